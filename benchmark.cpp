@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+#include "exprparser.hpp"
+#include "exprjit.hpp"
+#include "exprfile.hpp"
+#include "expredit.hpp"
+#include "exprcontext.hpp"
+#include "threadpool.hpp"
+#include "math_kernels.hh"
+#include "test-cases.hpp"
+
+using namespace std;
+
+/* Microbenchmarks for parsing, compiling and evaluating expressions.
+
+   Usage: benchmark [--json] [--reps N] [--rows N] [--min-time MS] [--filter TEXT]
+
+   Every benchmark is calibrated to run for at least --min-time per repetition, is
+   run once untimed to warm caches and the branch predictors, then timed --reps
+   times. Times are reported in nanoseconds per operation: per expression for
+   parse, edit, load, compile and scalar evaluation, and per row and expression for batches.
+   The corpus is the expressions of parse-test plus generated expressions of a
+   fixed size, built from a fixed seed so runs compare across builds. */
+
+struct BenchmarkOptions {
+    bool json = false;
+    int reps = 7;
+    size_t rows = 4096;
+    double min_time_ns = 20e6;
+    string filter;
+};
+
+struct BenchmarkResult {
+    string name;
+    size_t iterations;
+    size_t ops_per_iteration;
+    vector<double> ns_per_op;
+};
+
+struct Corpus {
+    string name;
+    vector<string> expressions;
+};
+
+/* Results are summed here so the compiler cannot drop the work being timed. */
+volatile double benchmark_sink;
+
+typedef chrono::steady_clock benchmark_clock;
+
+template <class Body>
+double time_iterations(Body& body, size_t iterations) {
+    double sum = 0;
+    benchmark_clock::time_point start = benchmark_clock::now();
+    for (size_t i=0; i<iterations; i++) {
+        sum += body();
+    }
+    benchmark_clock::time_point end = benchmark_clock::now();
+    benchmark_sink = sum;
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end-start).count();
+}
+
+/* body() does ops_per_iteration operations and returns something derived from them. */
+template <class Body>
+void run_benchmark(const BenchmarkOptions& options, vector<BenchmarkResult>& results,
+                   const string& name, size_t ops_per_iteration, Body body) {
+    if (!options.filter.empty() && name.find(options.filter)==string::npos) {
+        return;
+    }
+    size_t iterations = 1;
+    while (time_iterations(body, iterations)<options.min_time_ns && iterations<(size_t(1) << 30)) {
+        iterations *= 2;
+    }
+    time_iterations(body, iterations);
+    BenchmarkResult result{name, iterations, ops_per_iteration, {}};
+    for (int rep=0; rep<options.reps; rep++) {
+        result.ns_per_op.push_back(time_iterations(body, iterations) / (iterations*ops_per_iteration));
+    }
+    results.push_back(result);
+    if (!options.json) {
+        vector<double> sorted = result.ns_per_op;
+        sort(sorted.begin(), sorted.end());
+        cout << left << setw(36) << name << right << fixed << setprecision(1)
+             << setw(12) << sorted[sorted.size()/2] << " ns/op (min " << sorted.front() << ")\n";
+    }
+}
+
+/* Random expression with `operations` functions and operators over the variables
+   of test_variables. Only operations that stay finite for any input are used, and
+   E is left out because the lexer reads it as an exponent next to an operator. */
+string generate_expression(mt19937& random, int operations) {
+    static const char* VARIABLES[] = {"A", "B", "C", "D", "x", "y"};
+    static const char* BINARY_OPERATORS[] = {"+", "-", "*", "/"};
+    static const char* UNARY_FUNCTIONS[] = {"sin", "cos", "abs", "sqrt", "tanh", "fraction"};
+    static const char* BINARY_FUNCTIONS[] = {"min", "max", "mod"};
+    if (operations<=0) {
+        if (random()%4==0) {
+            return to_string(random()%100) + "." + to_string(random()%10);
+        }
+        return VARIABLES[random()%size(VARIABLES)];
+    }
+    unsigned kind = random()%8;
+    if (kind==0) {
+        return string(UNARY_FUNCTIONS[random()%size(UNARY_FUNCTIONS)]) + "("
+               + generate_expression(random, operations-1) + ")";
+    }
+    int left_operations = (int)(random()%operations);
+    string left = generate_expression(random, left_operations);
+    string right = generate_expression(random, operations-1-left_operations);
+    if (kind==1) {
+        return string(BINARY_FUNCTIONS[random()%size(BINARY_FUNCTIONS)]) + "(" + left + "," + right + ")";
+    }
+    return "(" + left + BINARY_OPERATORS[random()%size(BINARY_OPERATORS)] + right + ")";
+}
+
+vector<Corpus> make_corpora() {
+    vector<Corpus> corpora;
+    Corpus cases{"test_cases", {}};
+    for (auto entry: test_cases) {
+        cases.expressions.push_back(entry.first);
+    }
+    corpora.push_back(cases);
+    mt19937 random(20240917);
+    for (int operations: {16, 64, 256}) {
+        Corpus generated{"generated_" + to_string(operations), {}};
+        for (int i=0; i<8; i++) {
+            generated.expressions.push_back(generate_expression(random, operations));
+        }
+        corpora.push_back(generated);
+    }
+    return corpora;
+}
+
+void benchmark_corpus(const BenchmarkOptions& options, vector<BenchmarkResult>& results,
+                      const Corpus& corpus, ThreadPool& pool) {
+    const size_t count = corpus.expressions.size();
+    const size_t rows = options.rows;
+    vector<CompiledExpression> unoptimized;
+    vector<CompiledExpression> compiled;
+    for (const string& expression: corpus.expressions) {
+        ExpressionParser parser(expression.c_str());
+        parser.set_optimize(false);
+        unoptimized.push_back(parser.parse());
+        compiled.push_back(unoptimized.back().optimized());
+    }
+
+    /* Parsing alone, then the optimizer alone, then both as parse() does by default */
+    ExpressionParser parser;
+    parser.set_optimize(false);
+    run_benchmark(options, results, "parse/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (const string& expression: corpus.expressions) {
+            parser.set_expression(expression.c_str());
+            sum += parser.parse().get_program().size();
+        }
+        return sum;
+    });
+    run_benchmark(options, results, "optimize/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (const CompiledExpression& expression: unoptimized) {
+            sum += expression.optimized().get_program().size();
+        }
+        return sum;
+    });
+    ExpressionParser optimizing_parser;
+    run_benchmark(options, results, "parse_optimize/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (const string& expression: corpus.expressions) {
+            optimizing_parser.set_expression(expression.c_str());
+            sum += optimizing_parser.parse().get_program().size();
+        }
+        return sum;
+    });
+    /* Retyping one character in the middle of each expression, to compare with parse/ */
+    vector<ExpressionEditor> editors(count);
+    for (size_t i=0; i<count; i++) {
+        editors[i].set_optimize(false);
+        editors[i].set_text(corpus.expressions[i]);
+    }
+    run_benchmark(options, results, "edit/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (ExpressionEditor& editor: editors) {
+            size_t middle = editor.get_text().size()/2;
+            sum += editor.edit(middle, 1, editor.get_text().substr(middle, 1)).get_program().size();
+        }
+        return sum;
+    });
+    /* Loading the same programs from a program file in memory, checks included */
+    string program_file = ProgramFile::serialize(compiled);
+    run_benchmark(options, results, "load_file/" + corpus.name, count, [&]() {
+        ProgramFile file(program_file.data(), program_file.size(), nullptr);
+        return (double)file[0].get_program().size();
+    });
+    run_benchmark(options, results, "jit_compile/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (const CompiledExpression& expression: compiled) {
+            JitExpression jit(expression);
+            sum += jit.is_native();
+        }
+        return sum;
+    });
+
+    /* Scalar evaluation, through the name map and through bound slots */
+    vector<vector<float>> slot_values;
+    vector<vector<double>> precise_values;
+    vector<unique_ptr<JitExpression>> jits;
+    for (const CompiledExpression& expression: compiled) {
+        slot_values.push_back(expression.bind(test_variables));
+        precise_values.push_back(vector<double>(slot_values.back().begin(), slot_values.back().end()));
+        jits.push_back(make_unique<JitExpression>(expression));
+    }
+    run_benchmark(options, results, "evaluate_map/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (const CompiledExpression& expression: compiled) {
+            sum += expression.evaluate(test_variables);
+        }
+        return sum;
+    });
+    run_benchmark(options, results, "evaluate/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (size_t i=0; i<count; i++) {
+            sum += compiled[i].evaluate(slot_values[i].data());
+        }
+        return sum;
+    });
+    /* One variable changing between evaluations, to compare with evaluate/ */
+    vector<EvaluationContext> contexts;
+    for (size_t i=0; i<count; i++) {
+        contexts.emplace_back(compiled[i], slot_values[i].data());
+    }
+    float step = 0.0f;
+    run_benchmark(options, results, "evaluate_incremental/" + corpus.name, count, [&]() {
+        double sum = 0;
+        step += 0.5f;
+        for (EvaluationContext& context: contexts) {
+            if (context.get_expression().get_variables().size()>0) {
+                context.set_variable(0, step);
+            }
+            sum += context.evaluate();
+        }
+        return sum;
+    });
+    run_benchmark(options, results, "evaluate_double/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (size_t i=0; i<count; i++) {
+            sum += compiled[i].evaluate_as<double>(precise_values[i].data());
+        }
+        return sum;
+    });
+    run_benchmark(options, results, "evaluate_jit/" + corpus.name, count, [&]() {
+        double sum = 0;
+        for (size_t i=0; i<count; i++) {
+            sum += jits[i]->evaluate(slot_values[i].data());
+        }
+        return sum;
+    });
+
+    /* Batches: every variable gets a column of varying values */
+    mt19937 random(7);
+    uniform_real_distribution<float> distribution(-10.0f, 10.0f);
+    vector<vector<vector<float>>> column_data(count);
+    vector<vector<vector<double>>> precise_column_data(count);
+    vector<vector<const float*>> columns(count);
+    vector<vector<const double*>> precise_columns(count);
+    for (size_t i=0; i<count; i++) {
+        for (size_t slot=0; slot<compiled[i].get_variables().size(); slot++) {
+            vector<float> column(rows);
+            for (float& value: column) {
+                value = distribution(random);
+            }
+            precise_column_data[i].push_back(vector<double>(column.begin(), column.end()));
+            column_data[i].push_back(move(column));
+        }
+        for (const vector<float>& column: column_data[i]) {
+            columns[i].push_back(column.data());
+        }
+        for (const vector<double>& column: precise_column_data[i]) {
+            precise_columns[i].push_back(column.data());
+        }
+    }
+    vector<float> batch_results(rows);
+    vector<double> precise_batch_results(rows);
+    run_benchmark(options, results, "batch/" + corpus.name, count*rows, [&]() {
+        for (size_t i=0; i<count; i++) {
+            compiled[i].evaluate_batch(columns[i].data(), batch_results.data(), rows);
+        }
+        return batch_results[rows-1];
+    });
+    run_benchmark(options, results, "batch_double/" + corpus.name, count*rows, [&]() {
+        for (size_t i=0; i<count; i++) {
+            compiled[i].evaluate_batch_as<double>(precise_columns[i].data(), precise_batch_results.data(), rows);
+        }
+        return precise_batch_results[rows-1];
+    });
+    run_benchmark(options, results, "batch_jit/" + corpus.name, count*rows, [&]() {
+        for (size_t i=0; i<count; i++) {
+            jits[i]->evaluate_batch(columns[i].data(), batch_results.data(), rows);
+        }
+        return batch_results[rows-1];
+    });
+    run_benchmark(options, results, "batch_parallel/" + corpus.name, count*rows, [&]() {
+        for (size_t i=0; i<count; i++) {
+            compiled[i].evaluate_batch_parallel(columns[i].data(), batch_results.data(), rows, pool);
+        }
+        return batch_results[rows-1];
+    });
+}
+
+void print_json(const BenchmarkOptions& options, const vector<BenchmarkResult>& results, ThreadPool& pool) {
+    cout << "{\n";
+    cout << "  \"context\": {\n";
+#ifdef __VERSION__
+    cout << "    \"compiler\": \"" << __VERSION__ << "\",\n";
+#endif
+    cout << "    \"simd\": \"" << blender::nodes::get_math_kernel_isa() << "\",\n";
+    cout << "    \"threads\": " << pool.get_thread_count() << ",\n";
+    cout << "    \"reps\": " << options.reps << ",\n";
+    cout << "    \"rows\": " << options.rows << "\n";
+    cout << "  },\n";
+    cout << "  \"benchmarks\": [";
+    cout << setprecision(3) << fixed;
+    for (size_t i=0; i<results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        vector<double> sorted = result.ns_per_op;
+        sort(sorted.begin(), sorted.end());
+        double mean = 0;
+        for (double value: sorted) {
+            mean += value / sorted.size();
+        }
+        cout << (i==0 ? "\n" : ",\n");
+        cout << "    {\"name\": \"" << result.name << "\""
+             << ", \"iterations\": " << result.iterations
+             << ", \"ops_per_iteration\": " << result.ops_per_iteration
+             << ", \"median_ns_per_op\": " << sorted[sorted.size()/2]
+             << ", \"min_ns_per_op\": " << sorted.front()
+             << ", \"max_ns_per_op\": " << sorted.back()
+             << ", \"mean_ns_per_op\": " << mean
+             << ", \"samples\": [";
+        for (size_t rep=0; rep<result.ns_per_op.size(); rep++) {
+            cout << (rep==0 ? "" : ", ") << result.ns_per_op[rep];
+        }
+        cout << "]}";
+    }
+    cout << "\n  ]\n}\n";
+}
+
+int main(int argc, const char** argv) {
+    BenchmarkOptions options;
+    for (int i=1; i<argc; i++) {
+        bool has_value = i+1<argc;
+        if (strcmp(argv[i], "--json")==0) {
+            options.json = true;
+        } else if (strcmp(argv[i], "--reps")==0 && has_value) {
+            options.reps = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--rows")==0 && has_value) {
+            options.rows = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--min-time")==0 && has_value) {
+            options.min_time_ns = atof(argv[++i]) * 1e6;
+        } else if (strcmp(argv[i], "--filter")==0 && has_value) {
+            options.filter = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--json] [--reps N] [--rows N] [--min-time MS] [--filter TEXT]\n";
+            return 1;
+        }
+    }
+
+    ThreadPool pool;
+    vector<BenchmarkResult> results;
+    for (const Corpus& corpus: make_corpora()) {
+        benchmark_corpus(options, results, corpus, pool);
+    }
+    if (options.json) {
+        print_json(options, results, pool);
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "exprfile.hpp"
+
+using namespace std;
+
+/* Parses expressions ahead of time into a program file for ProgramFile to load.
+
+   Usage: compile-expressions [options] OUTPUT
+     --input FILE          read FILE instead of standard input
+     --no-optimize         keep the programs as parsed
+
+   The input has one expression per line; blank lines and lines starting with #
+   are skipped. Programs are stored in input order. */
+
+void print_usage(const char* program) {
+    cerr << "Usage: " << program << " [--input FILE] [--no-optimize] OUTPUT\n";
+}
+
+int main(int argc, const char** argv) {
+    string input_path;
+    string output_path;
+    bool optimize = true;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--input")==0 && i+1<argc) {
+            input_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-optimize")==0) {
+            optimize = false;
+        } else if (strncmp(argv[i], "--", 2)!=0 && output_path.empty()) {
+            output_path = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (output_path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    ifstream input_file;
+    if (!input_path.empty()) {
+        input_file.open(input_path);
+        if (!input_file) {
+            cerr << "Cannot open " << input_path << "\n";
+            return 1;
+        }
+    }
+    istream& input = input_path.empty() ? cin : input_file;
+
+    vector<CompiledExpression> programs;
+    ExpressionParser parser;
+    parser.set_optimize(optimize);
+    string line;
+    int line_number = 0;
+    int errors = 0;
+    while (getline(input, line)) {
+        line_number++;
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start==string::npos || line[start]=='#') {
+            continue;
+        }
+        line.erase(line.find_last_not_of(" \t\r")+1);
+        try {
+            parser.set_expression(line.c_str() + start);
+            programs.push_back(parser.parse());
+        } catch (const exception& e) {
+            cerr << "Line " << line_number << ": " << e.what() << "\n";
+            errors++;
+        }
+    }
+    if (errors>0) {
+        return 1;
+    }
+    try {
+        ProgramFile::write(output_path, programs);
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
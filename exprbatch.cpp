@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include "exprbatch.hpp"
+#include "threadpool.hpp"
+
+/* Expressions per pool task: parsing one takes microseconds, so a task of a
+   single expression would spend about as long being handed out as running. */
+static const size_t EXPRESSIONS_PER_TASK = 16;
+
+/* Calls work(begin, end) over [0, count), split into tasks on the pool if there is one. */
+static void run_tasks(size_t count, ThreadPool* pool, const function<void(size_t, size_t)>& work) {
+    if (!pool) {
+        work(0, count);
+        return;
+    }
+    size_t tasks = (count + EXPRESSIONS_PER_TASK-1) / EXPRESSIONS_PER_TASK;
+    pool->run(tasks, [&](size_t task) {
+        size_t begin = task * EXPRESSIONS_PER_TASK;
+        work(begin, min(count, begin + EXPRESSIONS_PER_TASK));
+    });
+}
+
+/* A constant is the same constant only if both its float and its double value are,
+   bit for bit: -0 is not 0, and the optimizer may fold a double that does not round
+   to the float it keeps beside it. */
+struct ConstantKey {
+    uint32_t value;
+    uint64_t precise_value;
+    bool operator==(const ConstantKey& other) const {
+        return value==other.value && precise_value==other.precise_value;
+    }
+};
+
+struct ConstantKeyHash {
+    size_t operator()(const ConstantKey& key) const {
+        return hash<uint64_t>()(key.precise_value ^ ((uint64_t)key.value << 17));
+    }
+};
+
+ExpressionBatch::ExpressionBatch(const vector<string>& expressions, ThreadPool* pool, bool optimize)
+    : errors(expressions.size()) {
+    /* Each expression is compiled on its own first, with a parser per task so the
+       parsers' buffers are reused within a task and never shared between threads. */
+    vector<CompiledExpression> compiled(expressions.size());
+    run_tasks(expressions.size(), pool, [&](size_t begin, size_t end) {
+        ExpressionParser parser;
+        parser.set_optimize(optimize);
+        for (size_t i=begin; i<end; i++) {
+            try {
+                parser.set_expression(expressions[i].c_str());
+                compiled[i] = parser.parse();
+            } catch (const exception& error) {
+                errors[i] = error.what();
+            }
+        }
+    });
+
+    /* Then their variables and constants are numbered into the batch's tables, in
+       expression order so the numbering does not depend on the thread count. */
+    vector<string> names;
+    vector<float> pool_constants;
+    vector<double> pool_precise_constants;
+    unordered_map<ConstantKey, int, ConstantKeyHash> constant_slots;
+    vector<vector<int>> slot_maps(expressions.size());
+    vector<vector<int>> constant_maps(expressions.size());
+    for (size_t i=0; i<expressions.size(); i++) {
+        if (!errors[i].empty()) {
+            error_count++;
+            continue;
+        }
+        for (const string& name: compiled[i].get_variables()) {
+            auto inserted = slots.emplace(name, (int)names.size());
+            if (inserted.second) {
+                names.push_back(name);
+            }
+            slot_maps[i].push_back(inserted.first->second);
+        }
+        const SharedArray<float>& local_constants = compiled[i].get_constants();
+        const SharedArray<double>& local_precise_constants = compiled[i].get_precise_constants();
+        for (size_t constant=0; constant<local_constants.size(); constant++) {
+            ConstantKey key;
+            memcpy(&key.value, &local_constants[constant], sizeof(key.value));
+            memcpy(&key.precise_value, &local_precise_constants[constant], sizeof(key.precise_value));
+            auto inserted = constant_slots.emplace(key, (int)pool_constants.size());
+            if (inserted.second) {
+                pool_constants.push_back(local_constants[constant]);
+                pool_precise_constants.push_back(local_precise_constants[constant]);
+            }
+            constant_maps[i].push_back(inserted.first->second);
+        }
+    }
+    variables = make_shared<const vector<string>>(move(names));
+    constants = SharedArray<float>(move(pool_constants));
+    precise_constants = SharedArray<double>(move(pool_precise_constants));
+
+    /* Finally every program is rewritten to read the shared tables. */
+    programs.resize(expressions.size());
+    run_tasks(expressions.size(), pool, [&](size_t begin, size_t end) {
+        for (size_t i=begin; i<end; i++) {
+            const CompiledExpression& local = compiled[i];
+            vector<Instruction> program(local.get_program().begin(), local.get_program().end());
+            for (Instruction& instruction: program) {
+                if (instruction.kind==INSTRUCTION_VARIABLE) {
+                    instruction.index = slot_maps[i][instruction.index];
+                } else if (instruction.kind==INSTRUCTION_CONSTANT) {
+                    instruction.index = constant_maps[i][instruction.index];
+                }
+            }
+            programs[i] = CompiledExpression(expressions[i], SharedArray<Instruction>(move(program)),
+                                             constants, precise_constants, variables, local.get_stack_depth(),
+                                             local.get_temp_count(), local.get_result_count());
+        }
+    });
+}
+
+size_t ExpressionBatch::size() const {
+    return programs.size();
+}
+
+const CompiledExpression& ExpressionBatch::operator[](size_t index) const {
+    return programs[index];
+}
+
+const vector<CompiledExpression>& ExpressionBatch::get_programs() const {
+    return programs;
+}
+
+const string& ExpressionBatch::get_error(size_t index) const {
+    return errors[index];
+}
+
+size_t ExpressionBatch::get_error_count() const {
+    return error_count;
+}
+
+const vector<string>& ExpressionBatch::get_variables() const {
+    return *variables;
+}
+
+int ExpressionBatch::get_slot(const string& name) const {
+    auto search = slots.find(name);
+    return search==slots.end() ? -1 : search->second;
+}
+
+const SharedArray<float>& ExpressionBatch::get_constants() const {
+    return constants;
+}
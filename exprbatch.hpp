@@ -0,0 +1,37 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "exprparser.hpp"
+
+class ThreadPool;
+
+/* Many expressions compiled at once, for loading a large rule set.
+   Every program of the batch uses the same table of variable slots, numbered in
+   order of first use over the whole batch, so one array of values (or one set of
+   columns) evaluates all of them. They also share one constant pool, with each
+   distinct constant stored once. Parsing runs on the pool's threads when one is
+   given; an expression that does not parse gets an empty program and an error
+   message, and the rest of the batch compiles as usual. */
+class ExpressionBatch {
+    public:
+    ExpressionBatch(const vector<string>& expressions, ThreadPool* pool = nullptr, bool optimize = true);
+    size_t size() const;
+    const CompiledExpression& operator[](size_t index) const;
+    const vector<CompiledExpression>& get_programs() const;
+    /* Why expression index did not compile; empty if it did. */
+    const string& get_error(size_t index) const;
+    size_t get_error_count() const;
+    const vector<string>& get_variables() const;
+    /* -1 if no expression of the batch uses the variable. */
+    int get_slot(const string& name) const;
+    const SharedArray<float>& get_constants() const;
+    private:
+    vector<CompiledExpression> programs;
+    vector<string> errors;
+    size_t error_count = 0;
+    shared_ptr<const vector<string>> variables;
+    unordered_map<string, int> slots;
+    SharedArray<float> constants;
+    SharedArray<double> precise_constants;
+};
@@ -0,0 +1,115 @@
+#include "exprcache.hpp"
+
+ExpressionCache::ExpressionCache(size_t memory_limit) : memory_limit(memory_limit) {}
+
+static bool is_space(char character) {
+    return character==' ' || character=='\t';
+}
+
+/* Characters the lexer splits tokens at anyway, so whitespace next to them is noise. */
+static bool is_separator(char character) {
+    return character=='\0' || string_view("()^%/*-+,").find(character)!=string_view::npos;
+}
+
+/* After an 'E', or an 'E' and an operator, whitespace is what stops the lexer
+   reading on as an exponent ("1E -1" is not "1E-1"), so it has to stay. */
+static bool ends_in_exponent(const string& text) {
+    size_t size = text.size();
+    return (size>=1 && text[size-1]=='E') || (size>=2 && text[size-2]=='E' && is_separator(text[size-1]));
+}
+
+string ExpressionCache::normalize(const char* expression) {
+    string normalized;
+    for (const char* c=expression; *c!='\0'; c++) {
+        if (!is_space(*c)) {
+            normalized += *c;
+            continue;
+        }
+        while (is_space(c[1])) {
+            c++;
+        }
+        /* Leading whitespace stays too: the lexer only treats an operator at offset 0
+           as a prefix, so " +y" and "+y" differ. */
+        if (c[1]!='\0' && (normalized.empty() || (!is_separator(normalized.back()) && !is_separator(c[1]))
+                           || ends_in_exponent(normalized))) {
+            normalized += ' ';
+        }
+    }
+    return normalized;
+}
+
+shared_ptr<const CompiledExpression> ExpressionCache::get(const char* expression) {
+    string key = normalize(expression);
+    {
+        lock_guard<mutex> guard(lock);
+        auto search = entries.find(key);
+        if (search!=entries.end()) {
+            recency.splice(recency.begin(), recency, search->second.position);
+            hits++;
+            return search->second.compiled;
+        }
+    }
+    misses++;
+    /* Parse outside the lock so a slow parse does not hold up hits on other
+       expressions; two threads missing on the same text both parse it, and the
+       first to finish gets cached. */
+    ExpressionParser parser(key.c_str());
+    shared_ptr<const CompiledExpression> compiled = make_shared<CompiledExpression>(parser.parse());
+    size_t memory = compiled->get_memory_size() + sizeof(Entry) + key.capacity() + sizeof(key);
+    if (memory>memory_limit) {
+        return compiled;
+    }
+    lock_guard<mutex> guard(lock);
+    auto inserted = entries.emplace(move(key), Entry{compiled, memory, {}});
+    if (!inserted.second) {
+        return inserted.first->second.compiled;
+    }
+    recency.push_front(&inserted.first->first);
+    inserted.first->second.position = recency.begin();
+    memory_used += memory;
+    evict_to(memory_limit);
+    return compiled;
+}
+
+void ExpressionCache::evict_to(size_t limit) {
+    while (memory_used>limit && !recency.empty()) {
+        auto oldest = entries.find(*recency.back());
+        memory_used -= oldest->second.memory;
+        recency.pop_back();
+        entries.erase(oldest);
+        evictions++;
+    }
+}
+
+void ExpressionCache::clear() {
+    lock_guard<mutex> guard(lock);
+    recency.clear();
+    entries.clear();
+    memory_used = 0;
+}
+
+size_t ExpressionCache::size() {
+    lock_guard<mutex> guard(lock);
+    return entries.size();
+}
+
+size_t ExpressionCache::get_memory_used() {
+    lock_guard<mutex> guard(lock);
+    return memory_used;
+}
+
+size_t ExpressionCache::get_memory_limit() const {
+    return memory_limit;
+}
+
+size_t ExpressionCache::get_hits() const {
+    return hits;
+}
+
+size_t ExpressionCache::get_misses() const {
+    return misses;
+}
+
+size_t ExpressionCache::get_evictions() const {
+    return evictions;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "exprparser.hpp"
+
+/* Thread-safe cache of compiled expressions, keyed by normalized expression text.
+   get() parses on a miss and otherwise hands out the program parsed earlier; the
+   programs are immutable, so callers may keep and evaluate them concurrently, and
+   an evicted program lives on for as long as someone still holds it.
+   Once the estimated memory of the cached programs passes memory_limit, the least
+   recently used ones are evicted. */
+class ExpressionCache {
+    public:
+    ExpressionCache(size_t memory_limit = 1 << 20);
+    /* Throws invalid_argument, like ExpressionParser::parse(), for an invalid
+       expression. Failures are not cached. */
+    shared_ptr<const CompiledExpression> get(const char* expression);
+    void clear();
+    size_t size();
+    size_t get_memory_used();
+    size_t get_memory_limit() const;
+    size_t get_hits() const;
+    size_t get_misses() const;
+    size_t get_evictions() const;
+    /* Removes whitespace that cannot change how the text tokenizes: runs become at
+       most one space, kept only where it separates two tokens. */
+    static string normalize(const char* expression);
+    private:
+    struct Entry {
+        shared_ptr<const CompiledExpression> compiled;
+        size_t memory;
+        list<const string*>::iterator position;
+    };
+    void evict_to(size_t memory_limit);
+    const size_t memory_limit;
+    mutex lock;
+    unordered_map<string, Entry> entries;
+    /* Keys of `entries`, most recently used first. */
+    list<const string*> recency;
+    size_t memory_used = 0;
+    atomic<size_t> hits{0};
+    atomic<size_t> misses{0};
+    atomic<size_t> evictions{0};
+};
@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "exprcontext.hpp"
+#include "exprfunctions.hpp"
+#include "math_functions_generic.hh"
+
+static bool same_bits(float a, float b) {
+    return memcmp(&a, &b, sizeof(float))==0;
+}
+
+EvaluationContext::EvaluationContext(CompiledExpression compiled, const float* initial_values)
+    : expression(move(compiled)) {
+    const SharedArray<Instruction>& program = expression.get_program();
+    const SharedArray<float>& constants = expression.get_constants();
+    size_t slot_count = expression.get_variables().size();
+    values.resize(program.size());
+    operands.resize(program.size() * MAX_FUNCTION_ARITY);
+    changed.resize(program.size());
+    result_nodes.assign(expression.get_result_count(), -1);
+    variable_values.assign(slot_count, 0.0f);
+    if (initial_values) {
+        copy(initial_values, initial_values + slot_count, variable_values.begin());
+    }
+    slot_nodes.resize(slot_count);
+    dependents.resize(slot_count);
+    slot_dirty.resize(slot_count);
+
+    /* Which nodes feed each operation is found by running the stack on node indices,
+       as in evaluate_batch_gradient(), along with the operations using each node. */
+    vector<int> node_stack(expression.get_stack_depth());
+    vector<int> temp_nodes(expression.get_temp_count());
+    vector<vector<int>> users(program.size());
+    int top = 0;
+    for (size_t i=0; i<program.size(); i++) {
+        const Instruction& instruction = program[i];
+        switch (instruction.kind) {
+            case INSTRUCTION_CONSTANT:
+                node_stack[top++] = i;
+                values[i] = constants[instruction.index];
+                node_count++;
+                break;
+            case INSTRUCTION_VARIABLE:
+                node_stack[top++] = i;
+                values[i] = variable_values[instruction.index];
+                slot_nodes[instruction.index].push_back(i);
+                node_count++;
+                break;
+            case INSTRUCTION_LOAD_TEMP:
+                node_stack[top++] = temp_nodes[instruction.index];
+                break;
+            case INSTRUCTION_STORE_TEMP:
+                temp_nodes[instruction.index] = node_stack[top-1];
+                break;
+            case INSTRUCTION_STORE_RESULT:
+                result_nodes[instruction.index] = node_stack[--top];
+                break;
+            case INSTRUCTION_OPERATION:
+            case INSTRUCTION_CALL:
+                top -= instruction.arity;
+                for (int k=0; k<instruction.arity; k++) {
+                    operands[i*MAX_FUNCTION_ARITY + k] = node_stack[top + k];
+                    users[node_stack[top + k]].push_back(i);
+                }
+                node_stack[top++] = i;
+                compute(i);
+                node_count++;
+                recomputed++;
+                break;
+        }
+    }
+    /* A single value left on the stack is the result, as in evaluate_all(). */
+    if (top==1 && !result_nodes.empty()) {
+        result_nodes[0] = node_stack[0];
+    }
+    total_recomputed = recomputed;
+
+    /* The operations reachable from a slot's variables, each found once per slot. */
+    vector<unsigned> visited(program.size());
+    vector<int> work;
+    for (size_t slot=0; slot<slot_count; slot++) {
+        work = slot_nodes[slot];
+        while (!work.empty()) {
+            int node = work.back();
+            work.pop_back();
+            for (int user: users[node]) {
+                if (visited[user]!=slot+1) {
+                    visited[user] = slot+1;
+                    dependents[slot].push_back(user);
+                    work.push_back(user);
+                }
+            }
+        }
+        sort(dependents[slot].begin(), dependents[slot].end());
+    }
+}
+
+void EvaluationContext::compute(int node) {
+    const Instruction& instruction = expression.get_program()[node];
+    const int *args = &operands[node*MAX_FUNCTION_ARITY];
+    float result = 0.0f;
+    if (instruction.kind==INSTRUCTION_CALL) {
+        const RegisteredFunction& function = FunctionRegistry::get(instruction.index);
+        float call_args[MAX_FUNCTION_ARITY];
+        for (int k=0; k<instruction.arity; k++) {
+            call_args[k] = values[args[k]];
+        }
+        result = function.call(function.state, call_args);
+    } else if (instruction.arity==1) {
+        float x = values[args[0]];
+        blender::nodes::try_dispatch_float_math_fl_to_fl(
+            instruction.operation, [&](auto math_function) {
+                result = math_function(x);
+            });
+    } else if (instruction.arity==2) {
+        float x = values[args[0]];
+        float y = values[args[1]];
+        blender::nodes::try_dispatch_float_math_fl_fl_to_fl(
+            instruction.operation, [&](auto math_function) {
+                result = math_function(x, y);
+            });
+    } else {
+        float x = values[args[0]];
+        float y = values[args[1]];
+        float z = values[args[2]];
+        blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(
+            instruction.operation, [&](auto math_function) {
+                result = math_function(x, y, z);
+            });
+    }
+    values[node] = result;
+}
+
+void EvaluationContext::set_variable(int slot, float value) {
+    if (slot<0 || (size_t)slot>=variable_values.size()) {
+        throw invalid_argument("No variable slot " + to_string(slot) + " in: " + expression.get_source());
+    }
+    if (same_bits(variable_values[slot], value)) {
+        return;
+    }
+    variable_values[slot] = value;
+    if (!slot_dirty[slot]) {
+        slot_dirty[slot] = true;
+        dirty_slots.push_back(slot);
+    }
+}
+
+void EvaluationContext::set_variable(const string& name, float value) {
+    int slot = expression.get_slot(name);
+    if (slot<0) {
+        throw invalid_argument("No variable " + name + " in: " + expression.get_source());
+    }
+    set_variable(slot, value);
+}
+
+void EvaluationContext::set_variables(const float* new_values) {
+    for (size_t slot=0; slot<variable_values.size(); slot++) {
+        set_variable(slot, new_values[slot]);
+    }
+}
+
+float EvaluationContext::get_variable(int slot) const {
+    return variable_values.at(slot);
+}
+
+void EvaluationContext::refresh() {
+    recomputed = 0;
+    if (dirty_slots.empty()) {
+        return;
+    }
+    if (++stamp==0) {
+        fill(changed.begin(), changed.end(), 0);
+        stamp = 1;
+    }
+    for (int slot: dirty_slots) {
+        slot_dirty[slot] = false;
+        for (int node: slot_nodes[slot]) {
+            if (!same_bits(values[node], variable_values[slot])) {
+                values[node] = variable_values[slot];
+                changed[node] = stamp;
+            }
+        }
+    }
+    /* Only the operations depending on a changed slot are looked at, in program
+       order so operands are always up to date; one whose operands all came out
+       the same as before keeps its value and does not count as changed either. */
+    const vector<int>* order = &dependents[dirty_slots[0]];
+    if (dirty_slots.size()>1) {
+        pending.clear();
+        for (int slot: dirty_slots) {
+            pending.insert(pending.end(), dependents[slot].begin(), dependents[slot].end());
+        }
+        sort(pending.begin(), pending.end());
+        pending.erase(unique(pending.begin(), pending.end()), pending.end());
+        order = &pending;
+    }
+    dirty_slots.clear();
+    const SharedArray<Instruction>& program = expression.get_program();
+    for (int node: *order) {
+        const int *args = &operands[node*MAX_FUNCTION_ARITY];
+        bool inputs_changed = false;
+        for (int k=0; k<program[node].arity; k++) {
+            inputs_changed |= changed[args[k]]==stamp;
+        }
+        if (!inputs_changed) {
+            continue;
+        }
+        float previous = values[node];
+        compute(node);
+        recomputed++;
+        if (!same_bits(previous, values[node])) {
+            changed[node] = stamp;
+        }
+    }
+    total_recomputed += recomputed;
+}
+
+float EvaluationContext::evaluate() {
+    return get_result(0);
+}
+
+float EvaluationContext::get_result(int result) {
+    if (result<0 || (size_t)result>=result_nodes.size()) {
+        throw invalid_argument("No result " + to_string(result) + " in: " + expression.get_source());
+    }
+    refresh();
+    return result_nodes[result]<0 ? 0.0f : values[result_nodes[result]];
+}
+
+size_t EvaluationContext::get_recomputed_count() const {
+    return recomputed;
+}
+
+size_t EvaluationContext::get_total_recomputed_count() const {
+    return total_recomputed;
+}
+
+size_t EvaluationContext::get_node_count() const {
+    return node_count;
+}
+
+const CompiledExpression& EvaluationContext::get_expression() const {
+    return expression;
+}
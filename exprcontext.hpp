@@ -0,0 +1,58 @@
+#pragma once
+
+#include "exprparser.hpp"
+
+/* A program with variable values that change a few at a time, such as the state
+   of a simulation step. It keeps the value of every node (every constant, variable
+   and operation of the program) from the last evaluation, and knows which
+   operations depend on each variable slot. After set_variable(), the next result
+   recomputes only the operations that depend on a changed slot, in program order,
+   and of those only the ones with an operand that actually came out different;
+   the results are the ones evaluate_all() gives for the same values. A registered
+   function is called again only when one of its arguments changes, pure or not.
+   Not thread-safe: each thread needs its own context, though they can share the program. */
+class EvaluationContext {
+    public:
+    /* values holds one value per variable slot; without it every variable starts at 0. */
+    EvaluationContext(CompiledExpression expression, const float* values = nullptr);
+    void set_variable(int slot, float value);
+    /* invalid_argument if the program has no such variable. */
+    void set_variable(const string& name, float value);
+    /* Sets every slot, recomputing only the operations whose inputs changed. */
+    void set_variables(const float* values);
+    float get_variable(int slot) const;
+    /* get_result(0) */
+    float evaluate();
+    /* The result with the current values; invalid_argument if there is no such result. */
+    float get_result(int result);
+    /* Operations recomputed by the last refresh, and over the context's lifetime,
+       the first full evaluation included. */
+    size_t get_recomputed_count() const;
+    size_t get_total_recomputed_count() const;
+    /* Constants, variables and operations of the program. */
+    size_t get_node_count() const;
+    const CompiledExpression& get_expression() const;
+    private:
+    void refresh();
+    void compute(int node);
+    CompiledExpression expression;
+    /* Per instruction: its value and, for an operation, the nodes of its operands.
+       Instructions that compute nothing (temporaries, results) are not nodes. */
+    vector<float> values;
+    vector<int> operands;
+    vector<int> result_nodes;
+    vector<float> variable_values;
+    /* The VARIABLE instructions of each slot, and the operations depending on it,
+       both in program order. */
+    vector<vector<int>> slot_nodes;
+    vector<vector<int>> dependents;
+    vector<int> dirty_slots;
+    vector<bool> slot_dirty;
+    /* changed[node]==stamp if the node's value changed in the current refresh. */
+    vector<unsigned> changed;
+    unsigned stamp = 0;
+    vector<int> pending;
+    size_t node_count = 0;
+    size_t recomputed = 0;
+    size_t total_recomputed = 0;
+};
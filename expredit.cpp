@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "expredit.hpp"
+
+ExpressionEditor::ExpressionEditor() {}
+
+void ExpressionEditor::set_optimize(bool optimize) {
+    this->optimize = optimize;
+}
+
+const string& ExpressionEditor::get_text() const {
+    return text;
+}
+
+CompiledExpression ExpressionEditor::set_text(string text) {
+    if (text.find('\0')!=string::npos) {
+        throw invalid_argument("Expression text contains a NUL character");
+    }
+    this->text = move(text);
+    tokens.clear();
+    edit_count++;
+    int first_new;
+    int last_new;
+    lex(0, 0, this->text.size(), first_new, last_new);
+    groups_valid = build_all();
+    return compile();
+}
+
+CompiledExpression ExpressionEditor::edit(size_t offset, size_t removed, string_view inserted) {
+    if (offset>text.size() || removed>text.size()-offset) {
+        throw invalid_argument("Edit outside the expression");
+    }
+    if (inserted.find('\0')!=string_view::npos) {
+        throw invalid_argument("Expression text contains a NUL character");
+    }
+    text.replace(offset, removed, inserted.data(), inserted.size());
+    edit_count++;
+    int first_new;
+    int last_new;
+    lex(offset, removed, inserted.size(), first_new, last_new);
+    if (groups_valid) {
+        /* The innermost group around all the new tokens is built again. If its closing
+           parenthesis is no longer the one it was, the edit changed which ones match. */
+        int open = enclosing_group(first_new);
+        while (open>=0 && tokens[open].partner>=0 && tokens[open].partner<last_new-1) {
+            open = enclosing_group(open);
+        }
+        int group = open<0 ? root : tokens[open].group;
+        int expected_close = open<0 ? tokens.size() : tokens[open].partner;
+        replaced_groups.clear();
+        child_opens.clear();
+        int close = build_group(open, group, first_new, last_new);
+        groups_valid = close>=0 && close==expected_close;
+        if (groups_valid) {
+            for (int replaced: replaced_groups) {
+                free_group(replaced);
+            }
+        }
+    }
+    if (!groups_valid) {
+        groups_valid = build_all();
+    }
+    return compile();
+}
+
+/* Reads the tokens again from the one the edit may have changed up to the first one
+   past it that cannot have changed, and puts them in place of the old ones there.
+   Whether a token ends at a character depends on that character and the two before
+   it, and how a token is read on its text and the character before it; so from two
+   characters after the inserted text on, the same tokens as before follow. */
+void ExpressionEditor::lex(size_t offset, size_t removed, size_t inserted, int& first_new, int& last_new) {
+    parser.expression = text.c_str();
+    parser.arena.reset();
+    int char_delta = (int)inserted - (int)removed;
+    int edit_end = offset + inserted;
+    int first = partition_point(tokens.begin(), tokens.end(),
+                                [&](const EditorToken& token) { return token.end<(int)offset; }) - tokens.begin();
+    int last = tokens.size();
+    int start = first>0 ? tokens[first-1].end : 0;
+    char last_printable_char = first>0 ? text[start-1] : '\0';
+    char printable_before_token = last_printable_char;
+    char previous_char = start>0 ? text[start-1] : '\0';
+    char before_previous_char = start>1 ? text[start-2] : '\0';
+    int token_start = start;
+    int token_boundary = start;
+    lexed.clear();
+    for (int i=start; ; i++) {
+        char current_char = text.c_str()[i];
+        bool is_space = current_char==' ' || current_char=='\t';
+        if (current_char=='\0' || ExpressionParser::is_token_boundary(before_previous_char, previous_char, current_char)) {
+            if (token_start<i) {
+                lexed.push_back(read(token_start, i, printable_before_token));
+                if (token_boundary>=edit_end+2) {
+                    int old = first;
+                    while (old<(int)tokens.size() && tokens[old].start<token_start-char_delta) {
+                        old++;
+                    }
+                    if (old<(int)tokens.size() && tokens[old].start==token_start-char_delta) {
+                        last = old+1;
+                        break;
+                    }
+                }
+            }
+            if (current_char=='\0') {
+                break;
+            }
+            token_start = is_space ? i+1 : i;
+            token_boundary = i;
+            printable_before_token = last_printable_char;
+        }
+        if (!is_space) {
+            last_printable_char = current_char;
+        }
+        before_previous_char = previous_char;
+        previous_char = current_char;
+    }
+
+    /* A parenthesis read again where it was still matches the one it did. */
+    int token_delta = (int)lexed.size() - (last-first);
+    auto move_partner = [&](int i) {
+        EditorToken& token = tokens[i];
+        if (token.partner>=last) {
+            token.partner += token_delta;
+        } else if (token.partner>=first) {
+            const EditorToken& old_partner = tokens[token.partner];
+            token.partner = -1;
+            for (int relexed=0; old_partner.start>=(int)(offset+removed) && relexed<(int)lexed.size(); relexed++) {
+                if (lexed[relexed].start==old_partner.start+char_delta && lexed[relexed].paren==old_partner.paren) {
+                    token.partner = first+relexed;
+                    lexed[relexed].partner = i<first ? i : i+token_delta;
+                }
+            }
+        }
+    };
+    for (int i=0; i<first; i++) {
+        move_partner(i);
+    }
+    for (int i=last; i<(int)tokens.size(); i++) {
+        move_partner(i);
+        tokens[i].start += char_delta;
+        tokens[i].end += char_delta;
+    }
+    tokens.erase(tokens.begin()+first, tokens.begin()+last);
+    tokens.insert(tokens.begin()+first, lexed.begin(), lexed.end());
+    first_new = first;
+    last_new = first + lexed.size();
+}
+
+ExpressionEditor::EditorToken ExpressionEditor::read(int start, int end, char previous_char) {
+    EditorToken token = {};
+    token.start = start;
+    token.end = end;
+    token.partner = -1;
+    token.group = -1;
+    Expression_Token* read = parser.read_token(start, end, previous_char);
+    token.valid = read!=nullptr;
+    if (!read) {
+        return token;
+    }
+    token.type = read->type;
+    if (read->type==TOKEN_NUMBER) {
+        NumberToken* number = static_cast<NumberToken*>(read);
+        token.value = number->value;
+        token.precise_value = number->precise_value;
+    } else if (read->type==TOKEN_VARIABLE) {
+        auto inserted = name_ids.emplace(string(read->text), names.size());
+        if (inserted.second) {
+            names.push_back(string(read->text));
+        }
+        token.name = inserted.first->second;
+    } else {
+        OperationToken* operation = static_cast<OperationToken*>(read);
+        token.is_prefix = operation->is_prefix;
+        token.is_function = operation->is_function;
+        token.no_of_params = operation->no_of_params;
+        token.operation = operation->operation;
+        token.function = operation->function;
+        token.dropped = operation->text=="|";
+        if (operation->text=="(" || operation->text==")") {
+            token.paren = operation->text[0];
+        }
+        if (operation->text.data()<text.data() || operation->text.data()>=text.data()+text.size()) {
+            token.renamed = operation->text;
+        }
+    }
+    return token;
+}
+
+/* The '(' of the innermost group around token, or -1 for the whole text. */
+int ExpressionEditor::enclosing_group(int token) {
+    int k = token-1;
+    while (k>=0) {
+        if (tokens[k].paren==')' && tokens[k].partner>=0) {
+            k = tokens[k].partner-1;
+        } else if (tokens[k].paren=='(') {
+            return k;
+        } else {
+            k--;
+        }
+    }
+    return -1;
+}
+
+int ExpressionEditor::new_group() {
+    int group;
+    if (!free_groups.empty()) {
+        group = free_groups.back();
+        free_groups.pop_back();
+    } else {
+        group = groups.size();
+        groups.push_back(Group());
+    }
+    groups[group].in_use = true;
+    return group;
+}
+
+void ExpressionEditor::free_group(int group) {
+    if (!groups[group].in_use || groups[group].confirmed==edit_count) {
+        return;
+    }
+    for (const pair<size_t, int>& child: groups[group].children) {
+        free_group(child.second);
+    }
+    groups[group].program.clear();
+    groups[group].constants.clear();
+    groups[group].precise_constants.clear();
+    groups[group].children.clear();
+    groups[group].in_use = false;
+    free_groups.push_back(group);
+}
+
+/* Builds the group opened at token open (-1: the whole text) and returns the index
+   of its closing parenthesis (the token count for the whole text), or -1 if it is
+   not closed or its tokens do not parse. Nested groups outside [first_new, last_new)
+   are kept as they are; first_new -1 builds every one. */
+int ExpressionEditor::build_group(int open, int group, int first_new, int last_new) {
+    /* Nested groups first, each one whole, since they all use the parser's stacks. */
+    for (const pair<size_t, int>& child: groups[group].children) {
+        replaced_groups.push_back(child.second);
+    }
+    groups[group].children.clear();
+    size_t first_child = child_opens.size();
+    int close = -1;
+    int k = open+1;
+    while (k<(int)tokens.size()) {
+        const EditorToken& token = tokens[k];
+        if (!token.valid) {
+            return -1;
+        }
+        if (token.paren==')' && open>=0) {
+            close = k;
+            break;
+        }
+        if (token.paren!='(') {
+            k++;
+            continue;
+        }
+        int child = token.group;
+        bool found = child>=0 && first_new>=0 && token.partner>=0
+            && (groups[child].confirmed==edit_count || token.partner<first_new || k>=last_new);
+        if (!found) {
+            if (child<0) {
+                child = new_group();
+                tokens[k].group = child;
+            }
+            int child_close = build_group(k, child, first_new, last_new);
+            if (child_close<0) {
+                return -1;
+            }
+            tokens[k].partner = child_close;
+            tokens[child_close].partner = k;
+        }
+        groups[child].confirmed = edit_count;
+        child_opens.push_back(k);
+        k = tokens[k].partner+1;
+    }
+    if (open<0) {
+        close = tokens.size();
+    } else if (close<0) {
+        return -1;
+    }
+
+    /* Then the shunting-yard over the group's own tokens, a nested group standing for
+       the part of the program it adds there. */
+    Group& built = groups[group];
+    built.program.clear();
+    built.constants.clear();
+    built.precise_constants.clear();
+    parser.arena.reset();
+    while (!parser.operation_stack.empty()) {
+        parser.operation_stack.pop();
+    }
+    while (!parser.output_queue_new.empty()) {
+        parser.output_queue_new.pop();
+    }
+    variable_names.clear();
+    size_t child = first_child;
+    /* A group's own parentheses too: a ',' or ')' pops down to the '(' where the
+       stack would otherwise be empty. */
+    int first = open<0 ? 0 : open;
+    int end = open<0 ? close : close+1;
+    for (k=first; k<end; k++) {
+        const EditorToken& token = tokens[k];
+        if (child<child_opens.size() && child_opens[child]==k) {
+            built.children.push_back(make_pair(parser.output_queue_new.size(), token.group));
+            k = token.partner;
+            child++;
+            continue;
+        }
+        if (token.dropped) {
+            continue;
+        }
+        string_view token_text = token.renamed.empty() ? string_view(text.data()+token.start, token.end-token.start)
+                                                       : token.renamed;
+        switch (token.type) {
+            case TOKEN_NUMBER:
+                parser.push_token(parser.arena.new_number(token_text, token.value, token.precise_value));
+                break;
+            case TOKEN_VARIABLE:
+                variable_names.push_back(token.name);
+                parser.push_token(parser.arena.new_variable(token_text));
+                break;
+            case TOKEN_OPERATION:
+                parser.push_token(parser.arena.new_operation(token_text, token.is_prefix, token.is_function,
+                                                             token.no_of_params, token.operation, token.function));
+                break;
+        }
+    }
+    while (!parser.operation_stack.empty()) {
+        parser.pop_operationstack_to_outqueue();
+    }
+    child_opens.resize(first_child);
+    /* Variables reach the output in the order they were pushed. */
+    size_t variable = 0;
+    while (!parser.output_queue_new.empty()) {
+        Expression_Token* token = parser.output_queue_new.front();
+        parser.output_queue_new.pop();
+        Instruction instruction;
+        instruction.arity = 0;
+        instruction.operation = 0;
+        if (token->type==TOKEN_VARIABLE) {
+            instruction.kind = INSTRUCTION_VARIABLE;
+            instruction.index = variable_names[variable++];
+        } else if (token->type==TOKEN_NUMBER) {
+            instruction.kind = INSTRUCTION_CONSTANT;
+            instruction.index = built.constants.size();
+            built.constants.push_back(static_cast<NumberToken*>(token)->value);
+            built.precise_constants.push_back(static_cast<NumberToken*>(token)->precise_value);
+        } else {
+            OperationToken* operation = static_cast<OperationToken*>(token);
+            if (operation->function>=0) {
+                instruction.kind = INSTRUCTION_CALL;
+                instruction.arity = operation->no_of_params;
+                instruction.index = operation->function;
+            } else if (operation->no_of_params<1 || operation->no_of_params>3) {
+                return -1;
+            } else {
+                instruction.kind = INSTRUCTION_OPERATION;
+                instruction.arity = operation->no_of_params;
+                instruction.operation = operation->operation;
+                instruction.index = 0;
+            }
+        }
+        built.program.push_back(instruction);
+    }
+    return close;
+}
+
+bool ExpressionEditor::build_all() {
+    groups.clear();
+    free_groups.clear();
+    for (EditorToken& token: tokens) {
+        token.group = -1;
+        token.partner = -1;
+    }
+    root = new_group();
+    replaced_groups.clear();
+    child_opens.clear();
+    return build_group(-1, root, -1, -1)>=0;
+}
+
+/* Appends the program of group and the groups nested in it, numbering variable slots
+   and constants in program order as ExpressionParser::parse() does. False if an
+   operation would be missing an operand. */
+bool ExpressionEditor::assemble(int group, vector<Instruction>& program, vector<float>& constants,
+                                vector<double>& precise_constants, vector<string>& variables,
+                                int& depth, int& max_depth) {
+    const Group& built = groups[group];
+    size_t child = 0;
+    for (size_t i=0; ; i++) {
+        while (child<built.children.size() && built.children[child].first==i) {
+            if (!assemble(built.children[child].second, program, constants, precise_constants, variables,
+                          depth, max_depth)) {
+                return false;
+            }
+            child++;
+        }
+        if (i==built.program.size()) {
+            return true;
+        }
+        Instruction instruction = built.program[i];
+        if (instruction.kind==INSTRUCTION_VARIABLE) {
+            int name = instruction.index;
+            if (slot_stamp[name]!=edit_count) {
+                slot_stamp[name] = edit_count;
+                slot_of_name[name] = variables.size();
+                variables.push_back(names[name]);
+            }
+            instruction.index = slot_of_name[name];
+            depth++;
+        } else if (instruction.kind==INSTRUCTION_CONSTANT) {
+            int constant = instruction.index;
+            instruction.index = constants.size();
+            constants.push_back(built.constants[constant]);
+            precise_constants.push_back(built.precise_constants[constant]);
+            depth++;
+        } else {
+            depth -= instruction.arity - 1;
+        }
+        if (depth<1) {
+            return false;
+        }
+        max_depth = max(max_depth, depth);
+        program.push_back(instruction);
+    }
+}
+
+CompiledExpression ExpressionEditor::compile() {
+    if (groups_valid) {
+        vector<Instruction> program;
+        vector<float> constants;
+        vector<double> precise_constants;
+        vector<string> variables;
+        program.reserve(tokens.size());
+        constants.reserve(tokens.size());
+        precise_constants.reserve(tokens.size());
+        slot_of_name.resize(names.size());
+        slot_stamp.resize(names.size());
+        int depth = 0;
+        int max_depth = 0;
+        if (assemble(root, program, constants, precise_constants, variables, depth, max_depth)) {
+            CompiledExpression compiled(text, move(program), move(constants), move(variables), max_depth,
+                                        0, 1, move(precise_constants));
+            return optimize ? compiled.optimized() : compiled;
+        }
+    }
+    /* Text that does not parse gets the parser's own error for it. */
+    parser.set_expression(text.c_str());
+    parser.set_optimize(optimize);
+    return parser.parse();
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "exprparser.hpp"
+
+/* Expression text that is edited in place, such as a formula being typed, and
+   parsed again after every edit. It gives the same program as ExpressionParser
+   gives for the whole text, but keeps the tokens and each parenthesized group's
+   part of the program between edits: an edit reads only the tokens it touched and
+   runs the shunting-yard only over the innermost group around them, reusing the
+   groups nested in it. An edit that changes which parentheses match, or follows
+   one that did not parse, runs it over all tokens (still without reading them).
+   Renumbering the slots and constants of the whole program stays linear, but is
+   a copy; so is the optimizer, so with set_optimize(false) an edit's cost follows
+   the edit and its group rather than the length of the text. */
+class ExpressionEditor {
+    public:
+    ExpressionEditor();
+    /* parse() optimizes the program it returns unless this is turned off. */
+    void set_optimize(bool optimize);
+    /* Replaces the whole text. Throws invalid_argument, like ExpressionParser::parse(),
+       if it does not parse; the text is set either way, and can be edited. */
+    CompiledExpression set_text(string text);
+    /* Replaces the removed characters at offset by inserted, and returns the program
+       for the new text, or throws like set_text() if it does not parse. Throws
+       invalid_argument without changing anything if the range is outside the text. */
+    CompiledExpression edit(size_t offset, size_t removed, string_view inserted);
+    const string& get_text() const;
+    private:
+    /* One token, as ExpressionParser::read_token() classified it. */
+    struct EditorToken {
+        int start;
+        int end;
+        bool valid;
+        /* '(' , a closing ')' or 0; partner is the token index of the matching
+           parenthesis, -1 while unmatched. */
+        char paren;
+        int partner;
+        /* For '(': the group it opens, -1 if none yet. */
+        int group;
+        TokenType type;
+        bool dropped;
+        bool is_prefix;
+        bool is_function;
+        short no_of_params;
+        NodeMathOperation operation;
+        /* Registered function id, -1 for a built-in operation. */
+        int function;
+        /* A name such as "neg" that the token was read as, instead of its text. */
+        string_view renamed;
+        float value;
+        double precise_value;
+        int name;
+    };
+    /* The part of the program for the tokens of one group, those of nested groups
+       excluded: variables are name ids and constants index the group's own pools. */
+    struct Group {
+        vector<Instruction> program;
+        vector<float> constants;
+        vector<double> precise_constants;
+        /* (position in program, group) of each nested group, in order. */
+        vector<pair<size_t, int>> children;
+        /* The last edit that found the group in place. */
+        unsigned confirmed = 0;
+        bool in_use = false;
+    };
+    void lex(size_t offset, size_t removed, size_t inserted, int& first_new, int& last_new);
+    EditorToken read(int start, int end, char previous_char);
+    int enclosing_group(int token);
+    int new_group();
+    void free_group(int group);
+    int build_group(int open, int group, int first_new, int last_new);
+    bool build_all();
+    bool assemble(int group, vector<Instruction>& program, vector<float>& constants,
+                  vector<double>& precise_constants, vector<string>& variables, int& depth, int& max_depth);
+    CompiledExpression compile();
+    ExpressionParser parser;
+    string text;
+    vector<EditorToken> tokens;
+    /* Scratch space, kept between edits: tokens read by lex(), the '(' of the
+       groups nested in those being built, and the name of each variable pushed. */
+    vector<EditorToken> lexed;
+    vector<int> child_opens;
+    vector<int> variable_names;
+    vector<Group> groups;
+    vector<int> free_groups;
+    /* Groups that were nested in a rebuilt group, freed after the edit unless found again. */
+    vector<int> replaced_groups;
+    int root = -1;
+    /* Whether groups describe the current tokens. */
+    bool groups_valid = false;
+    unsigned edit_count = 0;
+    vector<string> names;
+    unordered_map<string, int> name_ids;
+    vector<int> slot_of_name;
+    vector<unsigned> slot_stamp;
+    bool optimize = true;
+};
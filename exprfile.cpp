@@ -0,0 +1,416 @@
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+
+#include "exprfile.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[8] = {'E', 'X', 'P', 'R', 'P', 'R', 'O', 'G'};
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+const size_t ALIGNMENT = 8;
+
+struct FileHeader {
+    char magic[8];
+    /* Of every byte after this field */
+    uint64_t checksum;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t instruction_size;
+    uint32_t program_count;
+    uint64_t file_size;
+    uint64_t records_offset;
+};
+
+const size_t CHECKSUM_END = offsetof(FileHeader, checksum) + sizeof(uint64_t);
+
+struct ProgramRecord {
+    uint64_t source_offset;
+    uint64_t program_offset;
+    uint64_t constants_offset;
+    uint64_t precise_constants_offset;
+    uint64_t names_offset;
+    uint32_t source_length;
+    uint32_t instruction_count;
+    uint32_t constant_count;
+    uint32_t variable_count;
+    uint32_t names_length;
+    int32_t stack_depth;
+    int32_t temp_count;
+    int32_t result_count;
+};
+
+/* FNV-1a style, but a 64-bit word at a time in four independent lanes, with the
+   high bits folded back down after each step. Bytewise FNV-1a was most of the
+   time spent loading. */
+uint64_t checksum(const char* bytes, size_t size) {
+    const uint64_t PRIME = 1099511628211ull;
+    uint64_t lanes[4] = {14695981039346656037ull, 1, 2, 3};
+    size_t i = 0;
+    for (; i+sizeof(lanes)<=size; i+=sizeof(lanes)) {
+        for (int lane=0; lane<4; lane++) {
+            uint64_t word;
+            memcpy(&word, bytes + i + lane*sizeof(word), sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * PRIME;
+            lanes[lane] ^= lanes[lane] >> 32;
+        }
+    }
+    uint64_t hash = size;
+    for (int lane=0; lane<4; lane++) {
+        hash = (hash ^ lanes[lane]) * PRIME;
+    }
+    for (; i<size; i++) {
+        hash = (hash ^ (unsigned char)bytes[i]) * PRIME;
+    }
+    return hash;
+}
+
+/* Appends arrays at aligned offsets. */
+class FileBuilder {
+    public:
+    string bytes;
+    uint64_t append(const void* data, size_t size) {
+        bytes.resize((bytes.size() + ALIGNMENT-1) / ALIGNMENT * ALIGNMENT);
+        uint64_t offset = bytes.size();
+        bytes.append((const char*)data, size);
+        return offset;
+    }
+};
+
+[[noreturn]] void reject(const string& reason) {
+    throw invalid_argument("Invalid program file: " + reason);
+}
+
+/* Whether count items of item_size bytes at offset are inside the file and aligned for them. */
+void check_range(uint64_t offset, uint64_t count, size_t item_size, size_t size, const char* what) {
+    if (offset>size || count>(size-offset)/item_size || offset%min(item_size, ALIGNMENT)!=0) {
+        reject(string(what) + " out of bounds");
+    }
+}
+
+void check_range(uint64_t offset, uint64_t count, size_t item_size, size_t size, size_t program, const char* what) {
+    if (offset>size || count>(size-offset)/item_size || offset%min(item_size, ALIGNMENT)!=0) {
+        reject("program " + to_string(program) + " " + what + " out of bounds");
+    }
+}
+
+bool is_valid_operation(int arity, int operation) {
+    auto ignore = [](auto math_function) {};
+    switch (arity) {
+        case 1:
+            return blender::nodes::try_dispatch_float_math_fl_to_fl(operation, ignore);
+        case 2:
+            return blender::nodes::try_dispatch_float_math_fl_fl_to_fl(operation, ignore);
+        case 3:
+            return blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(operation, ignore);
+    }
+    return false;
+}
+
+/* The evaluators trust a program: every index must be in range, and the stack must
+   neither underflow nor grow past the depth they allocate for it. */
+void check_program(const ProgramRecord& record, const Instruction* program, size_t index) {
+    if (record.stack_depth<0 || record.temp_count<0 || record.result_count<1) {
+        reject("program " + to_string(index) + " has invalid sizes");
+    }
+    int top = 0;
+    int deepest = 0;
+    for (uint32_t i=0; i<record.instruction_count; i++) {
+        const Instruction& instruction = program[i];
+        bool valid = true;
+        switch (instruction.kind) {
+            case INSTRUCTION_CONSTANT:
+                valid = instruction.index>=0 && (uint32_t)instruction.index<record.constant_count;
+                top++;
+                break;
+            case INSTRUCTION_VARIABLE:
+                valid = instruction.index>=0 && (uint32_t)instruction.index<record.variable_count;
+                top++;
+                break;
+            case INSTRUCTION_LOAD_TEMP:
+                valid = instruction.index>=0 && instruction.index<record.temp_count;
+                top++;
+                break;
+            case INSTRUCTION_STORE_TEMP:
+                valid = instruction.index>=0 && instruction.index<record.temp_count && top>=1;
+                break;
+            case INSTRUCTION_STORE_RESULT:
+                valid = instruction.index>=0 && instruction.index<record.result_count && top>=1;
+                top--;
+                break;
+            case INSTRUCTION_OPERATION:
+                valid = top>=instruction.arity && is_valid_operation(instruction.arity, instruction.operation);
+                top -= instruction.arity-1;
+                break;
+            default:
+                valid = false;
+        }
+        deepest = max(deepest, top);
+        if (!valid || deepest>record.stack_depth) {
+            reject("program " + to_string(index) + " has an invalid instruction " + to_string(i));
+        }
+    }
+}
+
+/* A whole file mapped read-only, unmapped with the last reference to it. */
+class FileMapping {
+    public:
+    const char* bytes = nullptr;
+    size_t size = 0;
+    ~FileMapping() {
+#ifdef _WIN32
+        UnmapViewOfFile(bytes);
+#else
+        munmap((void*)bytes, size);
+#endif
+    }
+};
+
+shared_ptr<FileMapping> map_file(const string& path) {
+    shared_ptr<FileMapping> mapping;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file==INVALID_HANDLE_VALUE) {
+        throw runtime_error("Cannot open " + path);
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw runtime_error("Cannot read " + path);
+    }
+    if ((uint64_t)size.QuadPart<sizeof(FileHeader)) {
+        CloseHandle(file);
+        reject(path + " is shorter than its header");
+    }
+    HANDLE file_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    const void* view = file_mapping ? MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (file_mapping) {
+        CloseHandle(file_mapping);
+    }
+    CloseHandle(file);
+    if (!view) {
+        throw runtime_error("Cannot map " + path);
+    }
+    mapping = make_shared<FileMapping>();
+    mapping->bytes = (const char*)view;
+    mapping->size = size.QuadPart;
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file<0) {
+        throw runtime_error("Cannot open " + path);
+    }
+    struct stat status;
+    if (fstat(file, &status)!=0) {
+        close(file);
+        throw runtime_error("Cannot read " + path);
+    }
+    if ((uint64_t)status.st_size<sizeof(FileHeader)) {
+        close(file);
+        reject(path + " is shorter than its header");
+    }
+    void* view = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (view==MAP_FAILED) {
+        throw runtime_error("Cannot map " + path);
+    }
+    mapping = make_shared<FileMapping>();
+    mapping->bytes = (const char*)view;
+    mapping->size = status.st_size;
+#endif
+    return mapping;
+}
+
+}
+
+string ProgramFile::serialize(const vector<CompiledExpression>& programs) {
+    FileBuilder builder;
+    FileHeader header = {};
+    vector<ProgramRecord> records(programs.size());
+    builder.append(&header, sizeof(header));
+    uint64_t records_offset = builder.append(records.data(), records.size()*sizeof(ProgramRecord));
+    /* Programs of one ExpressionBatch share their constant pools and variable names;
+       those are written once and every record points at the same bytes. */
+    map<pair<const void*, size_t>, uint64_t> written;
+    auto append_shared = [&](const void* data, size_t size) {
+        auto found = written.find({data, size});
+        if (found!=written.end()) {
+            return found->second;
+        }
+        uint64_t offset = builder.append(data, size);
+        written[{data, size}] = offset;
+        return offset;
+    };
+    map<const vector<string>*, pair<uint64_t, uint32_t>> written_names;
+    for (size_t i=0; i<programs.size(); i++) {
+        const CompiledExpression& compiled = programs[i];
+        ProgramRecord& record = records[i];
+        /* A registered function's id means nothing to another process */
+        for (const Instruction& instruction: compiled.get_program()) {
+            if (instruction.kind==INSTRUCTION_CALL) {
+                throw invalid_argument("Program " + to_string(i) + " calls a registered function: "
+                                       + compiled.get_source());
+            }
+        }
+        record.source_offset = builder.append(compiled.get_source().data(), compiled.get_source().size());
+        record.program_offset = builder.append(compiled.get_program().data(),
+                                               compiled.get_program().size()*sizeof(Instruction));
+        record.constants_offset = append_shared(compiled.get_constants().data(),
+                                                compiled.get_constants().size()*sizeof(float));
+        record.precise_constants_offset = append_shared(compiled.get_precise_constants().data(),
+                                                        compiled.get_precise_constants().size()*sizeof(double));
+        auto names_written = written_names.find(&compiled.get_variables());
+        if (names_written==written_names.end()) {
+            string names;
+            for (const string& variable: compiled.get_variables()) {
+                names.append(variable.c_str(), variable.size()+1);
+            }
+            pair<uint64_t, uint32_t> range(builder.append(names.data(), names.size()), names.size());
+            names_written = written_names.emplace(&compiled.get_variables(), range).first;
+        }
+        record.names_offset = names_written->second.first;
+        record.names_length = names_written->second.second;
+        record.source_length = compiled.get_source().size();
+        record.instruction_count = compiled.get_program().size();
+        record.constant_count = compiled.get_constants().size();
+        record.variable_count = compiled.get_variables().size();
+        record.stack_depth = compiled.get_stack_depth();
+        record.temp_count = compiled.get_temp_count();
+        record.result_count = compiled.get_result_count();
+    }
+    string& bytes = builder.bytes;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.header_size = sizeof(FileHeader);
+    header.record_size = sizeof(ProgramRecord);
+    header.instruction_size = sizeof(Instruction);
+    header.program_count = programs.size();
+    header.file_size = bytes.size();
+    header.records_offset = records_offset;
+    memcpy(&bytes[0], &header, sizeof(header));
+    memcpy(&bytes[records_offset], records.data(), records.size()*sizeof(ProgramRecord));
+    header.checksum = checksum(bytes.data() + CHECKSUM_END, bytes.size() - CHECKSUM_END);
+    memcpy(&bytes[0], &header, sizeof(header));
+    return bytes;
+}
+
+void ProgramFile::write(const string& path, const vector<CompiledExpression>& programs) {
+    string bytes = serialize(programs);
+    ofstream output(path, ios::binary);
+    output.write(bytes.data(), bytes.size());
+    output.close();
+    if (!output) {
+        throw runtime_error("Writing " + path + " failed");
+    }
+}
+
+ProgramFile::ProgramFile(const string& path) {
+    shared_ptr<FileMapping> mapping = map_file(path);
+    try {
+        load(mapping->bytes, mapping->size, mapping);
+    } catch (const invalid_argument& e) {
+        throw invalid_argument(string(e.what()) + " in " + path);
+    }
+}
+
+ProgramFile::ProgramFile(const char* bytes, size_t size, shared_ptr<const void> owner) {
+    load(bytes, size, owner);
+}
+
+void ProgramFile::load(const char* bytes, size_t size, const shared_ptr<const void>& owner) {
+    FileHeader header;
+    if (size<sizeof(header)) {
+        reject("shorter than its header");
+    }
+    if ((uintptr_t)bytes%ALIGNMENT!=0) {
+        reject("not loaded at an aligned address");
+    }
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC))!=0) {
+        reject("not a program file");
+    }
+    if (header.byte_order!=BYTE_ORDER_MARK) {
+        reject("written with another byte order");
+    }
+    if (header.version!=VERSION) {
+        reject("format version " + to_string(header.version) + ", expected " + to_string(VERSION));
+    }
+    if (header.header_size!=sizeof(FileHeader) || header.record_size!=sizeof(ProgramRecord)
+        || header.instruction_size!=sizeof(Instruction)) {
+        reject("unexpected record layout");
+    }
+    if (header.file_size!=size) {
+        reject(to_string(size) + " bytes long, expected " + to_string(header.file_size));
+    }
+    if (checksum(bytes + CHECKSUM_END, size - CHECKSUM_END)!=header.checksum) {
+        reject("checksum mismatch");
+    }
+    check_range(header.records_offset, header.program_count, sizeof(ProgramRecord), size, "program records");
+
+    programs.reserve(header.program_count);
+    map<tuple<uint64_t, uint32_t, uint32_t>, shared_ptr<const vector<string>>> names_loaded;
+    for (size_t i=0; i<header.program_count; i++) {
+        ProgramRecord record;
+        memcpy(&record, bytes + header.records_offset + i*sizeof(ProgramRecord), sizeof(record));
+        check_range(record.source_offset, record.source_length, 1, size, i, "source");
+        check_range(record.program_offset, record.instruction_count, sizeof(Instruction), size, i, "instructions");
+        check_range(record.constants_offset, record.constant_count, sizeof(float), size, i, "constants");
+        check_range(record.precise_constants_offset, record.constant_count, sizeof(double), size, i, "constants");
+        check_range(record.names_offset, record.names_length, 1, size, i, "variables");
+        const Instruction* program = (const Instruction*)(bytes + record.program_offset);
+        check_program(record, program, i);
+
+        /* Records pointing at the same names (one batch) share one table. */
+        shared_ptr<const vector<string>>& shared_variables =
+            names_loaded[{record.names_offset, record.names_length, record.variable_count}];
+        if (!shared_variables) {
+            vector<string> variables;
+            const char* name = bytes + record.names_offset;
+            const char* names_end = name + record.names_length;
+            for (uint32_t slot=0; slot<record.variable_count; slot++) {
+                const char* name_end = (const char*)memchr(name, '\0', names_end-name);
+                if (!name_end) {
+                    reject("program " + to_string(i) + " variables out of bounds");
+                }
+                variables.push_back(string(name, name_end));
+                name = name_end+1;
+            }
+            shared_variables = make_shared<const vector<string>>(move(variables));
+        }
+        programs.push_back(CompiledExpression(
+            string(bytes + record.source_offset, record.source_length),
+            SharedArray<Instruction>(program, record.instruction_count, owner),
+            SharedArray<float>((const float*)(bytes + record.constants_offset), record.constant_count, owner),
+            SharedArray<double>((const double*)(bytes + record.precise_constants_offset), record.constant_count, owner),
+            shared_variables, record.stack_depth, record.temp_count, record.result_count));
+    }
+}
+
+size_t ProgramFile::size() const {
+    return programs.size();
+}
+
+const CompiledExpression& ProgramFile::operator[](size_t index) const {
+    return programs[index];
+}
+
+const vector<CompiledExpression>& ProgramFile::get_programs() const {
+    return programs;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+#include "exprparser.hpp"
+
+/* Compiled programs saved to a binary file by a build step, so a process can load
+   thousands of them without parsing any. Loading maps the file read-only and the
+   programs evaluate straight out of the mapping: instructions and constant pools
+   are used in place and only source texts and variable names become strings.
+
+   The layout is position-independent (offsets from the start of the file, every
+   array 8-byte aligned) and in the writer's byte order:
+     header         magic, checksum, version, byte order mark, sizes and counts
+     records        one per program: offsets and lengths of its arrays, its stack
+                    depth, temporary and result counts
+     data           source text, instructions, float and double constant pools,
+                    variable names as NUL-terminated strings
+   The checksum covers everything after it. A file is rejected if the checksum,
+   version or byte order does not match, or if any program would read outside its
+   arrays or its stack when evaluated. */
+class ProgramFile {
+    public:
+    static const uint32_t VERSION = 1;
+    /* The file contents for these programs; invalid_argument if one calls a registered function. */
+    static string serialize(const vector<CompiledExpression>& programs);
+    /* Throws runtime_error if the file cannot be written. */
+    static void write(const string& path, const vector<CompiledExpression>& programs);
+    /* Maps the file and checks it. Throws runtime_error if it cannot be read and
+       invalid_argument if it is not a valid program file of this version. */
+    explicit ProgramFile(const string& path);
+    /* Same, for file contents already in memory, which owner keeps alive. */
+    ProgramFile(const char* bytes, size_t size, shared_ptr<const void> owner);
+    size_t size() const;
+    const CompiledExpression& operator[](size_t index) const;
+    const vector<CompiledExpression>& get_programs() const;
+    private:
+    void load(const char* bytes, size_t size, const shared_ptr<const void>& owner);
+    vector<CompiledExpression> programs;
+};
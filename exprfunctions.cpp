@@ -0,0 +1,42 @@
+#include <cctype>
+#include <mutex>
+#include <stdexcept>
+
+#include "exprfunctions.hpp"
+#include "exprtables.hpp"
+
+int FunctionRegistry::add(RegisteredFunction function) {
+    const string& name = function.name;
+    bool valid_name = !name.empty() && (isalpha((unsigned char)name[0]) || name[0]=='_');
+    for (char c: name) {
+        valid_name = valid_name && (isalnum((unsigned char)c) || c=='_');
+    }
+    if (!valid_name) {
+        throw invalid_argument("Invalid function name: " + name);
+    }
+    if (FUNCTIONS.find(name) || CONSTANTS.find(name)) {
+        throw invalid_argument("Function name is built in: " + name);
+    }
+    unique_lock<shared_mutex> lock(mutex);
+    if (ids.count(name)) {
+        throw invalid_argument("Function already registered: " + name);
+    }
+    int id = count.load(memory_order_relaxed);
+    if (id==MAX_FUNCTIONS) {
+        throw invalid_argument("Too many registered functions, adding " + name);
+    }
+    functions[id] = move(function);
+    ids[functions[id].name] = id;
+    count.store(id+1, memory_order_release);
+    return id;
+}
+
+int FunctionRegistry::find(string_view name) {
+    /* Every variable name is looked up here, so no lock at all until something is registered */
+    if (count.load(memory_order_acquire)==0) {
+        return -1;
+    }
+    shared_lock<shared_mutex> lock(mutex);
+    auto search = ids.find(string(name));
+    return search==ids.end() ? -1 : search->second;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "exprparser.hpp"
+
+/* A function added by the application, called from expressions like a built-in
+   one. Programs refer to it by id with INSTRUCTION_CALL, and the evaluators call
+   it through call() and call_batch(): plain function pointers instantiated for
+   the callable's own type, so the callable is inlined into them and a batch makes
+   one indirect call per block of rows rather than one per row. */
+struct RegisteredFunction {
+    string name;
+    int arity = 0;
+    /* Same arguments, same result, no side effects: calls on constants are folded
+       and equal calls are computed once. Other functions are called every time. */
+    bool pure = false;
+    void* state = nullptr;
+    /* args[0..arity) */
+    float (*call)(void* state, const float* args) = nullptr;
+    /* results[row] = function(args[0][row], ...) for row < count. results may be args[0]. */
+    void (*call_batch)(void* state, const float* const* args, float* results, size_t count) = nullptr;
+    /* Owns state. */
+    shared_ptr<void> owner;
+};
+
+/* Process-wide set of registered functions, shared by every parser. Functions are
+   only ever added: an id stays valid, and a program that calls it stays valid, for
+   the rest of the process. Names follow the rules for variable names and may not
+   be taken by a built-in function, a constant or an earlier registration; text
+   parsed before a name was registered keeps reading it as a variable.
+   A function takes 1 to MAX_FUNCTION_ARITY float arguments and returns a float.
+   Evaluation in double or fixed point goes through float for these functions, and
+   neither gradients, derivatives nor program files support them. */
+class FunctionRegistry {
+    public:
+    static const int MAX_FUNCTIONS = 256;
+    /* Registers function, any callable taking floats, e.g.
+       FunctionRegistry::add("clamp01", [](float x) { return min(max(x, 0.0f), 1.0f); }, true).
+       Returns its id; invalid_argument if the name cannot be used. */
+    template <class Function>
+    static int add(const string& name, Function function, bool pure = false);
+    /* The same with a batch form for call_batch, such as a vectorized loop:
+       batch_function(const float* const* args, float* results, size_t count). */
+    template <class Function, class BatchFunction,
+              class = enable_if_t<is_invocable_v<BatchFunction&, const float* const*, float*, size_t>>>
+    static int add(const string& name, Function function, BatchFunction batch_function, bool pure = false);
+    /* -1 if no function has the name. */
+    static int find(string_view name);
+    static const RegisteredFunction& get(int id) {
+        return functions[id];
+    }
+    private:
+    static int add(RegisteredFunction function);
+    template <class Function, size_t... I>
+    static constexpr bool takes_floats(index_sequence<I...>) {
+        return is_invocable_r_v<float, Function&, decltype((void)I, 0.0f)...>;
+    }
+    /* The smallest number of floats the callable takes, 0 if none up to MAX_FUNCTION_ARITY. */
+    template <class Function, int ARITY = 1>
+    static constexpr int arity_of() {
+        if constexpr (ARITY>MAX_FUNCTION_ARITY) {
+            return 0;
+        } else if constexpr (takes_floats<Function>(make_index_sequence<ARITY>())) {
+            return ARITY;
+        } else {
+            return arity_of<Function, ARITY+1>();
+        }
+    }
+    template <class Function, class BatchFunction>
+    struct Callables {
+        Function function;
+        BatchFunction batch_function;
+    };
+    template <class State, size_t... I>
+    static float call(void* state, const float* args, index_sequence<I...>) {
+        return (float)static_cast<State*>(state)->function(args[I]...);
+    }
+    template <class State, int ARITY>
+    static float call(void* state, const float* args) {
+        return call<State>(state, args, make_index_sequence<ARITY>());
+    }
+    template <class State, size_t... I>
+    static void call_rows(void* state, const float* const* args, float* results, size_t count,
+                          index_sequence<I...>) {
+        State& callables = *static_cast<State*>(state);
+        for (size_t row=0; row<count; row++) {
+            results[row] = (float)callables.function(args[I][row]...);
+        }
+    }
+    template <class State, int ARITY>
+    static void call_batch(void* state, const float* const* args, float* results, size_t count) {
+        if constexpr (is_same_v<decltype(State::batch_function), nullptr_t>) {
+            call_rows<State>(state, args, results, count, make_index_sequence<ARITY>());
+        } else {
+            static_cast<State*>(state)->batch_function(args, results, count);
+        }
+    }
+    template <class Function, class BatchFunction>
+    static int add_callables(const string& name, Function&& function, BatchFunction&& batch_function, bool pure);
+    static inline RegisteredFunction functions[MAX_FUNCTIONS];
+    static inline atomic<int> count{0};
+    static inline shared_mutex mutex;
+    static inline unordered_map<string, int> ids;
+};
+
+template <class Function, class BatchFunction>
+int FunctionRegistry::add_callables(const string& name, Function&& function, BatchFunction&& batch_function,
+                                    bool pure) {
+    typedef Callables<decay_t<Function>, decay_t<BatchFunction>> State;
+    constexpr int ARITY = arity_of<decay_t<Function>>();
+    static_assert(ARITY>0, "A registered function must take 1 to MAX_FUNCTION_ARITY floats and return a float");
+    shared_ptr<State> state = make_shared<State>(State{forward<Function>(function),
+                                                       forward<BatchFunction>(batch_function)});
+    RegisteredFunction registered;
+    registered.name = name;
+    registered.arity = ARITY;
+    registered.pure = pure;
+    registered.state = state.get();
+    registered.call = &FunctionRegistry::call<State, ARITY>;
+    registered.call_batch = &FunctionRegistry::call_batch<State, ARITY>;
+    registered.owner = move(state);
+    return add(move(registered));
+}
+
+template <class Function>
+int FunctionRegistry::add(const string& name, Function function, bool pure) {
+    return add_callables(name, move(function), nullptr, pure);
+}
+
+template <class Function, class BatchFunction, class>
+int FunctionRegistry::add(const string& name, Function function, BatchFunction batch_function, bool pure) {
+    return add_callables(name, move(function), move(batch_function), pure);
+}
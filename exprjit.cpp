@@ -0,0 +1,439 @@
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "exprjit.hpp"
+#include "exprfunctions.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EXPRJIT_X86_64
+#endif
+
+#ifdef EXPRJIT_X86_64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+using namespace std;
+
+#ifdef EXPRJIT_X86_64
+
+namespace {
+
+/* Machine code for one program. The value stack and temporaries live in the
+   function's own frame; only xmm0-xmm2 and rax are used as scratch, and the
+   values/columns pointer, row index, results pointer and row count are kept in
+   rbx, r12, r13 and r14 so they survive calls into the math functions. */
+class Assembler {
+    public:
+    vector<unsigned char> code;
+
+    void byte(unsigned char value) {
+        code.push_back(value);
+    }
+
+    void bytes(std::initializer_list<unsigned char> values) {
+        code.insert(code.end(), values);
+    }
+
+    void int32(int32_t value) {
+        unsigned char encoded[4];
+        memcpy(encoded, &value, 4);
+        code.insert(code.end(), encoded, encoded+4);
+    }
+
+    void int64(uint64_t value) {
+        unsigned char encoded[8];
+        memcpy(encoded, &value, 8);
+        code.insert(code.end(), encoded, encoded+8);
+    }
+
+    /* op xmm<reg>, [rsp+offset] (or the store form, depending on opcode). */
+    void sse_rsp(unsigned char prefix, unsigned char opcode, int reg, int offset) {
+        bytes({prefix, 0x0F, opcode, (unsigned char)(0x84 | reg<<3), 0x24});
+        int32(offset);
+    }
+
+    /* op xmm<reg>, [rbx+offset] */
+    void sse_rbx(unsigned char prefix, unsigned char opcode, int reg, int offset) {
+        bytes({prefix, 0x0F, opcode, (unsigned char)(0x83 | reg<<3)});
+        int32(offset);
+    }
+
+    /* op xmm<reg>, xmm<source> */
+    void sse_reg(unsigned char prefix, unsigned char opcode, int reg, int source) {
+        if (prefix) {
+            byte(prefix);
+        }
+        bytes({0x0F, opcode, (unsigned char)(0xC0 | reg<<3 | source)});
+    }
+
+    void load_stack(int reg, int offset) {
+        sse_rsp(0xF3, 0x10, reg, offset);
+    }
+
+    void store_stack(int reg, int offset) {
+        sse_rsp(0xF3, 0x11, reg, offset);
+    }
+
+    /* mov eax, bits; movd xmm<reg>, eax */
+    void load_bits(int reg, uint32_t bits) {
+        byte(0xB8);
+        int32((int32_t)bits);
+        bytes({0x66, 0x0F, 0x6E, (unsigned char)(0xC0 | reg<<3)});
+    }
+
+    /* mov rax, function; call rax */
+    void call(const void* function) {
+        bytes({0x48, 0xB8});
+        int64((uint64_t)(uintptr_t)function);
+        bytes({0xFF, 0xD0});
+    }
+
+    /* Calls function(state, rsp+offset) with the two arguments in the first two
+       integer argument registers of the ABI. */
+    void call_with_stack(const void* function, const void* state, int offset) {
+#ifdef _WIN32
+        bytes({0x48, 0xB9});                                /* mov rcx, state */
+        int64((uint64_t)(uintptr_t)state);
+        bytes({0x48, 0x8D, 0x94, 0x24});                    /* lea rdx, [rsp+offset] */
+#else
+        bytes({0x48, 0xBF});                                /* mov rdi, state */
+        int64((uint64_t)(uintptr_t)state);
+        bytes({0x48, 0x8D, 0xB4, 0x24});                    /* lea rsi, [rsp+offset] */
+#endif
+        int32(offset);
+        call(function);
+    }
+
+    void patch_rel32(size_t at, size_t target) {
+        int32_t rel = (int32_t)(target - (at + 4));
+        memcpy(&code[at], &rel, 4);
+    }
+};
+
+const unsigned char SSE_SQRT = 0x51;
+const unsigned char SSE_AND = 0x54;
+const unsigned char SSE_XOR = 0x57;
+const unsigned char SSE_ADD = 0x58;
+const unsigned char SSE_MUL = 0x59;
+const unsigned char SSE_SUB = 0x5C;
+const unsigned char SSE_MIN = 0x5D;
+const unsigned char SSE_MAX = 0x5F;
+
+/* Bytes pushed by the prologue (rbx, r12, r13, r14) and the callee's shadow space
+   that the Windows ABI requires below every call; harmless on System V. */
+const int PUSHED_BYTES = 32;
+const int SHADOW_SPACE = 32;
+
+/* Returns the scalar function the interpreter would call for this instruction. */
+const void* get_math_function(const Instruction& instruction) {
+    const void* function = nullptr;
+    if (instruction.arity==1) {
+        blender::nodes::try_dispatch_float_math_fl_to_fl(instruction.operation, [&](auto math_function) {
+            float (*pointer)(float) = math_function;
+            function = (const void*)pointer;
+        });
+    } else if (instruction.arity==2) {
+        blender::nodes::try_dispatch_float_math_fl_fl_to_fl(instruction.operation, [&](auto math_function) {
+            float (*pointer)(float, float) = math_function;
+            function = (const void*)pointer;
+        });
+    } else if (instruction.arity==3) {
+        blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(instruction.operation, [&](auto math_function) {
+            float (*pointer)(float, float, float) = math_function;
+            function = (const void*)pointer;
+        });
+    }
+    return function;
+}
+
+/* Emits one operation on xmm0..xmm(arity-1), leaving the result in xmm0.
+   The inline forms match the interpreter bit for bit, including NaN handling:
+   minss/maxss return their second operand when either input is NaN, which is what
+   std::min(a, b) and std::max(a, b) do for (b, a). */
+bool emit_operation(Assembler& assembler, const Instruction& instruction) {
+    if (instruction.arity==2) {
+        switch (instruction.operation) {
+            case NODE_MATH_ADD:
+                assembler.sse_reg(0xF3, SSE_ADD, 0, 1);
+                return true;
+            case NODE_MATH_SUBTRACT:
+                assembler.sse_reg(0xF3, SSE_SUB, 0, 1);
+                return true;
+            case NODE_MATH_MULTIPLY:
+                assembler.sse_reg(0xF3, SSE_MUL, 0, 1);
+                return true;
+            case NODE_MATH_MINIMUM:
+            case NODE_MATH_MAXIMUM:
+                assembler.sse_reg(0, 0x28, 2, 0);
+                assembler.sse_reg(0, 0x28, 0, 1);
+                assembler.sse_reg(0xF3, instruction.operation==NODE_MATH_MINIMUM ? SSE_MIN : SSE_MAX, 0, 2);
+                return true;
+        }
+    } else if (instruction.arity==1) {
+        switch (instruction.operation) {
+            case NODE_MATH_NEG:
+                assembler.load_bits(1, 0x80000000u);
+                assembler.sse_reg(0, SSE_XOR, 0, 1);
+                return true;
+            case NODE_MATH_ABSOLUTE:
+                assembler.load_bits(1, 0x7FFFFFFFu);
+                assembler.sse_reg(0, SSE_AND, 0, 1);
+                return true;
+            case NODE_MATH_SQRT:
+                /* safe_sqrtf: sqrtf(a > 0 ? a : 0), NaN included. */
+                assembler.load_bits(1, 0);
+                assembler.sse_reg(0xF3, SSE_MAX, 0, 1);
+                assembler.sse_reg(0xF3, SSE_SQRT, 0, 0);
+                return true;
+        }
+    }
+    const void* function = get_math_function(instruction);
+    if (!function) {
+        return false;
+    }
+    assembler.call(function);
+    return true;
+}
+
+void emit_prologue(Assembler& assembler, int frame_size) {
+    assembler.bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56});   /* push rbx, r12, r13, r14 */
+    assembler.bytes({0x48, 0x81, 0xEC});                           /* sub rsp, frame_size */
+    assembler.int32(frame_size);
+}
+
+void emit_epilogue(Assembler& assembler, int frame_size) {
+    assembler.bytes({0x48, 0x81, 0xC4});                           /* add rsp, frame_size */
+    assembler.int32(frame_size);
+    assembler.bytes({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B});   /* pop r14, r13, r12, rbx */
+    assembler.byte(0xC3);                                          /* ret */
+}
+
+/* Emits the program body. In batch mode variables are read from columns[slot][r12]
+   with the columns pointer in rbx, otherwise from values[slot] with values in rbx.
+   The result is left in xmm0. */
+bool emit_body(Assembler& assembler, const CompiledExpression& compiled, int stack_depth, bool batch) {
+    const SharedArray<float>& constants = compiled.get_constants();
+    int top = 0;
+    for (const Instruction& instruction: compiled.get_program()) {
+        switch (instruction.kind) {
+            case INSTRUCTION_CONSTANT: {
+                uint32_t bits;
+                memcpy(&bits, &constants[instruction.index], sizeof(float));
+                assembler.load_bits(0, bits);
+                assembler.store_stack(0, SHADOW_SPACE + 4*top++);
+                break;
+            }
+            case INSTRUCTION_VARIABLE:
+                if (batch) {
+                    assembler.bytes({0x48, 0x8B, 0x83});                   /* mov rax, [rbx+8*slot] */
+                    assembler.int32(8*instruction.index);
+                    assembler.bytes({0xF3, 0x42, 0x0F, 0x10, 0x04, 0xA0}); /* movss xmm0, [rax+r12*4] */
+                } else {
+                    assembler.sse_rbx(0xF3, 0x10, 0, 4*instruction.index);
+                }
+                assembler.store_stack(0, SHADOW_SPACE + 4*top++);
+                break;
+            case INSTRUCTION_LOAD_TEMP:
+                assembler.load_stack(0, SHADOW_SPACE + 4*(stack_depth + instruction.index));
+                assembler.store_stack(0, SHADOW_SPACE + 4*top++);
+                break;
+            case INSTRUCTION_STORE_TEMP:
+                assembler.load_stack(0, SHADOW_SPACE + 4*(top-1));
+                assembler.store_stack(0, SHADOW_SPACE + 4*(stack_depth + instruction.index));
+                break;
+            case INSTRUCTION_OPERATION:
+                top -= instruction.arity;
+                for (int i=0; i<instruction.arity; i++) {
+                    assembler.load_stack(i, SHADOW_SPACE + 4*(top+i));
+                }
+                if (!emit_operation(assembler, instruction)) {
+                    return false;
+                }
+                assembler.store_stack(0, SHADOW_SPACE + 4*top++);
+                break;
+            case INSTRUCTION_CALL: {
+                /* The arguments are in order in the frame's value stack, which is what call() takes */
+                const RegisteredFunction& function = FunctionRegistry::get(instruction.index);
+                top -= instruction.arity;
+                assembler.call_with_stack((const void*)function.call, function.state, SHADOW_SPACE + 4*top);
+                assembler.store_stack(0, SHADOW_SPACE + 4*top++);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    assembler.load_stack(0, SHADOW_SPACE + 4*(top-1));
+    return true;
+}
+
+bool emit_scalar(Assembler& assembler, const CompiledExpression& compiled, int stack_depth, int frame_size) {
+    emit_prologue(assembler, frame_size);
+#ifdef _WIN32
+    assembler.bytes({0x48, 0x89, 0xCB});                   /* mov rbx, rcx */
+#else
+    assembler.bytes({0x48, 0x89, 0xFB});                   /* mov rbx, rdi */
+#endif
+    if (!emit_body(assembler, compiled, stack_depth, false)) {
+        return false;
+    }
+    emit_epilogue(assembler, frame_size);
+    return true;
+}
+
+bool emit_batch(Assembler& assembler, const CompiledExpression& compiled, int stack_depth, int frame_size) {
+    emit_prologue(assembler, frame_size);
+#ifdef _WIN32
+    assembler.bytes({0x48, 0x89, 0xCB});                   /* mov rbx, rcx */
+    assembler.bytes({0x49, 0x89, 0xD5});                   /* mov r13, rdx */
+    assembler.bytes({0x4D, 0x89, 0xC6});                   /* mov r14, r8 */
+#else
+    assembler.bytes({0x48, 0x89, 0xFB});                   /* mov rbx, rdi */
+    assembler.bytes({0x49, 0x89, 0xF5});                   /* mov r13, rsi */
+    assembler.bytes({0x49, 0x89, 0xD6});                   /* mov r14, rdx */
+#endif
+    assembler.bytes({0x45, 0x31, 0xE4});                   /* xor r12d, r12d */
+    size_t loop = assembler.code.size();
+    assembler.bytes({0x4D, 0x39, 0xF4});                   /* cmp r12, r14 */
+    assembler.bytes({0x0F, 0x83});                         /* jae done */
+    size_t exit_jump = assembler.code.size();
+    assembler.int32(0);
+    if (!emit_body(assembler, compiled, stack_depth, true)) {
+        return false;
+    }
+    assembler.bytes({0xF3, 0x43, 0x0F, 0x11, 0x44, 0xA5, 0x00}); /* movss [r13+r12*4], xmm0 */
+    assembler.bytes({0x49, 0xFF, 0xC4});                   /* inc r12 */
+    assembler.byte(0xE9);                                  /* jmp loop */
+    size_t loop_jump = assembler.code.size();
+    assembler.int32(0);
+    assembler.patch_rel32(loop_jump, loop);
+    assembler.patch_rel32(exit_jump, assembler.code.size());
+    emit_epilogue(assembler, frame_size);
+    return true;
+}
+
+void* allocate_executable(const vector<unsigned char>& code) {
+#ifdef _WIN32
+    void* memory = VirtualAlloc(nullptr, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!memory) {
+        return nullptr;
+    }
+    memcpy(memory, code.data(), code.size());
+    DWORD old_protection;
+    if (!VirtualProtect(memory, code.size(), PAGE_EXECUTE_READ, &old_protection)) {
+        VirtualFree(memory, 0, MEM_RELEASE);
+        return nullptr;
+    }
+    FlushInstructionCache(GetCurrentProcess(), memory, code.size());
+    return memory;
+#else
+    void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory==MAP_FAILED) {
+        return nullptr;
+    }
+    memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC)!=0) {
+        munmap(memory, code.size());
+        return nullptr;
+    }
+    return memory;
+#endif
+}
+
+void free_executable(void* memory, size_t size) {
+#ifdef _WIN32
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, size);
+#endif
+}
+
+}
+
+#endif
+
+JitExpression::JitExpression(const CompiledExpression& compiled) : compiled(compiled) {
+#ifdef EXPRJIT_X86_64
+    if (compiled.empty() || compiled.get_result_count()!=1) {
+        return;
+    }
+    /* The frame is sized from the program itself rather than trusting stack_depth. */
+    int depth = 0;
+    int stack_depth = 0;
+    int temp_count = 0;
+    for (const Instruction& instruction: compiled.get_program()) {
+        if (instruction.kind==INSTRUCTION_CONSTANT || instruction.kind==INSTRUCTION_VARIABLE
+            || instruction.kind==INSTRUCTION_LOAD_TEMP) {
+            depth++;
+        } else if (instruction.kind==INSTRUCTION_OPERATION || instruction.kind==INSTRUCTION_CALL) {
+            depth -= instruction.arity - 1;
+        }
+        if (instruction.kind==INSTRUCTION_LOAD_TEMP || instruction.kind==INSTRUCTION_STORE_TEMP) {
+            temp_count = max(temp_count, instruction.index + 1);
+        }
+        stack_depth = max(stack_depth, depth);
+    }
+    /* Keeps rsp 16-byte aligned at each call: entry leaves it 8 off, the pushes keep it so. */
+    int frame_size = (SHADOW_SPACE + 4*(stack_depth + temp_count) + 15) / 16 * 16 + 8;
+    static_assert(PUSHED_BYTES % 16 == 0, "prologue must preserve stack alignment");
+
+    Assembler assembler;
+    if (!emit_scalar(assembler, compiled, stack_depth, frame_size)) {
+        return;
+    }
+    while (assembler.code.size() % 16) {
+        assembler.byte(0xCC);
+    }
+    size_t batch_offset = assembler.code.size();
+    if (!emit_batch(assembler, compiled, stack_depth, frame_size)) {
+        return;
+    }
+    code = allocate_executable(assembler.code);
+    if (!code) {
+        return;
+    }
+    code_size = assembler.code.size();
+    scalar_function = (ScalarFunction)code;
+    batch_function = (BatchFunction)((unsigned char*)code + batch_offset);
+#endif
+}
+
+JitExpression::~JitExpression() {
+#ifdef EXPRJIT_X86_64
+    if (code) {
+        free_executable(code, code_size);
+    }
+#endif
+}
+
+bool JitExpression::is_native() const {
+    return scalar_function!=nullptr;
+}
+
+JitExpression::ScalarFunction JitExpression::get_scalar_function() const {
+    return scalar_function;
+}
+
+JitExpression::BatchFunction JitExpression::get_batch_function() const {
+    return batch_function;
+}
+
+float JitExpression::evaluate(const float* values) const {
+    if (scalar_function) {
+        return scalar_function(values);
+    }
+    return compiled.evaluate(values);
+}
+
+void JitExpression::evaluate_batch(const float* const* columns, float* results, size_t rows) const {
+    if (batch_function) {
+        batch_function(columns, results, rows);
+        return;
+    }
+    compiled.evaluate_batch(columns, results, rows);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "exprparser.hpp"
+
+/* Native x86-64 code for a CompiledExpression.
+   Construction translates the program into machine code in executable memory:
+   a scalar function reading variables by slot from a float array, and a batch
+   function looping over columns like CompiledExpression::evaluate_batch().
+   Add, subtract, multiply, min/max, neg/abs and sqrt are emitted inline; every
+   other operation (divide and multiply_add included) and every registered function
+   calls the same scalar function the interpreter uses, so results are bit-identical
+   to evaluate().
+   When native code cannot be produced (another architecture, a program with
+   several results, or no executable memory) is_native() is false and the
+   evaluate methods fall back to the interpreter. */
+class JitExpression {
+    public:
+    typedef float (*ScalarFunction)(const float* values);
+    typedef void (*BatchFunction)(const float* const* columns, float* results, size_t rows);
+    JitExpression(const CompiledExpression& compiled);
+    JitExpression(const JitExpression&) = delete;
+    JitExpression& operator=(const JitExpression&) = delete;
+    ~JitExpression();
+    bool is_native() const;
+    ScalarFunction get_scalar_function() const;
+    BatchFunction get_batch_function() const;
+    float evaluate(const float* values) const;
+    void evaluate_batch(const float* const* columns, float* results, size_t rows) const;
+    private:
+    CompiledExpression compiled;
+    void* code = nullptr;
+    size_t code_size = 0;
+    ScalarFunction scalar_function = nullptr;
+    BatchFunction batch_function = nullptr;
+};
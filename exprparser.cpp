@@ -1,22 +1,60 @@
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <charconv>
 
 #include "exprparser.hpp"
+#include "exprtables.hpp"
+#include "exprfunctions.hpp"
+#include "exprtree.hpp"
+#include "fixed_point.hpp"
+#include "math_functions_generic.hh"
+#include "math_derivatives.hh"
+#include "math_intervals.hh"
+#include "threadpool.hpp"
+#include "math_kernels.hh"
 
 using namespace std;
 
-template <class T>
-bool vector_contains(vector<T> vec, T item) {
-    for (T elem: vec) {
-        if (elem == item) {
-            return true;
+enum CharacterClass : unsigned char {
+    CHARACTER_DIGIT = 1,
+    CHARACTER_LETTER = 2,
+    CHARACTER_WHITESPACE = 4,
+    CHARACTER_OPERATOR = 8,
+    CHARACTER_EXPONENT = 16
+};
+
+/* Class bits for every byte value, so classifying a character is one load.
+   Must agree with OPERATORS_DETAILS; '\0' counts as whitespace, as it always has. */
+struct CharacterClasses {
+    unsigned char classes[256] = {};
+    constexpr CharacterClasses() {
+        for (char c='0'; c<='9'; c++) {
+            classes[(unsigned char)c] |= CHARACTER_DIGIT;
+        }
+        for (char c='a'; c<='z'; c++) {
+            classes[(unsigned char)c] |= CHARACTER_LETTER;
+            classes[(unsigned char)(c-'a'+'A')] |= CHARACTER_LETTER;
         }
+        classes[(unsigned char)' '] |= CHARACTER_WHITESPACE;
+        classes[(unsigned char)'\t'] |= CHARACTER_WHITESPACE;
+        classes[0] |= CHARACTER_WHITESPACE;
+        const char operators[] = "()^%/*-+,";
+        for (int i=0; operators[i]!='\0'; i++) {
+            classes[(unsigned char)operators[i]] |= CHARACTER_OPERATOR;
+        }
+        classes[(unsigned char)'E'] |= CHARACTER_EXPONENT;
     }
-    return false;
+};
+
+static constexpr CharacterClasses CHARACTER_CLASSES;
+
+static inline bool has_class(char character, unsigned char character_class) {
+    return (CHARACTER_CLASSES.classes[(unsigned char)character] & character_class)!=0;
 }
 
 template <class T>
-int vector_find(vector<T> vec, T item) {
+int vector_find(const vector<T>& vec, const T& item) {
     for (int i=0; i<vec.size(); i++) {
         if (vec[i] == item) {
             return i;
@@ -41,9 +79,21 @@ OperationDetails::OperationDetails(string function, NodeMathOperation operation,
     this->no_of_params = no_of_params;
 }
 
+const vector<OperatorDetails> ExpressionParser::OPERATORS_DETAILS {
+    OperatorDetails('(', 1, grouping_only),
+    OperatorDetails(')', 1, grouping_only),
+    OperatorDetails('^', 2, right_associative),
+    OperatorDetails('%', 3, left_associative),
+    OperatorDetails('/', 3, left_associative),
+    OperatorDetails('*', 3, left_associative),
+    OperatorDetails('-', 4, left_associative),
+    OperatorDetails('+', 4, left_associative),
+    OperatorDetails(',', 100, grouping_only),
+};
+
 OperatorDetails ExpressionParser::get_operator_details(char op) {
     //cout << "Searching for " << op << "\n";
-    for (OperatorDetails details: OPERATORS_DETAILS) {
+    for (const OperatorDetails& details: OPERATORS_DETAILS) {
         //cout << "Checking against " << details.op << "\n";
         if (details.op==op) {
             //cout << "Found " << details.op << ", " << details.precedence << ", " << details.associativity << "\n";
@@ -53,24 +103,28 @@ OperatorDetails ExpressionParser::get_operator_details(char op) {
     return OPERATORS_DETAILS[0];
 }
 
-optional<OperationDetails> ExpressionParser::get_function_details(string op) {
+optional<OperationDetails> ExpressionParser::get_function_details(string_view op) {
     //cout << "Searching for " << op << "\n";
-    auto search = FUNCTIONS_MAPPING.find(op);
-    if (search==FUNCTIONS_MAPPING.end()) {
+    const FunctionEntry* search = FUNCTIONS.find(op);
+    if (!search) {
         return {};
     } else {
-        return search->second;
+        return OperationDetails(string(search->name), search->operation, search->no_of_params);
     }
 }
 
-NumberToken::NumberToken() {}
+NumberToken::NumberToken() {
+    this->type=TOKEN_NUMBER;
+}
 
-NumberToken::NumberToken(string text) {
+NumberToken::NumberToken(string_view text) {
+    this->type=TOKEN_NUMBER;
     this->text=text;
     this->value=NAN;
 }
 
-NumberToken::NumberToken(string text, float value) {
+NumberToken::NumberToken(string_view text, float value) {
+    this->type=TOKEN_NUMBER;
     this->text=text;
     this->value=value;
 }
@@ -79,20 +133,60 @@ void NumberToken::set_value(float value) {
     this->value=value;
 }
 
-VariableToken::VariableToken() {}
+VariableToken::VariableToken() {
+    this->type=TOKEN_VARIABLE;
+}
 
-VariableToken::VariableToken(string text) {
+VariableToken::VariableToken(string_view text) {
+    this->type=TOKEN_VARIABLE;
     this->text=text;
 }
 
-OperationToken::OperationToken() {}
+OperationToken::OperationToken() {
+    this->type=TOKEN_OPERATION;
+}
 
-OperationToken::OperationToken(string text, bool is_prefix, bool is_function, short no_of_params, NodeMathOperation operation) {
+OperationToken::OperationToken(string_view text, bool is_prefix, bool is_function, short no_of_params, NodeMathOperation operation,
+                               int function) {
+    this->type=TOKEN_OPERATION;
     this->text=text;
     this->is_prefix=is_prefix;
     this->is_function=is_function;
     this->no_of_params=no_of_params;
     this->operation=operation;
+    this->function=function;
+}
+
+NumberToken* TokenArena::new_number(string_view text, float value, double precise_value) {
+    NumberToken* token = numbers.allocate();
+    token->text = text;
+    token->value = value;
+    token->precise_value = precise_value;
+    return token;
+}
+
+VariableToken* TokenArena::new_variable(string_view text) {
+    VariableToken* token = variables.allocate();
+    token->text = text;
+    return token;
+}
+
+OperationToken* TokenArena::new_operation(string_view text, bool is_prefix, bool is_function, short no_of_params,
+                                          NodeMathOperation operation, int function) {
+    OperationToken* token = operations.allocate();
+    token->text = text;
+    token->is_prefix = is_prefix;
+    token->is_function = is_function;
+    token->no_of_params = no_of_params;
+    token->operation = operation;
+    token->function = function;
+    return token;
+}
+
+void TokenArena::reset() {
+    numbers.reset();
+    variables.reset();
+    operations.reset();
 }
 
 ExpressionParser::ExpressionParser() {}
@@ -108,51 +202,65 @@ void ExpressionParser::set_expression(const char *expression)
 
 bool ExpressionParser::is_digit(char character)
 {
-    return vector_contains(DIGITS, character);
+    return has_class(character, CHARACTER_DIGIT);
 }
 
 bool ExpressionParser::is_letter(char character) {
-    return vector_contains(LETTERS, character);
+    return has_class(character, CHARACTER_LETTER);
 }
 
 bool ExpressionParser::is_whitespace(char character) {
-    return vector_contains(WHITESPACE, character);
+    return has_class(character, CHARACTER_WHITESPACE);
 }
 
 bool ExpressionParser::is_exponent(char character) {
-    return vector_contains(EXPONENTS, character);
+    return has_class(character, CHARACTER_EXPONENT);
 }
 
 bool ExpressionParser::is_operator(char character) {
-    for (OperatorDetails op_details: OPERATORS_DETAILS) {
-        if (op_details.op==character) {
-            return true;
-        }
-    }
-    return false;
+    return has_class(character, CHARACTER_OPERATOR);
 }
 
-// TODO - Does this need to be part of the class?
-//        Looks like a utility method that has no 
-//        dependencies other than std ones.  
-bool ExpressionParser::is_number(string text) {
-    char* pEnd;
-    const char* text_c_str = text.c_str(); 
-
-    /*float parsed_to_f = */strtof(text.c_str(), &pEnd);
-    size_t num_length = (size_t)(pEnd-text_c_str);
-    bool valid_parse = text.size() == num_length;
-    // cout << "strtof() got this: " << parsed_to_d << "; Length is " << num_length << ", Valid Parse=" << valid_parse << "\n";
+/* Parses the whole of text as a number, or fails. Unlike strtof this does not
+   depend on the C locale, but it accepts the same token forms: decimal with an
+   optional exponent, hexadecimal after 0x, inf and nan. The text is read both as
+   a float and as a double, so each is correctly rounded from the source. */
+bool ExpressionParser::parse_number(string_view text, float& value, double& precise_value) {
+    const char* first = text.data();
+    const char* last = text.data() + text.size();
+    chars_format format = chars_format::general;
+    if (text.size()>2 && text[0]=='0' && (text[1]=='x' || text[1]=='X')) {
+        first += 2;
+        format = chars_format::hex;
+    }
+    from_chars_result result = from_chars(first, last, value, format);
+    if (result.ptr!=last) {
+        return false;
+    }
+    if (result.ec==errc::result_out_of_range) {
+        /* Rare; strtof gives the infinity or denormal that such literals always meant. */
+        value = strtof(string(text).c_str(), nullptr);
+    } else if (result.ec!=errc()) {
+        return false;
+    }
+    if (from_chars(first, last, precise_value, format).ec!=errc()) {
+        precise_value = strtod(string(text).c_str(), nullptr);
+    }
+    return true;
+}
 
-    return valid_parse;
+bool ExpressionParser::is_number(string_view text) {
+    float value;
+    double precise_value;
+    return parse_number(text, value, precise_value);
 }
 
-bool ExpressionParser::is_variable(string text) {
+bool ExpressionParser::is_variable(string_view text) {
     if (!is_letter(text[0]) && text[0]!='_') {
         return false;
     } else {
         for (int i=1; i<text.size()-1; i++) {
-            if (!is_letter(text[i]) && !is_digit(text[i]) && text[i]!='_') {
+            if (!has_class(text[i], CHARACTER_LETTER | CHARACTER_DIGIT) && text[i]!='_') {
                 return false;
             }
         }
@@ -160,37 +268,31 @@ bool ExpressionParser::is_variable(string text) {
     return true;
 }
 
-float ExpressionParser::get_number(string text) {
-    char* pEnd;
-    const char* text_c_str = text.c_str(); 
-    float parsed_to_f = strtof(text.c_str(), &pEnd);
-    size_t num_length = (size_t)(pEnd-text_c_str);
-    bool valid_parse = text.size() == num_length;
-
-    if (valid_parse) {
-        return parsed_to_f;
+float ExpressionParser::get_number(string_view text) {
+    float value;
+    double precise_value;
+    if (parse_number(text, value, precise_value)) {
+        return value;
     } else {
         return 0.0;
     }
 }
 
-bool ExpressionParser::is_constant(string text) {
-    auto search = CONSTANTS.find(text);
-    return (search!=CONSTANTS.end());
+bool ExpressionParser::is_constant(string_view text) {
+    return CONSTANTS.find(text)!=nullptr;
 }
 
-float ExpressionParser::get_constant(string text) {
-    auto search = CONSTANTS.find(text);
-    if (search!=CONSTANTS.end()) {
-        return search->second;
+float ExpressionParser::get_constant(string_view text) {
+    const ConstantEntry* search = CONSTANTS.find(text);
+    if (search) {
+        return (float)search->value;
     } else {
         return 0;
     }
 }
 
-bool ExpressionParser::is_function(string text) {
-    auto search = FUNCTIONS_MAPPING.find(text);
-    return (search!=FUNCTIONS_MAPPING.end());
+bool ExpressionParser::is_function(string_view text) {
+    return FUNCTIONS.find(text)!=nullptr;
 }
 
 /* Checks if current operator token has precedence over previous operator token (using new operation token) */
@@ -211,166 +313,265 @@ void ExpressionParser::pop_operationstack_to_outqueue() {
     operation_stack.pop();
 }
 
-char ExpressionParser::get_last_printable_char_before(int index) {
-    if (index>0) {
-        int pos=index-1;
-        while (pos>=0) {
-            if (!is_whitespace(expression[pos])) {
-                return expression[pos];
-            }
-            pos--;
+/* Whether a token ends before current_char: at every operator and whitespace
+   character and after every operator, except around an exponent's 'E' ("1E-3"). */
+bool ExpressionParser::is_token_boundary(char before_previous_char, char previous_char, char current_char) {
+    unsigned char current_class = CHARACTER_CLASSES.classes[(unsigned char)current_char];
+    unsigned char previous_class = CHARACTER_CLASSES.classes[(unsigned char)previous_char];
+    return ((current_class & CHARACTER_OPERATOR) && !(previous_class & CHARACTER_EXPONENT))
+        || (current_class & CHARACTER_WHITESPACE)
+        || ((previous_class & CHARACTER_OPERATOR) && !has_class(before_previous_char, CHARACTER_EXPONENT));
+}
+
+/* prev_token_char is the last non-whitespace character before token_start, or '\0'. */
+bool ExpressionParser::add_token(int token_start, int token_end, char prev_token_char) {
+    if (token_start<token_end) {
+        Expression_Token* token_new = read_token(token_start, token_end, prev_token_char);
+        if (!token_new) {
+            return false;
+        }
+        if (token_new->text!="|") {
+            push_token(token_new);
         }
     }
-    return '\0';
+    return true;
 }
 
-bool ExpressionParser::add_token(int token_start, int token_end) {
-    if (token_start<token_end) {
-        string token_name(expression+token_start, expression+token_end);
-        NodeMathOperation operation;
-        Expression_Token* token_new = nullptr;
-        if (is_operator(expression[token_start])) {
-            char prev_token_char = get_last_printable_char_before(token_start);
-            bool is_prefix;
-            bool is_function;
-            if ((token_start==0)
-                || (is_operator(prev_token_char) 
-                    && prev_token_char!=')')) {
-                if (token_name=="-") {
-
-                    token_name="neg";
-                    is_prefix = true;
-                    is_function = true;
-                } else if (token_name=="+") {
-
-                    token_name="|";
-                    is_prefix = true;
-                    is_function = true;
-                } else {
-
-                    is_prefix = true;
-                    is_function = false;
-                }
+/* The token [token_start, token_end), or nullptr if it is not one. A prefix '+'
+   comes back as "|", which changes nothing and is dropped. */
+Expression_Token* ExpressionParser::read_token(int token_start, int token_end, char prev_token_char) {
+    string_view token_name(expression+token_start, token_end-token_start);
+    Expression_Token* token_new = nullptr;
+    float number_value;
+    double precise_number_value;
+    if (is_operator(expression[token_start])) {
+        bool is_prefix;
+        bool is_function;
+        if ((token_start==0)
+            || (is_operator(prev_token_char) 
+                && prev_token_char!=')')) {
+            if (token_name=="-") {
+
+                token_name="neg";
+                is_prefix = true;
+                is_function = true;
+            } else if (token_name=="+") {
+
+                token_name="|";
+                is_prefix = true;
+                is_function = true;
             } else {
 
-                is_prefix = false;
+                is_prefix = true;
                 is_function = false;
             }
-            optional<OperationDetails> op_map = get_function_details(token_name);
-            if (op_map.has_value()) {
-                operation = op_map.value().operation;
-                token_new = new OperationToken(token_name, is_prefix, is_function,
-                                            op_map.value().no_of_params,
-                                            op_map.value().operation);
+        } else {
+
+            is_prefix = false;
+            is_function = false;
+        }
+        const FunctionEntry* op_map = FUNCTIONS.find(token_name);
+        if (op_map) {
+            token_new = arena.new_operation(token_name, is_prefix, is_function,
+                                        op_map->no_of_params,
+                                        op_map->operation);
 
-            } else {
-                token_new = new OperationToken(token_name, false, true,
-                                                0, NODE_MATH_ABSOLUTE);
-            }
-        } else if (is_number(token_name)) {
-            token_new = new NumberToken(token_name, get_number(token_name));
-        } else if (is_function(token_name)) {
-            optional<OperationDetails> op_map = get_function_details(token_name);
-            if (op_map.has_value()) {
-                operation = op_map.value().operation;
-                token_new = new OperationToken(token_name, true, true,
-                                            op_map.value().no_of_params,
-                                            op_map.value().operation);
-            } else {
-                cerr << "Should never reach here. If token is a function, then op_map MUST get created.\n";
-            }
-        } else if (is_constant(token_name)) {
-            token_new = new NumberToken(token_name, get_constant(token_name));
-        } else if (is_variable(token_name)) {
-            token_new = new VariableToken(token_name);
         } else {
-            cerr << "Invalid token " << token_name << "\n";
-            return false;
+            token_new = arena.new_operation(token_name, false, true,
+                                            0, NODE_MATH_ABSOLUTE);
         }
+    } else if (parse_number(token_name, number_value, precise_number_value)) {
+        token_new = arena.new_number(token_name, number_value, precise_number_value);
+    } else if (const FunctionEntry* op_map = FUNCTIONS.find(token_name)) {
+        token_new = arena.new_operation(token_name, true, true,
+                                        op_map->no_of_params,
+                                        op_map->operation);
+    } else if (const ConstantEntry* constant = CONSTANTS.find(token_name)) {
+        token_new = arena.new_number(token_name, (float)constant->value, constant->value);
+    } else if (int function = FunctionRegistry::find(token_name); function>=0) {
+        token_new = arena.new_operation(token_name, true, true, FunctionRegistry::get(function).arity,
+                                        NODE_MATH_ADD, function);
+    } else if (is_variable(token_name)) {
+        token_new = arena.new_variable(token_name);
+    }
+    return token_new;
+}
 
-        if (token_name=="|") {
-            return true;
-        }
-
-        if (dynamic_cast<NumberToken*>(token_new) || dynamic_cast<VariableToken*>(token_new)) {
-            // cout << "Found a number" << "\n";
-            output_queue_new.push(token_new);
-        } else if (dynamic_cast<OperationToken*>(token_new)) {
-            OperationToken* opToken = dynamic_cast<OperationToken*>(token_new);
-            // cout << "Found an op: " << opToken->text << "\n";
-            if (opToken->text=="("
-                || operation_stack.size()==0
-                || (operation_stack.top()->text=="(" && opToken->text[0]!=')' && opToken->text[0]!=',')
-                || opToken->is_prefix==true) {
-                // cout << "\tFirst element to stack, or handling brackets, or handling prefix operation: " << opToken->text << "\n";
-                operation_stack.push(opToken);
-            } else if (opToken->text==")" || opToken->text==",") {
-                // cout << "\top is " << opToken->text << "\n";
-                while (!operation_stack.empty() && operation_stack.top()->text[0]!='(') {
-                    // cout << "Moving " << operator_stack.top().token << " to queue\n";
-                    pop_operationstack_to_outqueue();
-                }
-                // cout << "Hopefully popping left bracket off stack: " << operator_stack.top().token << "\n";
-                if (opToken->text!=",") {
-                    if (!operation_stack.empty()) {
-                        operation_stack.pop();
-                    }
+/* One step of the shunting-yard over the token read last. */
+void ExpressionParser::push_token(Expression_Token* token_new) {
+    if (token_new->type==TOKEN_NUMBER || token_new->type==TOKEN_VARIABLE) {
+        // cout << "Found a number" << "\n";
+        output_queue_new.push(token_new);
+    } else if (token_new->type==TOKEN_OPERATION) {
+        OperationToken* opToken = static_cast<OperationToken*>(token_new);
+        // cout << "Found an op: " << opToken->text << "\n";
+        if (opToken->text=="("
+            || operation_stack.size()==0
+            || (operation_stack.top()->text=="(" && opToken->text[0]!=')' && opToken->text[0]!=',')
+            || opToken->is_prefix==true) {
+            // cout << "\tFirst element to stack, or handling brackets, or handling prefix operation: " << opToken->text << "\n";
+            operation_stack.push(opToken);
+        } else if (opToken->text==")" || opToken->text==",") {
+            // cout << "\top is " << opToken->text << "\n";
+            while (!operation_stack.empty() && operation_stack.top()->text[0]!='(') {
+                // cout << "Moving " << operator_stack.top().token << " to queue\n";
+                pop_operationstack_to_outqueue();
+            }
+            // cout << "Hopefully popping left bracket off stack: " << operator_stack.top().token << "\n";
+            if (opToken->text!=",") {
+                if (!operation_stack.empty()) {
+                    operation_stack.pop();
                 }
-            } else if (!has_precedence(operation_stack.top(), opToken)) {
-                // cout << "\top doesn't have precedence:: " << opToken->text << "\n";
-                do {
-                    pop_operationstack_to_outqueue();
-                } while (!operation_stack.empty() && !has_precedence(operation_stack.top(), opToken) && operation_stack.top()->text[0]!='(');
-                operation_stack.push(opToken);
-            } else {
-                // cout << "\top has precedence:: " << opToken->text << "\n";
-                // cout << "\tPushing op to stack: " << opToken->text << "\n";
-                operation_stack.push(opToken);
             }
+        } else if (!has_precedence(operation_stack.top(), opToken)) {
+            // cout << "\top doesn't have precedence:: " << opToken->text << "\n";
+            do {
+                pop_operationstack_to_outqueue();
+            } while (!operation_stack.empty() && !has_precedence(operation_stack.top(), opToken) && operation_stack.top()->text[0]!='(');
+            operation_stack.push(opToken);
+        } else {
+            // cout << "\top has precedence:: " << opToken->text << "\n";
+            // cout << "\tPushing op to stack: " << opToken->text << "\n";
+            operation_stack.push(opToken);
         }
-        // cout << token_new->text << " | ";
-        // dump_stack(false);
-        // cout << " | ";
-        // dump_queue(false);
-        // cout << "\n";
     }
-    return true;
+    // cout << token_new->text << " | ";
+    // dump_stack(false);
+    // cout << " | ";
+    // dump_queue(false);
+    // cout << "\n";
 }
 
-void ExpressionParser::parse() {
-    operation_stack = stack<OperationToken *>();
-    output_queue_new = queue<Expression_Token *>();
+CompiledExpression ExpressionParser::parse() {
+    /* Emptied rather than replaced, so their storage is reused from one parse to the next. */
+    while (!operation_stack.empty()) {
+        operation_stack.pop();
+    }
+    while (!output_queue_new.empty()) {
+        output_queue_new.pop();
+    }
+    arena.reset();
+    /* One forward pass. The two previous characters and the last non-whitespace
+       character before the current token are carried along instead of being looked
+       up again, so nothing before the start of the string is ever read. */
     int i = 0;
     int token_start=0;
+    char previous_char = '\0';
+    char before_previous_char = '\0';
+    char last_printable_char = '\0';
+    char printable_before_token = '\0';
     char current_char = expression[i];
     while (current_char!='\0') {
-        if(((is_operator(current_char) && (i==0 || !is_exponent(expression[i-1])))) 
-            || (is_whitespace(current_char))
-            || (is_operator(expression[i-1]) && (i<2 || !is_exponent(expression[i-2])))
-            ) {
-            bool token_added = add_token(token_start, i);
+        bool is_space = has_class(current_char, CHARACTER_WHITESPACE);
+        if (is_token_boundary(before_previous_char, previous_char, current_char)) {
+            bool token_added = add_token(token_start, i, printable_before_token);
             if (!token_added) {
-                cerr << "Token start: " << token_start << ", token end: " << i << "\n";
-                throw invalid_argument("Parsing error, Invalid token found.");
+                throw invalid_argument("Parsing error, Invalid token found: "
+                                       + string(expression+token_start, i-token_start));
             }
             token_start=i;
-            if (is_whitespace(current_char)) {
+            if (is_space) {
                 token_start++;
             }
+            printable_before_token = last_printable_char;
+        }
+        if (!is_space) {
+            last_printable_char = current_char;
         }
+        before_previous_char = previous_char;
+        previous_char = current_char;
         i++;
         current_char = expression[i];
     }
-    bool token_added = add_token(token_start, i);
+    bool token_added = add_token(token_start, i, printable_before_token);
     if (!token_added) {
         this->valid_queue = false;
-        throw invalid_argument("Parsing error, Invalid token found. (adding operator)");
+        throw invalid_argument("Parsing error, Invalid token found: "
+                               + string(expression+token_start, i-token_start));
     }
     while (!operation_stack.empty()) {
         output_queue_new.push(operation_stack.top());
         operation_stack.pop();
     }
+    /* Flatten the output queue into plain instructions: resolve variable names to
+       dense slots, move number values into the constant pool and size the evaluation
+       stack once, here, so that evaluation never looks at a token again. */
+    vector<Instruction> program;
+    vector<float> constants;
+    vector<double> precise_constants;
+    vector<string> variables;
+    /* Sized for the worst case, so building the program does not reallocate. */
+    program.reserve(output_queue_new.size());
+    constants.reserve(output_queue_new.size());
+    precise_constants.reserve(output_queue_new.size());
+    variables.reserve(output_queue_new.size());
+    int depth = 0;
+    int max_depth = 0;
+    while (!output_queue_new.empty()) {
+        Expression_Token* token = output_queue_new.front();
+        output_queue_new.pop();
+        Instruction instruction;
+        switch (token->type) {
+            case TOKEN_VARIABLE:
+                instruction.kind = INSTRUCTION_VARIABLE;
+                instruction.arity = 0;
+                instruction.operation = 0;
+                instruction.index = 0;
+                while ((size_t)instruction.index<variables.size() && variables[instruction.index]!=token->text) {
+                    instruction.index++;
+                }
+                if ((size_t)instruction.index==variables.size()) {
+                    variables.push_back(string(token->text));
+                }
+                depth++;
+                break;
+            case TOKEN_NUMBER:
+                instruction.kind = INSTRUCTION_CONSTANT;
+                instruction.arity = 0;
+                instruction.operation = 0;
+                instruction.index = constants.size();
+                constants.push_back(static_cast<NumberToken*>(token)->value);
+                precise_constants.push_back(static_cast<NumberToken*>(token)->precise_value);
+                depth++;
+                break;
+            case TOKEN_OPERATION: {
+                OperationToken* opToken = static_cast<OperationToken*>(token);
+                /* Registered functions were checked for 1 to MAX_FUNCTION_ARITY when they were added */
+                if (opToken->function<0 && (opToken->no_of_params<1 || opToken->no_of_params>3)) {
+                    this->valid_queue = false;
+                    throw invalid_argument("Only 1-3 parameters supported. Found " + string(opToken->text)
+                                           + " with " + to_string(opToken->no_of_params));
+                }
+                instruction.kind = opToken->function<0 ? INSTRUCTION_OPERATION : INSTRUCTION_CALL;
+                instruction.arity = opToken->no_of_params;
+                instruction.operation = opToken->function<0 ? opToken->operation : 0;
+                instruction.index = opToken->function<0 ? 0 : opToken->function;
+                depth -= opToken->no_of_params - 1;
+                break;
+            }
+        }
+        if (depth<1) {
+            this->valid_queue = false;
+            throw invalid_argument("Parsing error, missing operand for " + string(token->text));
+        }
+        max_depth = max(max_depth, depth);
+        program.push_back(instruction);
+    }
+    compiled = CompiledExpression(expression, move(program), move(constants), move(variables), max_depth,
+                                  0, 1, move(precise_constants));
+    if (optimize) {
+        compiled = compiled.optimized();
+    }
     this->valid_queue = true;
+    return compiled;
+}
+
+void ExpressionParser::set_optimize(bool optimize) {
+    this->optimize = optimize;
+}
+
+const CompiledExpression& ExpressionParser::get_compiled() const {
+    return compiled;
 }
 
 bool ExpressionParser::can_evaluate() {
@@ -379,110 +580,990 @@ bool ExpressionParser::can_evaluate() {
 
 float ExpressionParser::evaluate(map<string, float> variables)
 {
-  stack<float> evaluation_stack;
-
-  // cout << "\n";
-
-  while (!output_queue_new.empty()) {
-    Expression_Token *curr_token = output_queue_new.front();
-    if (dynamic_cast<VariableToken *>(curr_token)) {
-      // cout << "Pushing " << curr_token.token << "=" << variables.at(curr_token.token) << ", ";
-        float value; 
-        auto search = variables.find(curr_token->text);
-        if (search==variables.end()) {
-            throw invalid_argument("Missing value for variable: " + curr_token->text);
-        } else {
-            value = search->second;
-        }
-
-        evaluation_stack.push(value);
-    }
-    else if (dynamic_cast<NumberToken *>(curr_token)) {
-      NumberToken *num_token = dynamic_cast<NumberToken *>(curr_token);
-      // cout << "Pushing " << num_token->value << ", ";
-      evaluation_stack.push(num_token->value);
-    }
-    else if (dynamic_cast<OperationToken *>(curr_token)) {
-      OperationToken *opToken = dynamic_cast<OperationToken *>(curr_token);
-      if (opToken->no_of_params == 1) {
-        float x = evaluation_stack.top();
-        evaluation_stack.pop();
-        // cout << "Evaluating " << opToken->text << "[" << curr_token.operation<< "]" << "(" << x
-        // << ")\n";
-        float result;
-        bool success = blender::nodes::try_dispatch_float_math_fl_to_fl(
-            opToken->operation, [&](auto math_function) {
-              result = math_function(x);
-            });
-        evaluation_stack.push(result);
-      }
-      else if (opToken->no_of_params == 2) {
-        float y = evaluation_stack.top();
-        evaluation_stack.pop();
-        float x = evaluation_stack.top();
-        evaluation_stack.pop();
-        // cout << "Evaluating " << curr_token.token << "[" << curr_token.operation<< "]" << "(" <<
-        // x << "," << y << ")";
-        float result;
-        bool success = blender::nodes::try_dispatch_float_math_fl_fl_to_fl(
-            opToken->operation, [&](auto math_function) {
-              result = math_function(x, y);
+  return compiled.evaluate(variables);
+}
+
+CompiledExpression::CompiledExpression() : variables(make_shared<const vector<string>>()) {}
+
+CompiledExpression::CompiledExpression(string source, vector<Instruction> program, vector<float> constants,
+                                       vector<string> variables, int stack_depth,
+                                       int temp_count, int result_count,
+                                       vector<double> precise_constants) {
+    /* Without a precise pool, the float constants are all there is. */
+    if (precise_constants.size()!=constants.size()) {
+        precise_constants.assign(constants.begin(), constants.end());
+    }
+    this->source = move(source);
+    this->program = SharedArray<Instruction>(move(program));
+    this->constants = SharedArray<float>(move(constants));
+    this->precise_constants = SharedArray<double>(move(precise_constants));
+    this->variables = make_shared<const vector<string>>(move(variables));
+    this->stack_depth = stack_depth;
+    this->temp_count = temp_count;
+    this->result_count = result_count;
+}
+
+CompiledExpression::CompiledExpression(string source, SharedArray<Instruction> program, SharedArray<float> constants,
+                                       SharedArray<double> precise_constants, shared_ptr<const vector<string>> variables,
+                                       int stack_depth, int temp_count, int result_count)
+    : source(move(source)), program(move(program)), constants(move(constants)),
+      precise_constants(move(precise_constants)), variables(move(variables)),
+      stack_depth(stack_depth), temp_count(temp_count), result_count(result_count) {}
+
+bool CompiledExpression::empty() const {
+    return program.empty();
+}
+
+const string& CompiledExpression::get_source() const {
+    return source;
+}
+
+const SharedArray<Instruction>& CompiledExpression::get_program() const {
+    return program;
+}
+
+const SharedArray<float>& CompiledExpression::get_constants() const {
+    return constants;
+}
+
+const SharedArray<double>& CompiledExpression::get_precise_constants() const {
+    return precise_constants;
+}
+
+int CompiledExpression::get_result_count() const {
+    return result_count;
+}
+
+int CompiledExpression::get_stack_depth() const {
+    return stack_depth;
+}
+
+int CompiledExpression::get_temp_count() const {
+    return temp_count;
+}
+
+CompiledExpression CompiledExpression::optimized() const {
+    if (program.empty()) {
+        return *this;
+    }
+    return ExpressionTree(*this).simplified().to_compiled(source, *variables);
+}
+
+CompiledExpression CompiledExpression::derivative(const string& variable) const {
+    return ExpressionTree(*this).differentiated(get_slot(variable)).simplified()
+        .to_compiled("d(" + source + ")/d" + variable, *variables);
+}
+
+CompiledExpression CompiledExpression::combine(const vector<CompiledExpression>& expressions) {
+    /* A program without results has nothing for evaluate_all() to write */
+    if (expressions.empty()) {
+        throw invalid_argument("No expressions to combine");
+    }
+    vector<string> variables;
+    ExpressionTree tree;
+    string source;
+    for (const CompiledExpression& expression: expressions) {
+        /* Variables with the same name share one slot in the combined program */
+        vector<int> slot_map;
+        for (const string& name: *expression.variables) {
+            int slot = vector_find(variables, name);
+            if (slot<0) {
+                slot = variables.size();
+                variables.push_back(name);
+            }
+            slot_map.push_back(slot);
+        }
+        tree.add_expression(expression, slot_map);
+        source += (source.empty() ? "" : "; ") + expression.source;
+    }
+    return tree.simplified().to_compiled(source, variables);
+}
+
+int CompiledExpression::get_slot(const string& name) const {
+    for (size_t slot=0; slot<variables->size(); slot++) {
+        if ((*variables)[slot]==name) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/* The single-result methods give result 0. A program from combine() stores several,
+   so the others are written to scratch columns of `rows` values each. */
+template <class T>
+static vector<T *> scratch_result_columns(T *results, int result_count, size_t rows, vector<T> &scratch)
+{
+  scratch.resize(rows * (result_count - 1));
+  vector<T *> result_columns(1, results);
+  for (int result = 1; result < result_count; result++) {
+    result_columns.push_back(scratch.data() + (result - 1) * rows);
+  }
+  return result_columns;
+}
+
+template <class T>
+T CompiledExpression::evaluate_as(const T* values) const
+{
+  if (result_count > 1) {
+    vector<T> results(result_count);
+    evaluate_all_as(values, results.data());
+    return results[0];
+  }
+  T result;
+  evaluate_all_as(values, &result);
+  return result;
+}
+
+template <class T>
+void CompiledExpression::evaluate_batch_as(const T* const* columns, T* results, size_t rows) const
+{
+  if (result_count > 1) {
+    vector<T> scratch;
+    evaluate_batch_all_as(columns, scratch_result_columns(results, result_count, rows, scratch).data(), rows);
+    return;
+  }
+  T *result_columns[1] = {results};
+  evaluate_batch_all_as(columns, result_columns, rows);
+}
+
+template <>
+void CompiledExpression::evaluate_all_as<float>(const float* values, float* results) const
+{
+  evaluate_all(values, results);
+}
+
+template <>
+void CompiledExpression::evaluate_batch_all_as<float>(const float* const* columns, float* const* results,
+                                                      size_t rows) const
+{
+  evaluate_batch_all(columns, results, rows);
+}
+
+/* Registered functions take floats, so other value types are converted both ways. */
+template <class T>
+static T call_as_float(const Instruction &instruction, const T *args)
+{
+  const RegisteredFunction &function = FunctionRegistry::get(instruction.index);
+  float float_args[MAX_FUNCTION_ARITY];
+  for (int i = 0; i < instruction.arity; i++) {
+    float_args[i] = (float)(double)args[i];
+  }
+  return T((double)function.call(function.state, float_args));
+}
+
+/* Same as evaluate_all(), for any value type. */
+template <class T>
+void CompiledExpression::evaluate_all_as(const T* values, T* results) const
+{
+  T local_stack[EVALUATION_STACK_SIZE];
+  T local_temps[EVALUATION_TEMP_SIZE];
+  vector<T> heap_stack;
+  vector<T> heap_temps;
+  T *evaluation_stack = local_stack;
+  T *temps = local_temps;
+  if (stack_depth > EVALUATION_STACK_SIZE) {
+    heap_stack.resize(stack_depth);
+    evaluation_stack = heap_stack.data();
+  }
+  if (temp_count > EVALUATION_TEMP_SIZE) {
+    heap_temps.resize(temp_count);
+    temps = heap_temps.data();
+  }
+  int top = 0;
+
+  for (const Instruction &instruction : program) {
+    switch (instruction.kind) {
+      case INSTRUCTION_CONSTANT:
+        evaluation_stack[top++] = T(precise_constants[instruction.index]);
+        break;
+      case INSTRUCTION_VARIABLE:
+        evaluation_stack[top++] = values[instruction.index];
+        break;
+      case INSTRUCTION_LOAD_TEMP:
+        evaluation_stack[top++] = temps[instruction.index];
+        break;
+      case INSTRUCTION_STORE_TEMP:
+        temps[instruction.index] = evaluation_stack[top - 1];
+        break;
+      case INSTRUCTION_STORE_RESULT:
+        results[instruction.index] = evaluation_stack[--top];
+        break;
+      case INSTRUCTION_CALL: {
+        T *args = evaluation_stack + top - instruction.arity;
+        top -= instruction.arity - 1;
+        evaluation_stack[top - 1] = call_as_float(instruction, args);
+        break;
+      }
+      case INSTRUCTION_OPERATION: {
+        T *args = evaluation_stack + top - instruction.arity;
+        T result = T(0.0);
+        if (instruction.arity == 1) {
+          blender::nodes::try_dispatch_value_math_v_to_v<T>(
+              instruction.operation, [&](auto math_function) { result = math_function(args[0]); });
+        }
+        else if (instruction.arity == 2) {
+          blender::nodes::try_dispatch_value_math_v_v_to_v<T>(
+              instruction.operation, [&](auto math_function) { result = math_function(args[0], args[1]); });
+        }
+        else {
+          blender::nodes::try_dispatch_value_math_v_v_v_to_v<T>(
+              instruction.operation,
+              [&](auto math_function) { result = math_function(args[0], args[1], args[2]); });
+        }
+        top -= instruction.arity - 1;
+        evaluation_stack[top - 1] = result;
+        break;
+      }
+    }
+  }
+  if (top == 1) {
+    results[0] = evaluation_stack[0];
+  }
+  else if (top > 1) {
+    cerr << "Stack not compeletely evaluated: " << source << " Stack size='"
+         << top << "'\n";
+    results[0] = evaluation_stack[top - 1];
+  }
+  else if (program.empty()) {
+    cerr << "Nothing to return!\n";
+    results[0] = T(0.0);
+  }
+}
+
+/* Same as evaluate_batch_all(), for any value type. There are no vector kernels
+   here; the per-block loops call one concrete math function each. */
+template <class T>
+void CompiledExpression::evaluate_batch_all_as(const T* const* columns, T* const* results, size_t rows) const
+{
+  vector<T> block_stack(max(stack_depth, 1) * BATCH_BLOCK_SIZE);
+  vector<T> block_temps(temp_count * BATCH_BLOCK_SIZE);
+  auto block = [&](int index) { return block_stack.data() + index * BATCH_BLOCK_SIZE; };
+  auto temp = [&](int index) { return block_temps.data() + index * BATCH_BLOCK_SIZE; };
+
+  for (size_t start = 0; start < rows; start += BATCH_BLOCK_SIZE) {
+    size_t count = min((size_t)BATCH_BLOCK_SIZE, rows - start);
+    int top = 0;
+    for (const Instruction &instruction : program) {
+      if (instruction.kind == INSTRUCTION_VARIABLE) {
+        const T *column = columns[instruction.index] + start;
+        copy(column, column + count, block(top++));
+      }
+      else if (instruction.kind == INSTRUCTION_CONSTANT) {
+        fill_n(block(top++), count, T(precise_constants[instruction.index]));
+      }
+      else if (instruction.kind == INSTRUCTION_LOAD_TEMP) {
+        copy(temp(instruction.index), temp(instruction.index) + count, block(top++));
+      }
+      else if (instruction.kind == INSTRUCTION_STORE_TEMP) {
+        copy(block(top - 1), block(top - 1) + count, temp(instruction.index));
+      }
+      else if (instruction.kind == INSTRUCTION_STORE_RESULT) {
+        top--;
+        copy(block(top), block(top) + count, results[instruction.index] + start);
+      }
+      else if (instruction.kind == INSTRUCTION_CALL) {
+        top -= instruction.arity - 1;
+        T *x = block(top - 1);
+        T args[MAX_FUNCTION_ARITY];
+        for (size_t i = 0; i < count; i++) {
+          for (int a = 0; a < instruction.arity; a++) {
+            args[a] = block(top - 1 + a)[i];
+          }
+          x[i] = call_as_float(instruction, args);
+        }
+      }
+      else if (instruction.arity == 1) {
+        T *x = block(top - 1);
+        blender::nodes::try_dispatch_value_math_v_to_v<T>(
+            instruction.operation, [&](auto math_function) {
+              for (size_t i = 0; i < count; i++) {
+                x[i] = math_function(x[i]);
+              }
             });
-        // cout << " = " << result << "\n";
-        evaluation_stack.push(result);
-      }
-      else if (opToken->no_of_params == 3) {
-        float z = evaluation_stack.top();
-        evaluation_stack.pop();
-        float y = evaluation_stack.top();
-        evaluation_stack.pop();
-        float x = evaluation_stack.top();
-        evaluation_stack.pop();
-        // cout << "Evaluating " << curr_token.token << "[" << curr_token.operation<< "]" << "(" <<
-        // x << "," << y << "," << z << ")\n";
-        float result;
-        bool success = blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(
-            opToken->operation,
-            [&](auto math_function) {
-              result = math_function(x, y, z);
+      }
+      else if (instruction.arity == 2) {
+        T *x = block(top - 2);
+        const T *y = block(top - 1);
+        blender::nodes::try_dispatch_value_math_v_v_to_v<T>(
+            instruction.operation, [&](auto math_function) {
+              for (size_t i = 0; i < count; i++) {
+                x[i] = math_function(x[i], y[i]);
+              }
             });
-        evaluation_stack.push(result);
+        top--;
       }
       else {
-        cerr << "Only 1, 2 or 3 parameters are supported Found " << opToken->text
-          << " with " << opToken->no_of_params << ".\n";
-        throw invalid_argument("Only 1-3 parameters supported. Found " + opToken->no_of_params);
+        T *x = block(top - 3);
+        const T *y = block(top - 2);
+        const T *z = block(top - 1);
+        blender::nodes::try_dispatch_value_math_v_v_v_to_v<T>(
+            instruction.operation, [&](auto math_function) {
+              for (size_t i = 0; i < count; i++) {
+                x[i] = math_function(x[i], y[i], z[i]);
+              }
+            });
+        top -= 2;
       }
     }
-    else {
-      cerr << "Unrecognized token type while evaluating!\n";
-      throw invalid_argument("Only 1-3 parameters supported. Found " + curr_token->text);
+    if (top > 0) {
+      copy(block(top - 1), block(top - 1) + count, results[0] + start);
+    }
+    else if (program.empty()) {
+      fill_n(results[0] + start, count, T(0.0));
     }
+  }
+}
+
+#define INSTANTIATE_EVALUATE_AS(T) \
+  template T CompiledExpression::evaluate_as<T>(const T *values) const; \
+  template void CompiledExpression::evaluate_all_as<T>(const T *values, T *results) const; \
+  template void CompiledExpression::evaluate_batch_as<T>(const T *const *columns, T *results, size_t rows) const; \
+  template void CompiledExpression::evaluate_batch_all_as<T>(const T *const *columns, T *const *results, \
+                                                             size_t rows) const;
+
+INSTANTIATE_EVALUATE_AS(float)
+INSTANTIATE_EVALUATE_AS(double)
+INSTANTIATE_EVALUATE_AS(Fixed32)
+INSTANTIATE_EVALUATE_AS(Fixed64)
+
+size_t CompiledExpression::get_memory_size() const {
+    size_t size = sizeof(CompiledExpression) + source.capacity()
+        + program.size() * sizeof(Instruction) + constants.size() * sizeof(float)
+        + precise_constants.size() * sizeof(double);
+    for (const string& variable: *variables) {
+        size += sizeof(string) + variable.capacity();
+    }
+    return size;
+}
+
+const vector<string>& CompiledExpression::get_variables() const {
+    return *variables;
+}
+
+vector<float> CompiledExpression::bind(const map<string, float>& values) const {
+    /* A slot of a shared table that this program never reads can stay 0 */
+    vector<bool> read(variables->size());
+    for (const Instruction& instruction: program) {
+        if (instruction.kind==INSTRUCTION_VARIABLE) {
+            read[instruction.index] = true;
+        }
+    }
+    vector<float> slot_values(variables->size());
+    for (size_t slot=0; slot<variables->size(); slot++) {
+        auto search = values.find((*variables)[slot]);
+        if (search!=values.end()) {
+            slot_values[slot] = search->second;
+        } else if (read[slot]) {
+            throw invalid_argument("Missing value for variable: " + (*variables)[slot]);
+        }
+    }
+    return slot_values;
+}
+
+float CompiledExpression::evaluate(const map<string, float>& variables) const
+{
+  return evaluate(bind(variables).data());
+}
+
+float CompiledExpression::evaluate(const float* values) const
+{
+  if (result_count > 1) {
+    vector<float> results(result_count);
+    evaluate_all(values, results.data());
+    return results[0];
+  }
+  float result = 0.0f;
+  evaluate_all(values, &result);
+  return result;
+}
 
-    // stack<float> temp;
-    // while (!evaluation_stack.empty()) {
-    //     temp.push(evaluation_stack.top());
-    //     evaluation_stack.pop();
-    // }
-    // while(!temp.empty()) {
-    //     evaluation_stack.push(temp.top());
-    //     cout << temp.top() << " ";
-    //     temp.pop();
-    // }
-    output_queue_new.pop();
+void CompiledExpression::evaluate_all(const float* values, float* results) const
+{
+  /* Programs that fit (nearly all of them) run on stack arrays, so evaluating does not allocate. */
+  float local_stack[EVALUATION_STACK_SIZE];
+  float local_temps[EVALUATION_TEMP_SIZE];
+  vector<float> heap_stack;
+  vector<float> heap_temps;
+  float *evaluation_stack = local_stack;
+  float *temps = local_temps;
+  if (stack_depth > EVALUATION_STACK_SIZE) {
+    heap_stack.resize(stack_depth);
+    evaluation_stack = heap_stack.data();
+  }
+  if (temp_count > EVALUATION_TEMP_SIZE) {
+    heap_temps.resize(temp_count);
+    temps = heap_temps.data();
+  }
+  int top = 0;
+
+  for (const Instruction &instruction : program) {
+    switch (instruction.kind) {
+      case INSTRUCTION_CONSTANT:
+        evaluation_stack[top++] = constants[instruction.index];
+        break;
+      case INSTRUCTION_VARIABLE:
+        evaluation_stack[top++] = values[instruction.index];
+        break;
+      case INSTRUCTION_LOAD_TEMP:
+        evaluation_stack[top++] = temps[instruction.index];
+        break;
+      case INSTRUCTION_STORE_TEMP:
+        temps[instruction.index] = evaluation_stack[top - 1];
+        break;
+      case INSTRUCTION_STORE_RESULT:
+        results[instruction.index] = evaluation_stack[--top];
+        break;
+      case INSTRUCTION_CALL: {
+        /* The arguments are in order on the stack already */
+        const RegisteredFunction &function = FunctionRegistry::get(instruction.index);
+        top -= instruction.arity - 1;
+        evaluation_stack[top - 1] = function.call(function.state, evaluation_stack + top - 1);
+        break;
+      }
+      case INSTRUCTION_OPERATION:
+        switch (instruction.arity) {
+          case 1: {
+            float x = evaluation_stack[top - 1];
+            float result = 0.0f;
+            blender::nodes::try_dispatch_float_math_fl_to_fl(
+                instruction.operation, [&](auto math_function) {
+                  result = math_function(x);
+                });
+            evaluation_stack[top - 1] = result;
+            break;
+          }
+          case 2: {
+            float y = evaluation_stack[top - 1];
+            float x = evaluation_stack[top - 2];
+            float result = 0.0f;
+            blender::nodes::try_dispatch_float_math_fl_fl_to_fl(
+                instruction.operation, [&](auto math_function) {
+                  result = math_function(x, y);
+                });
+            top--;
+            evaluation_stack[top - 1] = result;
+            break;
+          }
+          case 3: {
+            float z = evaluation_stack[top - 1];
+            float y = evaluation_stack[top - 2];
+            float x = evaluation_stack[top - 3];
+            float result = 0.0f;
+            blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(
+                instruction.operation, [&](auto math_function) {
+                  result = math_function(x, y, z);
+                });
+            top -= 2;
+            evaluation_stack[top - 1] = result;
+            break;
+          }
+        }
+        break;
+    }
+  }
+  if (top == 1) {
+    results[0] = evaluation_stack[0];
   }
-  if (evaluation_stack.size() == 1) {
-    return evaluation_stack.top();
+  else if (top > 1) {
+    cerr << "Stack not compeletely evaluated: " << source << " Stack size='"
+         << top << "'\n";
+    results[0] = evaluation_stack[top - 1];
   }
-  else if (evaluation_stack.size() == 0) {
+  else if (program.empty()) {
     cerr << "Nothing to return!\n";
-    return 0;
+    results[0] = 0;
+  }
+}
+
+void CompiledExpression::evaluate_batch(const float* const* columns, float* results, size_t rows) const
+{
+  if (result_count > 1) {
+    vector<float> scratch;
+    evaluate_batch_all(columns, scratch_result_columns(results, result_count, rows, scratch).data(), rows);
+    return;
+  }
+  float *result_columns[1] = {results};
+  evaluate_batch_all(columns, result_columns, rows);
+}
+
+void CompiledExpression::evaluate_batch_all(const float* const* columns, float* const* results, size_t rows) const
+{
+  /* Runs the program one operation at a time over blocks of rows, so the operation
+     dispatch happens once per block and the inner loops see a single concrete math
+     function they can inline. Each stack entry and temporary is a whole block of values. */
+  vector<float> block_stack(max(stack_depth, 1) * BATCH_BLOCK_SIZE);
+  vector<float> block_temps(temp_count * BATCH_BLOCK_SIZE);
+  auto block = [&](int index) { return block_stack.data() + index * BATCH_BLOCK_SIZE; };
+  auto temp = [&](int index) { return block_temps.data() + index * BATCH_BLOCK_SIZE; };
+
+  for (size_t start = 0; start < rows; start += BATCH_BLOCK_SIZE) {
+    size_t count = min((size_t)BATCH_BLOCK_SIZE, rows - start);
+    int top = 0;
+    for (const Instruction &instruction : program) {
+      if (instruction.kind == INSTRUCTION_VARIABLE) {
+        const float *column = columns[instruction.index] + start;
+        copy(column, column + count, block(top++));
+      }
+      else if (instruction.kind == INSTRUCTION_CONSTANT) {
+        fill_n(block(top++), count, constants[instruction.index]);
+      }
+      else if (instruction.kind == INSTRUCTION_LOAD_TEMP) {
+        copy(temp(instruction.index), temp(instruction.index) + count, block(top++));
+      }
+      else if (instruction.kind == INSTRUCTION_STORE_TEMP) {
+        copy(block(top - 1), block(top - 1) + count, temp(instruction.index));
+      }
+      else if (instruction.kind == INSTRUCTION_STORE_RESULT) {
+        top--;
+        copy(block(top), block(top) + count, results[instruction.index] + start);
+      }
+      else if (instruction.kind == INSTRUCTION_CALL) {
+        /* One call per block; the result overwrites the first argument, as the kernels do */
+        const RegisteredFunction &function = FunctionRegistry::get(instruction.index);
+        const float *args[MAX_FUNCTION_ARITY];
+        top -= instruction.arity;
+        for (int a = 0; a < instruction.arity; a++) {
+          args[a] = block(top + a);
+        }
+        function.call_batch(function.state, args, block(top), count);
+        top++;
+      }
+      else {
+        if (instruction.arity == 1) {
+          float *x = block(top - 1);
+          blender::nodes::MathKernel_fl_to_fl kernel =
+              blender::nodes::get_math_kernel_fl_to_fl(instruction.operation);
+          if (kernel) {
+            kernel(x, count);
+          }
+          else {
+            blender::nodes::try_dispatch_float_math_fl_to_fl(
+                instruction.operation, [&](auto math_function) {
+                  for (size_t i = 0; i < count; i++) {
+                    x[i] = math_function(x[i]);
+                  }
+                });
+          }
+        }
+        else if (instruction.arity == 2) {
+          float *x = block(top - 2);
+          const float *y = block(top - 1);
+          blender::nodes::MathKernel_fl_fl_to_fl kernel =
+              blender::nodes::get_math_kernel_fl_fl_to_fl(instruction.operation);
+          if (kernel) {
+            kernel(x, y, count);
+          }
+          else {
+            blender::nodes::try_dispatch_float_math_fl_fl_to_fl(
+                instruction.operation, [&](auto math_function) {
+                  for (size_t i = 0; i < count; i++) {
+                    x[i] = math_function(x[i], y[i]);
+                  }
+                });
+          }
+          top--;
+        }
+        else {
+          float *x = block(top - 3);
+          const float *y = block(top - 2);
+          const float *z = block(top - 1);
+          blender::nodes::MathKernel_fl_fl_fl_to_fl kernel =
+              blender::nodes::get_math_kernel_fl_fl_fl_to_fl(instruction.operation);
+          if (kernel) {
+            kernel(x, y, z, count);
+          }
+          else {
+            blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(
+                instruction.operation, [&](auto math_function) {
+                  for (size_t i = 0; i < count; i++) {
+                    x[i] = math_function(x[i], y[i], z[i]);
+                  }
+                });
+          }
+          top -= 2;
+        }
+      }
+    }
+    if (top > 0) {
+      copy(block(top - 1), block(top - 1) + count, results[0] + start);
+    }
+    else if (program.empty()) {
+      fill_n(results[0] + start, count, 0.0f);
+    }
+  }
+}
+
+void CompiledExpression::evaluate_batch_parallel(const float* const* columns, float* results, size_t rows,
+                                                 ThreadPool& pool, size_t chunk_rows) const
+{
+  if (result_count > 1) {
+    vector<float> scratch;
+    evaluate_batch_all_parallel(columns, scratch_result_columns(results, result_count, rows, scratch).data(),
+                                rows, pool, chunk_rows);
+    return;
+  }
+  float *result_columns[1] = {results};
+  evaluate_batch_all_parallel(columns, result_columns, rows, pool, chunk_rows);
+}
+
+void CompiledExpression::evaluate_batch_all_parallel(const float* const* columns, float* const* results, size_t rows,
+                                                     ThreadPool& pool, size_t chunk_rows) const
+{
+  /* By default aim for several chunks per thread, so stealing can even out uneven
+     threads, but never less than a few blocks, so the per-chunk setup stays small. */
+  if (chunk_rows == 0) {
+    chunk_rows = max(rows / (pool.get_thread_count() * 8), (size_t)BATCH_BLOCK_SIZE * 16);
+  }
+  chunk_rows = (chunk_rows + BATCH_BLOCK_SIZE - 1) / BATCH_BLOCK_SIZE * BATCH_BLOCK_SIZE;
+  size_t chunks = (rows + chunk_rows - 1) / chunk_rows;
+  pool.run(chunks, [&](size_t chunk) {
+    size_t start = chunk * chunk_rows;
+    vector<const float *> chunk_columns(variables->size());
+    vector<float *> chunk_results(result_count);
+    for (size_t slot = 0; slot < variables->size(); slot++) {
+      chunk_columns[slot] = columns[slot] + start;
+    }
+    for (int result = 0; result < result_count; result++) {
+      chunk_results[result] = results[result] + start;
+    }
+    evaluate_batch_all(chunk_columns.data(), chunk_results.data(), min(chunk_rows, rows - start));
+  });
+}
+
+float CompiledExpression::evaluate_gradient(const float* values, float* gradient, int result) const
+{
+  const float *local_columns[EVALUATION_STACK_SIZE];
+  float *local_gradients[EVALUATION_STACK_SIZE];
+  vector<const float *> heap_columns;
+  vector<float *> heap_gradients;
+  const float **columns = local_columns;
+  float **gradients = local_gradients;
+  if (variables->size() > EVALUATION_STACK_SIZE) {
+    heap_columns.resize(variables->size());
+    heap_gradients.resize(variables->size());
+    columns = heap_columns.data();
+    gradients = heap_gradients.data();
+  }
+  for (size_t slot = 0; slot < variables->size(); slot++) {
+    columns[slot] = values + slot;
+    gradients[slot] = gradient + slot;
+  }
+  float value = 0.0f;
+  evaluate_batch_gradient(columns, &value, gradients, 1, result);
+  return value;
+}
+
+void CompiledExpression::evaluate_batch_gradient(const float* const* columns, float* results,
+                                                 float* const* gradients, size_t rows, int result) const
+{
+  if (result < 0 || result >= result_count) {
+    throw invalid_argument("No result " + to_string(result) + " in: " + source);
+  }
+  /* A node's values and adjoints are a block of rows each, sized down for a single
+     row. As in evaluate_all(), scratch that fits goes on the stack, so the gradient
+     of one row of a typical program does not allocate. */
+  const size_t LOCAL_SCRATCH = 512;
+  int local_ints[LOCAL_SCRATCH];
+  float local_floats[LOCAL_SCRATCH];
+  vector<int> heap_ints;
+  vector<float> heap_floats;
+  size_t block_size = min((size_t)BATCH_BLOCK_SIZE, rows);
+  size_t int_count = program.size() * 3 + stack_depth + temp_count;
+  size_t float_count = program.size() * block_size * 2;
+  int *ints = local_ints;
+  float *floats = local_floats;
+  if (int_count > LOCAL_SCRATCH) {
+    heap_ints.resize(int_count);
+    ints = heap_ints.data();
+  }
+  if (float_count > LOCAL_SCRATCH) {
+    heap_floats.resize(float_count);
+    floats = heap_floats.data();
+  }
+  int *operands = ints;
+  int *node_stack = operands + program.size() * 3;
+  int *temp_nodes = node_stack + stack_depth;
+  float *node_values = floats;
+  float *node_adjoints = floats + program.size() * block_size;
+  auto value = [&](int node) { return node_values + node * block_size; };
+  auto adjoint = [&](int node) { return node_adjoints + node * block_size; };
+
+  /* The tape has one node per instruction that computes a value, named by the
+     instruction's index. Which nodes feed each operation does not depend on the
+     values, so it is worked out once here by running the stack on node indices;
+     temporaries just alias the node that was stored. */
+  int top = 0;
+  int result_node = -1;
+  for (int i = 0; i < (int)program.size(); i++) {
+    const Instruction &instruction = program[i];
+    switch (instruction.kind) {
+      case INSTRUCTION_CONSTANT:
+      case INSTRUCTION_VARIABLE:
+        node_stack[top++] = i;
+        break;
+      case INSTRUCTION_LOAD_TEMP:
+        node_stack[top++] = temp_nodes[instruction.index];
+        break;
+      case INSTRUCTION_STORE_TEMP:
+        temp_nodes[instruction.index] = node_stack[top - 1];
+        break;
+      case INSTRUCTION_STORE_RESULT:
+        top--;
+        if (instruction.index == result) {
+          result_node = node_stack[top];
+        }
+        break;
+      case INSTRUCTION_CALL:
+        throw invalid_argument("No derivative for function " + FunctionRegistry::get(instruction.index).name
+                               + " in: " + source);
+      case INSTRUCTION_OPERATION:
+        top -= instruction.arity;
+        for (int k = 0; k < instruction.arity; k++) {
+          operands[i * 3 + k] = node_stack[top + k];
+        }
+        node_stack[top++] = i;
+        break;
+    }
+  }
+  if (result_node < 0 && result == 0 && top > 0) {
+    result_node = node_stack[top - 1];
+  }
+
+  for (size_t start = 0; start < rows; start += block_size) {
+    size_t count = min(block_size, rows - start);
+    for (size_t slot = 0; slot < variables->size(); slot++) {
+      fill_n(gradients[slot] + start, count, 0.0f);
+    }
+    if (result_node < 0) {
+      fill_n(results + start, count, 0.0f);
+      continue;
+    }
+
+    for (int i = 0; i <= result_node; i++) {
+      const Instruction &instruction = program[i];
+      const int *args = operands + i * 3;
+      float *out = value(i);
+      if (instruction.kind == INSTRUCTION_CONSTANT) {
+        fill_n(out, count, constants[instruction.index]);
+      }
+      else if (instruction.kind == INSTRUCTION_VARIABLE) {
+        const float *column = columns[instruction.index] + start;
+        copy(column, column + count, out);
+      }
+      else if (instruction.kind != INSTRUCTION_OPERATION) {
+        continue;
+      }
+      else if (instruction.arity == 1) {
+        const float *x = value(args[0]);
+        blender::nodes::try_dispatch_float_math_fl_to_fl(
+            instruction.operation, [&](auto math_function) {
+              for (size_t r = 0; r < count; r++) {
+                out[r] = math_function(x[r]);
+              }
+            });
+      }
+      else if (instruction.arity == 2) {
+        const float *x = value(args[0]);
+        const float *y = value(args[1]);
+        blender::nodes::try_dispatch_float_math_fl_fl_to_fl(
+            instruction.operation, [&](auto math_function) {
+              for (size_t r = 0; r < count; r++) {
+                out[r] = math_function(x[r], y[r]);
+              }
+            });
+      }
+      else {
+        const float *x = value(args[0]);
+        const float *y = value(args[1]);
+        const float *z = value(args[2]);
+        blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(
+            instruction.operation, [&](auto math_function) {
+              for (size_t r = 0; r < count; r++) {
+                out[r] = math_function(x[r], y[r], z[r]);
+              }
+            });
+      }
+    }
+    copy(value(result_node), value(result_node) + count, results + start);
+
+    fill_n(node_adjoints, (result_node + 1) * block_size, 0.0f);
+    fill_n(adjoint(result_node), count, 1.0f);
+    for (int i = result_node; i >= 0; i--) {
+      const Instruction &instruction = program[i];
+      const int *args = operands + i * 3;
+      const float *out = value(i);
+      const float *bar = adjoint(i);
+      if (instruction.kind == INSTRUCTION_VARIABLE) {
+        float *gradient = gradients[instruction.index] + start;
+        for (size_t r = 0; r < count; r++) {
+          gradient[r] += bar[r];
+        }
+      }
+      else if (instruction.kind != INSTRUCTION_OPERATION) {
+        continue;
+      }
+      else if (instruction.arity == 1) {
+        const float *x = value(args[0]);
+        float *x_bar = adjoint(args[0]);
+        blender::nodes::try_dispatch_float_math_derivative_fl_to_fl(
+            instruction.operation, [&](auto derivative) {
+              for (size_t r = 0; r < count; r++) {
+                x_bar[r] += bar[r] * derivative(x[r], out[r]);
+              }
+            });
+      }
+      else if (instruction.arity == 2) {
+        const float *x = value(args[0]);
+        const float *y = value(args[1]);
+        float *x_bar = adjoint(args[0]);
+        float *y_bar = adjoint(args[1]);
+        blender::nodes::try_dispatch_float_math_derivative_fl_fl_to_fl(
+            instruction.operation, [&](auto derivative) {
+              for (size_t r = 0; r < count; r++) {
+                float d[2];
+                derivative(x[r], y[r], out[r], d);
+                x_bar[r] += bar[r] * d[0];
+                y_bar[r] += bar[r] * d[1];
+              }
+            });
+      }
+      else {
+        const float *x = value(args[0]);
+        const float *y = value(args[1]);
+        const float *z = value(args[2]);
+        float *x_bar = adjoint(args[0]);
+        float *y_bar = adjoint(args[1]);
+        float *z_bar = adjoint(args[2]);
+        blender::nodes::try_dispatch_float_math_derivative_fl_fl_fl_to_fl(
+            instruction.operation, [&](auto derivative) {
+              for (size_t r = 0; r < count; r++) {
+                float d[3];
+                derivative(x[r], y[r], z[r], out[r], d);
+                x_bar[r] += bar[r] * d[0];
+                y_bar[r] += bar[r] * d[1];
+                z_bar[r] += bar[r] * d[2];
+              }
+            });
+      }
+    }
   }
-  else {
-    cerr << "Stack not compeletely evaluated: " << expression << " Stack size='"
-         << evaluation_stack.size() << "'\n";
-    return evaluation_stack.top();
+}
+
+Interval CompiledExpression::evaluate_interval(const Interval* ranges) const
+{
+  if (result_count > 1) {
+    vector<Interval> results(result_count);
+    evaluate_all_interval(ranges, results.data());
+    return results[0];
   }
+  Interval result;
+  evaluate_all_interval(ranges, &result);
+  return result;
+}
+
+/* Same as evaluate_all(), over intervals. Constants come from the float pool, as the
+   bounds are for the float evaluator. */
+void CompiledExpression::evaluate_all_interval(const Interval* ranges, Interval* results) const
+{
+  Interval local_stack[EVALUATION_STACK_SIZE];
+  Interval local_temps[EVALUATION_TEMP_SIZE];
+  vector<Interval> heap_stack;
+  vector<Interval> heap_temps;
+  Interval *evaluation_stack = local_stack;
+  Interval *temps = local_temps;
+  if (stack_depth > EVALUATION_STACK_SIZE) {
+    heap_stack.resize(stack_depth);
+    evaluation_stack = heap_stack.data();
+  }
+  if (temp_count > EVALUATION_TEMP_SIZE) {
+    heap_temps.resize(temp_count);
+    temps = heap_temps.data();
+  }
+  int top = 0;
+
+  for (const Instruction &instruction : program) {
+    switch (instruction.kind) {
+      case INSTRUCTION_CONSTANT:
+        evaluation_stack[top++] = Interval(constants[instruction.index]);
+        break;
+      case INSTRUCTION_VARIABLE:
+        evaluation_stack[top++] = ranges[instruction.index];
+        break;
+      case INSTRUCTION_LOAD_TEMP:
+        evaluation_stack[top++] = temps[instruction.index];
+        break;
+      case INSTRUCTION_STORE_TEMP:
+        temps[instruction.index] = evaluation_stack[top - 1];
+        break;
+      case INSTRUCTION_STORE_RESULT:
+        results[instruction.index] = evaluation_stack[--top];
+        break;
+      case INSTRUCTION_CALL: {
+        /* Nothing is known about a registered function but its value at a single
+           point, and only if it is pure */
+        const RegisteredFunction &function = FunctionRegistry::get(instruction.index);
+        Interval *args = evaluation_stack + top - instruction.arity;
+        float points[MAX_FUNCTION_ARITY];
+        bool all_points = function.pure;
+        for (int i = 0; i < instruction.arity; i++) {
+          all_points = all_points && args[i].lo == args[i].hi;
+          points[i] = args[i].lo;
+        }
+        top -= instruction.arity - 1;
+        evaluation_stack[top - 1] = all_points ? Interval(function.call(function.state, points)) :
+                                                 Interval(-INFINITY, INFINITY);
+        break;
+      }
+      case INSTRUCTION_OPERATION: {
+        Interval *args = evaluation_stack + top - instruction.arity;
+        Interval result;
+        if (instruction.arity == 1) {
+          blender::nodes::try_dispatch_interval_math_fl_to_fl(
+              instruction.operation, [&](auto math_function) { result = math_function(args[0]); });
+        }
+        else if (instruction.arity == 2) {
+          blender::nodes::try_dispatch_interval_math_fl_fl_to_fl(
+              instruction.operation, [&](auto math_function) { result = math_function(args[0], args[1]); });
+        }
+        else {
+          blender::nodes::try_dispatch_interval_math_fl_fl_fl_to_fl(
+              instruction.operation,
+              [&](auto math_function) { result = math_function(args[0], args[1], args[2]); });
+        }
+        top -= instruction.arity - 1;
+        evaluation_stack[top - 1] = result;
+        break;
+      }
+    }
+  }
+  if (top == 1) {
+    results[0] = evaluation_stack[0];
+  }
+  else if (top > 1) {
+    cerr << "Stack not compeletely evaluated: " << source << " Stack size='"
+         << top << "'\n";
+    results[0] = evaluation_stack[top - 1];
+  }
+  else if (program.empty()) {
+    cerr << "Nothing to return!\n";
+    results[0] = Interval(0.0f);
+  }
+}
+
+string ExpressionParser::get_operation_text(const Instruction& instruction) {
+    if (instruction.kind==INSTRUCTION_CALL) {
+        return FunctionRegistry::get(instruction.index).name;
+    }
+    for (const FunctionEntry& entry: FUNCTIONS) {
+        if (entry.operation==instruction.operation && entry.no_of_params==instruction.arity) {
+            return string(entry.name);
+        }
+    }
+    if (instruction.operation==NODE_MATH_MULTIPLY_ADD && instruction.arity==3) {
+        /* Only produced by the optimizer, so it has no name in FUNCTIONS */
+        return "multiply_add";
+    }
+    return "?";
 }
 
 void ExpressionParser::dump_queue(bool with_headers) {
@@ -490,16 +1571,19 @@ void ExpressionParser::dump_queue(bool with_headers) {
         cout << "Output Queue" << "\n";
         cout << "============" << "\n";
     }
-    for (int i=0; i<output_queue_new.size(); i++) {
-        Expression_Token* token = output_queue_new.front();
-        output_queue_new.push(token);
-        output_queue_new.pop();
-
-        NumberToken* num_token = dynamic_cast<NumberToken*>(token);
-        if (num_token) {
-            cout << num_token->value << " ";
+    for (const Instruction& instruction: compiled.get_program()) {
+        if (instruction.kind==INSTRUCTION_CONSTANT) {
+            cout << compiled.get_constants()[instruction.index] << " ";
+        } else if (instruction.kind==INSTRUCTION_VARIABLE) {
+            cout << compiled.get_variables()[instruction.index] << " ";
+        } else if (instruction.kind==INSTRUCTION_LOAD_TEMP) {
+            cout << "t" << instruction.index << " ";
+        } else if (instruction.kind==INSTRUCTION_STORE_TEMP) {
+            cout << "=t" << instruction.index << " ";
+        } else if (instruction.kind==INSTRUCTION_STORE_RESULT) {
+            cout << "=>r" << instruction.index << " ";
         } else {
-            cout << token->text << " ";
+            cout << get_operation_text(instruction) << " ";
         }
     }
     if (with_headers) {
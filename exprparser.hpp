@@ -1,14 +1,21 @@
+#pragma once
+
 #include <vector>
 #include <stack>
 #include <queue>
 #include <map>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <memory>
 
 #include "math_functions.hh"
+#include "interval.hpp"
 
 using namespace std;
 
+class ThreadPool;
+
 enum Associativity {
     left_associative,
     non_associative,
@@ -35,10 +42,18 @@ class OperationDetails {
     private:
 };
 
+enum TokenType {
+    TOKEN_NUMBER,
+    TOKEN_VARIABLE,
+    TOKEN_OPERATION
+};
+
+/* Token text is a slice of the expression being parsed (or a fixed name such as
+   "neg"), so it is only valid while that expression is. */
 class Expression_Token {
     public:
-    virtual ~Expression_Token() = default;
-    string text;
+    TokenType type;
+    string_view text;
 };
 
 class ValueToken : public Expression_Token {
@@ -49,142 +64,285 @@ class ValueToken : public Expression_Token {
 class NumberToken : public ValueToken {
     public:
     NumberToken();
-    NumberToken(string text);
-    NumberToken(string text, float value);
+    NumberToken(string_view text);
+    NumberToken(string_view text, float value);
     void set_value(float value);
+    /* The same number read as a double, for evaluation in higher precision. */
+    double precise_value;
 };
 
 class VariableToken : public ValueToken {
     public:
     VariableToken();
-    VariableToken(string value);
+    VariableToken(string_view value);
 };
 
 class OperationToken : public Expression_Token {
     public:
     OperationToken();
-    OperationToken(string text, bool is_prefix, bool is_function, short no_of_params, NodeMathOperation operation);
+    OperationToken(string_view text, bool is_prefix, bool is_function, short no_of_params, NodeMathOperation operation,
+                   int function = -1);
     bool is_prefix;
     bool is_function;
     short no_of_params;
     NodeMathOperation operation;
+    /* Id of a function of the FunctionRegistry, or -1 for a built-in operation. */
+    int function = -1;
+};
+
+/* Hands out objects from fixed-size chunks, in order. reset() recycles every object
+   at once while keeping the chunks for the next round, so steady-state parsing does not touch the allocator. */
+template <class T>
+class TokenPool {
+    public:
+    T* allocate() {
+        if (used == chunks.size() * CHUNK_SIZE) {
+            chunks.push_back(unique_ptr<T[]>(new T[CHUNK_SIZE]));
+        }
+        T* item = &chunks[used / CHUNK_SIZE][used % CHUNK_SIZE];
+        used++;
+        return item;
+    }
+    void reset() {
+        used = 0;
+    }
+    private:
+    static const size_t CHUNK_SIZE = 64;
+    vector<unique_ptr<T[]>> chunks;
+    size_t used = 0;
+};
+
+/* Owns every token created while parsing one expression. Tokens only live until the
+   next parse(); the CompiledExpression keeps nothing but plain instructions. */
+class TokenArena {
+    public:
+    NumberToken* new_number(string_view text, float value, double precise_value);
+    VariableToken* new_variable(string_view text);
+    OperationToken* new_operation(string_view text, bool is_prefix, bool is_function, short no_of_params,
+                                  NodeMathOperation operation, int function = -1);
+    void reset();
+    private:
+    TokenPool<NumberToken> numbers;
+    TokenPool<VariableToken> variables;
+    TokenPool<OperationToken> operations;
+};
+
+enum InstructionKind : unsigned char {
+    INSTRUCTION_CONSTANT,     /* push constants[index] */
+    INSTRUCTION_VARIABLE,     /* push values[index] */
+    INSTRUCTION_OPERATION,    /* replace the top `arity` entries with operation(entries) */
+    INSTRUCTION_LOAD_TEMP,    /* push temps[index] */
+    INSTRUCTION_STORE_TEMP,   /* temps[index] = top, leaving it on the stack */
+    INSTRUCTION_STORE_RESULT, /* pop into results[index] */
+    INSTRUCTION_CALL          /* replace the top `arity` entries with registered function `index` of them */
+};
+
+/* Most arguments a registered function can take; built-in operations take 1 to 3. */
+const int MAX_FUNCTION_ARITY = 8;
+
+/* One step of a compiled program. Plain data, 8 bytes, so a program is one contiguous array. */
+struct Instruction {
+    InstructionKind kind;
+    unsigned char arity;
+    unsigned short operation;
+    int index;
 };
 
+/* Read-only array that the copies of a program share. It owns its items, or points
+   into memory someone else owns, such as a mapped program file, and keeps that alive. */
+template <class T>
+class SharedArray {
+    public:
+    SharedArray() {}
+    explicit SharedArray(vector<T> items) {
+        shared_ptr<const vector<T>> storage = make_shared<const vector<T>>(move(items));
+        this->items = storage->data();
+        count = storage->size();
+        owner = move(storage);
+    }
+    SharedArray(const T* items, size_t count, shared_ptr<const void> owner)
+        : items(items), count(count), owner(move(owner)) {}
+    const T* begin() const {
+        return items;
+    }
+    const T* end() const {
+        return items + count;
+    }
+    const T* data() const {
+        return items;
+    }
+    size_t size() const {
+        return count;
+    }
+    bool empty() const {
+        return count==0;
+    }
+    const T& operator[](size_t index) const {
+        return items[index];
+    }
+    private:
+    const T* items = nullptr;
+    size_t count = 0;
+    shared_ptr<const void> owner;
+};
+
+/* Immutable RPN program produced by ExpressionParser::parse(). Evaluating it does
+   not consume the program, so one parse can be evaluated any number of times,
+   and concurrently from several threads. It does not refer back to the parser or
+   its tokens. Its instructions and constant pools are SharedArrays, so they may be
+   shared with its copies and with an ExpressionBatch, or point into the mapping of a
+   ProgramFile, which they keep mapped.
+   Variables are numbered into dense slots at parse time, in order of first use;
+   evaluate(const float*) reads its values in that slot order. Programs compiled
+   together by an ExpressionBatch share one table of slots instead, and may have
+   slots they never read.
+   Subexpressions used more than once are computed once and kept in temporaries.
+   A program made by combine() computes several expressions in one pass and
+   stores one result per expression. */
+class CompiledExpression {
+    public:
+    static const int EVALUATION_STACK_SIZE = 64;
+    static const int EVALUATION_TEMP_SIZE = 64;
+    static const int BATCH_BLOCK_SIZE = 256;
+    CompiledExpression();
+    CompiledExpression(string source, vector<Instruction> program, vector<float> constants,
+                       vector<string> variables, int stack_depth,
+                       int temp_count = 0, int result_count = 1,
+                       vector<double> precise_constants = {});
+    /* A program over arrays and a slot table that exist already, such as those of
+       a ProgramFile or an ExpressionBatch. */
+    CompiledExpression(string source, SharedArray<Instruction> program, SharedArray<float> constants,
+                       SharedArray<double> precise_constants, shared_ptr<const vector<string>> variables,
+                       int stack_depth, int temp_count, int result_count);
+    /* Compiles several expressions into one program over a shared variable namespace.
+       Each distinct subexpression is computed once per evaluation, even when it
+       appears in more than one of the expressions. invalid_argument if there are none. */
+    static CompiledExpression combine(const vector<CompiledExpression>& expressions);
+    /* For a program from combine(), evaluate() and the other single-result methods
+       give its first result. */
+    float evaluate(const map<string, float>& variables) const;
+    float evaluate(const float* values) const;
+    /* columns[slot] points at `rows` values of that variable; one result per row is written to results. */
+    void evaluate_batch(const float* const* columns, float* results, size_t rows) const;
+    /* Write all get_result_count() results: results[i] for one row, results[i][row] for a batch. */
+    void evaluate_all(const float* values, float* results) const;
+    void evaluate_batch_all(const float* const* columns, float* const* results, size_t rows) const;
+    /* Batch evaluation split into chunks of chunk_rows rows (0 picks a size from the
+       row and thread counts) and spread over the pool's threads. */
+    void evaluate_batch_parallel(const float* const* columns, float* results, size_t rows,
+                                 ThreadPool& pool, size_t chunk_rows = 0) const;
+    void evaluate_batch_all_parallel(const float* const* columns, float* const* results, size_t rows,
+                                     ThreadPool& pool, size_t chunk_rows = 0) const;
+    /* Reverse-mode differentiation: one pass forward, keeping every intermediate
+       value, then one pass back from the result, gives the value and its partial
+       derivatives with respect to all variable slots at once (gradient[slot]).
+       math_derivatives.hh has the rules. For a program from combine(), `result`
+       picks the result to differentiate; invalid_argument if there is no such result,
+       or if the program calls a registered function. */
+    float evaluate_gradient(const float* values, float* gradient, int result = 0) const;
+    /* results[row] and gradients[slot][row] for every row, a block of rows per pass. */
+    void evaluate_batch_gradient(const float* const* columns, float* results, float* const* gradients,
+                                 size_t rows, int result = 0) const;
+    /* Range analysis: given an interval for each variable slot, returns an interval
+       holding every value evaluate() can give for values in them (NaN aside), with
+       the rules of math_intervals.hh. Bounds are safe but can be loose, e.g. when a
+       variable appears more than once. Bounding a block of rows with Interval::of()
+       first tells whether the block can pass a threshold at all. */
+    Interval evaluate_interval(const Interval* ranges) const;
+    void evaluate_all_interval(const Interval* ranges, Interval* results) const;
+    /* The evaluate methods for another value type: double, or the Fixed32/Fixed64
+       fixed-point types of fixed_point.hpp. Each type gets its own instantiation of
+       the evaluator and math functions, and constants come from the precise pool.
+       Constant subexpressions are folded in double, so with the optimizer on a
+       fixed-point result can differ slightly from set_optimize(false).
+       For float these are the float methods above. */
+    template <class T> T evaluate_as(const T* values) const;
+    template <class T> void evaluate_all_as(const T* values, T* results) const;
+    template <class T> void evaluate_batch_as(const T* const* columns, T* results, size_t rows) const;
+    template <class T> void evaluate_batch_all_as(const T* const* columns, T* const* results, size_t rows) const;
+    int get_result_count() const;
+    int get_stack_depth() const;
+    int get_temp_count() const;
+    const vector<string>& get_variables() const;
+    int get_slot(const string& name) const;
+    /* Values in slot order; invalid_argument if a variable the program reads is missing. */
+    vector<float> bind(const map<string, float>& values) const;
+    bool empty() const;
+    const string& get_source() const;
+    const SharedArray<Instruction>& get_program() const;
+    const SharedArray<float>& get_constants() const;
+    /* The constant pool again, in double: literals as read from the source and
+       constants folded in double, for evaluate_as() with wider types. */
+    const SharedArray<double>& get_precise_constants() const;
+    /* Approximate heap and object size, for caches that budget memory. */
+    size_t get_memory_size() const;
+    /* Returns an equivalent program with constant subexpressions folded, exact
+       identities (x*1, x+0, x-0, x/1, x^1, neg(neg(x))) removed and a*b+c fused
+       into multiply_add. */
+    CompiledExpression optimized() const;
+    /* d(expression)/d(variable) as a program of its own, over the same variable slots
+       and with one result per result of this one, folded and simplified as by
+       optimized(). Piecewise functions differentiate as in evaluate_gradient(); a
+       variable the program does not use gives the constant 0. */
+    CompiledExpression derivative(const string& variable) const;
+    private:
+    string source;
+    SharedArray<Instruction> program;
+    SharedArray<float> constants;
+    SharedArray<double> precise_constants;
+    shared_ptr<const vector<string>> variables;
+    int stack_depth = 0;
+    int temp_count = 0;
+    int result_count = 1;
+};
+
+template <> void CompiledExpression::evaluate_all_as<float>(const float* values, float* results) const;
+template <> void CompiledExpression::evaluate_batch_all_as<float>(const float* const* columns, float* const* results,
+                                                                  size_t rows) const;
+
 class ExpressionParser {
     public:
     ExpressionParser();
     ExpressionParser(const char* expression);
     void set_expression(const char *expression);
-    void parse();
+    CompiledExpression parse();
+    const CompiledExpression& get_compiled() const;
+    /* parse() optimizes the program it returns unless this is turned off. */
+    void set_optimize(bool optimize);
     void dump_tokens();
     void dump_queue(bool with_headers);
     void dump_stack(bool with_headers);
     OperatorDetails get_operator_details(char op);
-    optional<OperationDetails> get_function_details(string op);
+    optional<OperationDetails> get_function_details(string_view op);
+    string get_operation_text(const Instruction& instruction);
     bool can_evaluate();
     float evaluate(map<string, float> variables);
     private:
-    bool add_token(int token_start, int token_end);
+    friend class ExpressionEditor;
+    bool add_token(int token_start, int token_end, char prev_token_char);
+    Expression_Token* read_token(int token_start, int token_end, char prev_token_char);
+    void push_token(Expression_Token* token);
+    static bool is_token_boundary(char before_previous_char, char previous_char, char current_char);
+    bool parse_number(string_view text, float& value, double& precise_value);
     bool has_precedence(OperationToken* prev, OperationToken* curr);
     bool is_operator(char character);
     bool is_digit(char character);
     bool is_letter(char character);
     bool is_whitespace(char character);
     bool is_exponent(char character);
-    bool is_function(string text);
-    bool is_number(string text);
-    bool is_constant(string text);
-    bool is_variable(string text);
-    float get_number(string text);
-    float get_constant(string text);
+    bool is_function(string_view text);
+    bool is_number(string_view text);
+    bool is_constant(string_view text);
+    bool is_variable(string_view text);
+    float get_number(string_view text);
+    float get_constant(string_view text);
     void pop_operationstack_to_outqueue();
-    char get_last_printable_char_before(int index);
     const char* expression;
     bool valid_queue = false;
     stack<OperationToken*> operation_stack;
     queue<Expression_Token*> output_queue_new;
-    vector<OperatorDetails> OPERATORS_DETAILS {
-        OperatorDetails('(', 1, grouping_only),
-        OperatorDetails(')', 1, grouping_only),
-        OperatorDetails('^', 2, right_associative),
-        OperatorDetails('%', 3, left_associative),
-        OperatorDetails('/', 3, left_associative),
-        OperatorDetails('*', 3, left_associative),
-        OperatorDetails('-', 4, left_associative),
-        OperatorDetails('+', 4, left_associative),
-        OperatorDetails(',', 100, grouping_only),
-    };
-    vector<char> WHITESPACE {
-        ' ',
-        '\t',
-        '\0'
-    };
-    vector<char> EXPONENTS {
-        'E'
-    };
-    vector<char> DIGITS {
-        '0',
-        '1',
-        '2',
-        '3',
-        '4',
-        '5',
-        '6',
-        '7',
-        '8',
-        '9',
-    };
-    vector<char> LETTERS{
-        'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h',
-        'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p',
-        'q', 'r', 's', 't', 'u', 'v', 'w', 'x',
-        'y', 'z', 
-        'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-        'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-        'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-        'Y', 'Z'
-    };
-    map<string, float> CONSTANTS{
-      {"pi", M_PI},
-      {"e", M_E}
-    };
-    map<string, OperationDetails> FUNCTIONS_MAPPING{
-        {"abs", OperationDetails("abs", NODE_MATH_ABSOLUTE, 1)},
-        {"exp", OperationDetails("exp", NODE_MATH_EXPONENT, 1)},
-        {"sign", OperationDetails("sign", NODE_MATH_SIGN, 1)},
-        {"round", OperationDetails("round", NODE_MATH_ROUND, 1)},
-        {"floor", OperationDetails("floor", NODE_MATH_FLOOR, 1)},
-        {"ceil", OperationDetails("ceil", NODE_MATH_CEIL, 1)},
-        {"fraction", OperationDetails("fraction", NODE_MATH_FRACTION, 1)},
-        {"trunc", OperationDetails("trunc", NODE_MATH_TRUNC, 1)},
-        {"sqrt", OperationDetails("sqrt", NODE_MATH_SQRT, 1)},
-        {"isqrt", OperationDetails("isqrt", NODE_MATH_INV_SQRT, 1)},
-        {"deg2rad", OperationDetails("deg2rad", NODE_MATH_RADIANS, 1)},
-        {"rad2deg", OperationDetails("rad2deg", NODE_MATH_DEGREES, 1)},
-        {"sin", OperationDetails("sin", NODE_MATH_SINE, 1)},
-        {"cos", OperationDetails("cos", NODE_MATH_COSINE, 1)},
-        {"tan", OperationDetails("tan", NODE_MATH_TANGENT, 1)},
-        {"sinh", OperationDetails("sinh", NODE_MATH_SINH, 1)},
-        {"cosh", OperationDetails("cosh", NODE_MATH_COSH, 1)},
-        {"tanh", OperationDetails("tanh", NODE_MATH_TANH, 1)},
-        {"+", OperationDetails("+", NODE_MATH_ADD, 2)},
-        {"-", OperationDetails("-", NODE_MATH_SUBTRACT, 2)},
-        {"*", OperationDetails("*", NODE_MATH_MULTIPLY, 2)},
-        {"/", OperationDetails("/", NODE_MATH_DIVIDE, 2)},
-        {"^", OperationDetails("^", NODE_MATH_POWER, 2)},
-        {"log", OperationDetails("log", NODE_MATH_LOGARITHM, 2)},
-        {"min", OperationDetails("min", NODE_MATH_MINIMUM, 2)},
-        {"max", OperationDetails("max", NODE_MATH_MAXIMUM, 2)},
-        {"<", OperationDetails("<", NODE_MATH_LESS_THAN, 2)},
-        {">", OperationDetails(">", NODE_MATH_GREATER_THAN, 2)},
-        {"mod", OperationDetails("mod", NODE_MATH_MODULO, 2)},
-        {"snap", OperationDetails("snap", NODE_MATH_SNAP, 2)},
-        {"arctan", OperationDetails("arctan", NODE_MATH_ARCTAN2, 2)},
-        {"pingpong", OperationDetails("pingpong", NODE_MATH_PINGPONG, 2)},
-        {"compare", OperationDetails("compare", NODE_MATH_COMPARE, 3)},
-        {"smoothmin", OperationDetails("smoothmin", NODE_MATH_SMOOTH_MIN, 3)},
-        {"smoothmax", OperationDetails("smoothmax", NODE_MATH_SMOOTH_MAX, 3)},
-        {"wrap", OperationDetails("wrap", NODE_MATH_WRAP, 3)},
-        {"neg", OperationDetails("wrap", NODE_MATH_NEG, 1)}
-    };
+    TokenArena arena;
+    CompiledExpression compiled;
+    bool optimize = true;
+    static const vector<OperatorDetails> OPERATORS_DETAILS;
 };
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "exprstream.hpp"
+
+/* Raw files are little-endian; values are swapped on the way in and out elsewhere. */
+static bool is_little_endian() {
+    uint16_t probe = 1;
+    return *(unsigned char*)&probe==1;
+}
+
+static float swap_bytes(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static bool is_blank(char character) {
+    return character==' ' || character=='\t';
+}
+
+const vector<string>& TableReader::get_columns() const {
+    return column_names;
+}
+
+void TableReader::select(const vector<size_t>& columns) {
+    targets.assign(column_names.size(), -1);
+    for (size_t i=0; i<columns.size(); i++) {
+        targets.at(columns[i]) = (int)i;
+    }
+}
+
+CsvReader::CsvReader(istream& input, char delimiter) : input(input), delimiter(delimiter), buffer(1 << 20) {
+    const char* begin;
+    const char* end;
+    if (!next_line(begin, end)) {
+        throw invalid_argument("CSV input has no header line");
+    }
+    if (end-begin>=3 && memcmp(begin, "\xEF\xBB\xBF", 3)==0) {
+        begin += 3;
+    }
+    while (true) {
+        const char* name_end = (const char*)memchr(begin, delimiter, end-begin);
+        const char* field_end = name_end ? name_end : end;
+        const char* name_begin = begin;
+        while (name_begin<field_end && (is_blank(*name_begin) || *name_begin=='"')) {
+            name_begin++;
+        }
+        const char* name_last = field_end;
+        while (name_last>name_begin && (is_blank(name_last[-1]) || name_last[-1]=='"')) {
+            name_last--;
+        }
+        column_names.push_back(string(name_begin, name_last));
+        if (!name_end) {
+            break;
+        }
+        begin = name_end+1;
+    }
+    targets.resize(column_names.size());
+    for (size_t i=0; i<targets.size(); i++) {
+        targets[i] = (int)i;
+    }
+}
+
+/* Finds the next line in the buffer, reading more input (and growing the buffer
+   for a line longer than it) when the line is not all there yet. */
+bool CsvReader::next_line(const char*& begin, const char*& end) {
+    while (true) {
+        const char* line = buffer.data() + start;
+        const char* newline = (const char*)memchr(line, '\n', filled-start);
+        if (newline || (input_ended && start<filled)) {
+            begin = line;
+            end = newline ? newline : buffer.data() + filled;
+            start = end - buffer.data() + (newline ? 1 : 0);
+            if (end>begin && end[-1]=='\r') {
+                end--;
+            }
+            line_number++;
+            return true;
+        }
+        if (input_ended) {
+            return false;
+        }
+        memmove(buffer.data(), line, filled-start);
+        filled -= start;
+        start = 0;
+        if (filled==buffer.size()) {
+            buffer.resize(buffer.size()*2);
+        }
+        input.read(buffer.data() + filled, buffer.size() - filled);
+        filled += input.gcount();
+        input_ended = input.gcount()==0;
+    }
+}
+
+float CsvReader::parse_field(const char* begin, const char* end, size_t column) {
+    while (begin<end && is_blank(*begin)) {
+        begin++;
+    }
+    while (end>begin && is_blank(end[-1])) {
+        end--;
+    }
+    if (end-begin>1 && *begin=='+') {
+        begin++;
+    }
+    float value = 0;
+    from_chars_result result = from_chars(begin, end, value);
+    if (result.ec==errc::result_out_of_range) {
+        /* from_chars leaves the value alone on overflow; strtof saturates to inf or 0 */
+        value = strtof(string(begin, end).c_str(), nullptr);
+    } else if (result.ec!=errc() || result.ptr!=end) {
+        throw invalid_argument("Invalid number '" + string(begin, end) + "' on line "
+                               + to_string(line_number) + " in column " + column_names[column]);
+    }
+    return value;
+}
+
+size_t CsvReader::read_block(float* const* columns, size_t max_rows) {
+    const size_t column_count = column_names.size();
+    const char* begin;
+    const char* end;
+    size_t rows = 0;
+    while (rows<max_rows && next_line(begin, end)) {
+        if (begin==end) {
+            continue;
+        }
+        const char* field = begin;
+        for (size_t column=0; column<column_count; column++) {
+            const char* field_end = (const char*)memchr(field, delimiter, end-field);
+            bool last = column+1==column_count;
+            if (last==(field_end!=nullptr)) {
+                throw invalid_argument("Line " + to_string(line_number) + " does not have "
+                                       + to_string(column_count) + " fields");
+            }
+            if (!field_end) {
+                field_end = end;
+            }
+            if (targets[column]>=0) {
+                columns[targets[column]][rows] = parse_field(field, field_end, column);
+            }
+            field = field_end+1;
+        }
+        rows++;
+    }
+    return rows;
+}
+
+RawReader::RawReader(istream& input, const vector<string>& columns) : input(input) {
+    if (columns.empty()) {
+        throw invalid_argument("Raw input needs at least one column");
+    }
+    column_names = columns;
+    targets.resize(column_names.size());
+    for (size_t i=0; i<targets.size(); i++) {
+        targets[i] = (int)i;
+    }
+}
+
+size_t RawReader::read_block(float* const* columns, size_t max_rows) {
+    const size_t column_count = column_names.size();
+    rows_buffer.resize(max_rows*column_count);
+    input.read((char*)rows_buffer.data(), rows_buffer.size()*sizeof(float));
+    size_t bytes = input.gcount();
+    if (bytes % (column_count*sizeof(float))!=0) {
+        throw invalid_argument("Raw input ends in the middle of a row");
+    }
+    size_t rows = bytes / (column_count*sizeof(float));
+    bool swap = !is_little_endian();
+    for (size_t column=0; column<column_count; column++) {
+        if (targets[column]<0) {
+            continue;
+        }
+        float* target = columns[targets[column]];
+        const float* source = rows_buffer.data() + column;
+        for (size_t row=0; row<rows; row++) {
+            float value = source[row*column_count];
+            target[row] = swap ? swap_bytes(value) : value;
+        }
+    }
+    return rows;
+}
+
+CsvWriter::CsvWriter(ostream& output, char delimiter) : output(output), delimiter(delimiter) {}
+
+void CsvWriter::write_header(const vector<string>& columns) {
+    for (size_t i=0; i<columns.size(); i++) {
+        output << (i==0 ? "" : string(1, delimiter)) << columns[i];
+    }
+    output << "\n";
+}
+
+/* Each value is written in the shortest form that reads back as the same float. */
+void CsvWriter::write_block(const float* const* columns, size_t column_count, size_t rows) {
+    const size_t MAX_FLOAT_TEXT = 24;
+    text.resize(rows*(column_count*(MAX_FLOAT_TEXT+1)+1));
+    char* position = text.data();
+    for (size_t row=0; row<rows; row++) {
+        for (size_t column=0; column<column_count; column++) {
+            if (column>0) {
+                *position++ = delimiter;
+            }
+            position = to_chars(position, position + MAX_FLOAT_TEXT, columns[column][row]).ptr;
+        }
+        *position++ = '\n';
+    }
+    output.write(text.data(), position - text.data());
+    if (!output) {
+        throw runtime_error("Writing the output failed");
+    }
+}
+
+RawWriter::RawWriter(ostream& output) : output(output) {}
+
+void RawWriter::write_header(const vector<string>& columns) {}
+
+void RawWriter::write_block(const float* const* columns, size_t column_count, size_t rows) {
+    rows_buffer.resize(rows*column_count);
+    bool swap = !is_little_endian();
+    for (size_t column=0; column<column_count; column++) {
+        float* target = rows_buffer.data() + column;
+        for (size_t row=0; row<rows; row++) {
+            target[row*column_count] = swap ? swap_bytes(columns[column][row]) : columns[column][row];
+        }
+    }
+    output.write((const char*)rows_buffer.data(), rows_buffer.size()*sizeof(float));
+    if (!output) {
+        throw runtime_error("Writing the output failed");
+    }
+}
+
+StreamEvaluator::StreamEvaluator(const vector<string>& expressions, size_t block_rows, ThreadPool* pool)
+    : block_rows(block_rows>0 ? block_rows : DEFAULT_BLOCK_ROWS), pool(pool) {
+    if (expressions.empty()) {
+        throw invalid_argument("No expressions to evaluate");
+    }
+    vector<CompiledExpression> compiled;
+    for (const string& expression: expressions) {
+        /* No operator contains '=', so the first one always ends a name */
+        size_t equals = expression.find('=');
+        string source = equals==string::npos ? expression : expression.substr(equals+1);
+        output_names.push_back(equals==string::npos ? expression : expression.substr(0, equals));
+        ExpressionParser parser(source.c_str());
+        compiled.push_back(parser.parse());
+    }
+    program = CompiledExpression::combine(compiled);
+}
+
+void StreamEvaluator::bind(const string& variable, const string& column) {
+    bindings[variable] = column;
+}
+
+const vector<string>& StreamEvaluator::get_output_names() const {
+    return output_names;
+}
+
+size_t StreamEvaluator::run(TableReader& reader, TableWriter& writer) {
+    /* Read only the columns some variable uses, each once however many variables share it */
+    const vector<string>& columns = reader.get_columns();
+    const vector<string>& variables = program.get_variables();
+    vector<size_t> selected;
+    vector<size_t> slot_inputs;
+    for (const string& variable: variables) {
+        auto binding = bindings.find(variable);
+        const string& column_name = binding!=bindings.end() ? binding->second : variable;
+        size_t column = find(columns.begin(), columns.end(), column_name) - columns.begin();
+        if (column==columns.size()) {
+            throw invalid_argument("No input column " + column_name + " for variable " + variable);
+        }
+        size_t input = find(selected.begin(), selected.end(), column) - selected.begin();
+        if (input==selected.size()) {
+            selected.push_back(column);
+        }
+        slot_inputs.push_back(input);
+    }
+    reader.select(selected);
+
+    vector<float> input_data(selected.size()*block_rows);
+    vector<float> output_data(program.get_result_count()*block_rows);
+    vector<float*> inputs;
+    vector<const float*> slot_columns;
+    vector<float*> outputs;
+    for (size_t input=0; input<selected.size(); input++) {
+        inputs.push_back(input_data.data() + input*block_rows);
+    }
+    for (size_t input: slot_inputs) {
+        slot_columns.push_back(inputs[input]);
+    }
+    for (int result=0; result<program.get_result_count(); result++) {
+        outputs.push_back(output_data.data() + result*block_rows);
+    }
+
+    writer.write_header(output_names);
+    size_t total_rows = 0;
+    while (size_t rows = reader.read_block(inputs.data(), block_rows)) {
+        if (pool) {
+            program.evaluate_batch_all_parallel(slot_columns.data(), outputs.data(), rows, *pool);
+        } else {
+            program.evaluate_batch_all(slot_columns.data(), outputs.data(), rows);
+        }
+        writer.write_block(outputs.data(), outputs.size(), rows);
+        total_rows += rows;
+    }
+    return total_rows;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+
+#include "exprparser.hpp"
+
+/* Evaluating expressions over tables too large to hold in memory: a reader hands
+   out the input a block of rows at a time as float columns, every expression is
+   evaluated over the block in one batch, and a writer streams the results out
+   before the next block is read. Memory is bounded by the block size, whatever
+   the length of the input. */
+
+/* Source of rows of named float columns. */
+class TableReader {
+    public:
+    virtual ~TableReader() {}
+    const vector<string>& get_columns() const;
+    /* read_block() stores only these columns (distinct indices into get_columns()),
+       in this order; by default it stores all of them. */
+    void select(const vector<size_t>& columns);
+    /* Fills columns[i][0..rows) for up to max_rows rows and returns the row count,
+       which is 0 only at the end of the input. Throws invalid_argument for malformed input. */
+    virtual size_t read_block(float* const* columns, size_t max_rows) = 0;
+    protected:
+    vector<string> column_names;
+    /* For each column of the input, where read_block() stores it, or -1 to skip it. */
+    vector<int> targets;
+};
+
+/* Text with a header line of column names and one row per line. Fields are plain
+   numbers; quotes around header names are dropped, but quoted fields are not supported. */
+class CsvReader : public TableReader {
+    public:
+    CsvReader(istream& input, char delimiter = ',');
+    size_t read_block(float* const* columns, size_t max_rows) override;
+    private:
+    bool next_line(const char*& begin, const char*& end);
+    float parse_field(const char* begin, const char* end, size_t column);
+    istream& input;
+    char delimiter;
+    vector<char> buffer;
+    /* Bytes read but not yet parsed are buffer[start, filled). */
+    size_t start = 0;
+    size_t filled = 0;
+    bool input_ended = false;
+    size_t line_number = 0;
+};
+
+/* Rows of little-endian 32-bit floats, one per column, with the column names given separately. */
+class RawReader : public TableReader {
+    public:
+    RawReader(istream& input, const vector<string>& columns);
+    size_t read_block(float* const* columns, size_t max_rows) override;
+    private:
+    istream& input;
+    vector<float> rows_buffer;
+};
+
+/* Sink for rows of float columns, in the same two formats. */
+class TableWriter {
+    public:
+    virtual ~TableWriter() {}
+    virtual void write_header(const vector<string>& columns) = 0;
+    virtual void write_block(const float* const* columns, size_t column_count, size_t rows) = 0;
+};
+
+class CsvWriter : public TableWriter {
+    public:
+    CsvWriter(ostream& output, char delimiter = ',');
+    void write_header(const vector<string>& columns) override;
+    void write_block(const float* const* columns, size_t column_count, size_t rows) override;
+    private:
+    ostream& output;
+    char delimiter;
+    string text;
+};
+
+class RawWriter : public TableWriter {
+    public:
+    RawWriter(ostream& output);
+    void write_header(const vector<string>& columns) override;
+    void write_block(const float* const* columns, size_t column_count, size_t rows) override;
+    private:
+    ostream& output;
+    vector<float> rows_buffer;
+};
+
+/* Evaluates a fixed set of expressions over every row of a table, block by block.
+   The expressions are compiled into one combined program, so subexpressions they
+   share are computed once per row. Each expression is "name=expression", or just
+   an expression, which is then also its output column name. A variable reads the
+   input column of the same name unless bind() says otherwise. */
+class StreamEvaluator {
+    public:
+    static const size_t DEFAULT_BLOCK_ROWS = 1 << 16;
+    /* With a pool, each block is spread over its threads. Throws invalid_argument
+       for an expression that does not parse, or for no expressions at all. */
+    StreamEvaluator(const vector<string>& expressions, size_t block_rows = DEFAULT_BLOCK_ROWS,
+                    ThreadPool* pool = nullptr);
+    void bind(const string& variable, const string& column);
+    const vector<string>& get_output_names() const;
+    /* Evaluates every row of reader into writer, header first, and returns the row
+       count. Throws invalid_argument if a variable has no column. */
+    size_t run(TableReader& reader, TableWriter& writer);
+    private:
+    CompiledExpression program;
+    vector<string> output_names;
+    map<string, string> bindings;
+    size_t block_rows;
+    ThreadPool* pool;
+};
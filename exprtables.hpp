@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+
+#include "math_functions.hh"
+
+using namespace std;
+
+struct FunctionEntry {
+    string_view name;
+    NodeMathOperation operation = NODE_MATH_ADD;
+    short no_of_params = 0;
+};
+
+struct ConstantEntry {
+    string_view name;
+    double value = 0.0;
+};
+
+constexpr uint32_t name_hash(string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c: name) {
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+    return hash;
+}
+
+/* Fixed set of named entries with a perfect hash, built by the compiler: the
+   constructor searches for a seed under which no two names share a slot, so
+   find() is one hash, one slot and one string compare, and never allocates.
+   TABLE_SIZE must be a power of two larger than N. A seed is collision-free with
+   probability about exp(-N*N/(2*TABLE_SIZE)), so with at least N*N/8 slots the
+   search takes some fifty tries on average at most (FUNCTIONS, 37 names in 256
+   slots, needs about 14). */
+template <class Entry, size_t N, size_t TABLE_SIZE>
+class NameTable {
+    public:
+    constexpr NameTable(const Entry (&source)[N]) {
+        static_assert((TABLE_SIZE & (TABLE_SIZE-1))==0 && TABLE_SIZE>N, "TABLE_SIZE must be a power of two above N");
+        for (size_t i=0; i<N; i++) {
+            entries[i] = source[i];
+        }
+        for (seed=0; !try_seed(); seed++) {
+        }
+    }
+
+    constexpr const Entry* find(string_view name) const {
+        short slot = slots[name_hash(name, seed) & (TABLE_SIZE-1)];
+        if (slot>=0 && entries[slot].name==name) {
+            return &entries[slot];
+        }
+        return nullptr;
+    }
+
+    constexpr const Entry* begin() const {
+        return entries;
+    }
+
+    constexpr const Entry* end() const {
+        return entries + N;
+    }
+
+    private:
+    constexpr bool try_seed() {
+        for (size_t h=0; h<TABLE_SIZE; h++) {
+            slots[h] = -1;
+        }
+        for (size_t i=0; i<N; i++) {
+            size_t h = name_hash(entries[i].name, seed) & (TABLE_SIZE-1);
+            if (slots[h]>=0) {
+                return false;
+            }
+            slots[h] = (short)i;
+        }
+        return true;
+    }
+
+    Entry entries[N] = {};
+    short slots[TABLE_SIZE] = {};
+    uint32_t seed = 0;
+};
+
+constexpr FunctionEntry FUNCTION_ENTRIES[] = {
+    {"abs", NODE_MATH_ABSOLUTE, 1},
+    {"exp", NODE_MATH_EXPONENT, 1},
+    {"sign", NODE_MATH_SIGN, 1},
+    {"round", NODE_MATH_ROUND, 1},
+    {"floor", NODE_MATH_FLOOR, 1},
+    {"ceil", NODE_MATH_CEIL, 1},
+    {"fraction", NODE_MATH_FRACTION, 1},
+    {"trunc", NODE_MATH_TRUNC, 1},
+    {"sqrt", NODE_MATH_SQRT, 1},
+    {"isqrt", NODE_MATH_INV_SQRT, 1},
+    {"deg2rad", NODE_MATH_RADIANS, 1},
+    {"rad2deg", NODE_MATH_DEGREES, 1},
+    {"sin", NODE_MATH_SINE, 1},
+    {"cos", NODE_MATH_COSINE, 1},
+    {"tan", NODE_MATH_TANGENT, 1},
+    {"sinh", NODE_MATH_SINH, 1},
+    {"cosh", NODE_MATH_COSH, 1},
+    {"tanh", NODE_MATH_TANH, 1},
+    {"+", NODE_MATH_ADD, 2},
+    {"-", NODE_MATH_SUBTRACT, 2},
+    {"*", NODE_MATH_MULTIPLY, 2},
+    {"/", NODE_MATH_DIVIDE, 2},
+    {"^", NODE_MATH_POWER, 2},
+    {"log", NODE_MATH_LOGARITHM, 2},
+    {"min", NODE_MATH_MINIMUM, 2},
+    {"max", NODE_MATH_MAXIMUM, 2},
+    {"<", NODE_MATH_LESS_THAN, 2},
+    {">", NODE_MATH_GREATER_THAN, 2},
+    {"mod", NODE_MATH_MODULO, 2},
+    {"snap", NODE_MATH_SNAP, 2},
+    {"arctan", NODE_MATH_ARCTAN2, 2},
+    {"pingpong", NODE_MATH_PINGPONG, 2},
+    {"compare", NODE_MATH_COMPARE, 3},
+    {"smoothmin", NODE_MATH_SMOOTH_MIN, 3},
+    {"smoothmax", NODE_MATH_SMOOTH_MAX, 3},
+    {"wrap", NODE_MATH_WRAP, 3},
+    {"neg", NODE_MATH_NEG, 1}
+};
+
+constexpr ConstantEntry CONSTANT_ENTRIES[] = {
+    {"pi", M_PI},
+    {"e", M_E}
+};
+
+/* Built-in functions and operators (by their symbol) and named constants, shared by every parser. */
+inline constexpr NameTable<FunctionEntry, size(FUNCTION_ENTRIES), 256> FUNCTIONS(FUNCTION_ENTRIES);
+inline constexpr NameTable<ConstantEntry, size(CONSTANT_ENTRIES), 4> CONSTANTS(CONSTANT_ENTRIES);
@@ -0,0 +1,663 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "exprtree.hpp"
+#include "exprfunctions.hpp"
+#include "math_functions_generic.hh"
+
+using namespace std;
+
+float apply_operation(unsigned short operation, int arity, const float* args) {
+    float result = 0.0f;
+    if (arity==1) {
+        blender::nodes::try_dispatch_float_math_fl_to_fl(operation, [&](auto math_function) {
+            result = math_function(args[0]);
+        });
+    } else if (arity==2) {
+        blender::nodes::try_dispatch_float_math_fl_fl_to_fl(operation, [&](auto math_function) {
+            result = math_function(args[0], args[1]);
+        });
+    } else if (arity==3) {
+        blender::nodes::try_dispatch_float_math_fl_fl_fl_to_fl(operation, [&](auto math_function) {
+            result = math_function(args[0], args[1], args[2]);
+        });
+    }
+    return result;
+}
+
+double apply_precise_operation(unsigned short operation, int arity, const double* args) {
+    double result = 0.0;
+    if (arity==1) {
+        blender::nodes::try_dispatch_value_math_v_to_v<double>(operation, [&](auto math_function) {
+            result = math_function(args[0]);
+        });
+    } else if (arity==2) {
+        blender::nodes::try_dispatch_value_math_v_v_to_v<double>(operation, [&](auto math_function) {
+            result = math_function(args[0], args[1]);
+        });
+    } else if (arity==3) {
+        blender::nodes::try_dispatch_value_math_v_v_v_to_v<double>(operation, [&](auto math_function) {
+            result = math_function(args[0], args[1], args[2]);
+        });
+    }
+    return result;
+}
+
+size_t ExpressionNodeHash::operator()(const ExpressionNode& node) const {
+    uint32_t value_bits;
+    uint64_t precise_bits;
+    memcpy(&value_bits, &node.value, sizeof(float));
+    memcpy(&precise_bits, &node.precise, sizeof(double));
+    size_t hash = node.kind;
+    hash = hash*31 + node.arity;
+    hash = hash*31 + node.operation;
+    hash = hash*31 + (uint32_t)node.slot;
+    hash = hash*31 + value_bits;
+    hash = hash*31 + precise_bits;
+    for (int i=0; i<node.arity; i++) {
+        hash = hash*31 + (uint32_t)node.args[i];
+    }
+    return hash;
+}
+
+bool ExpressionNodeEqual::operator()(const ExpressionNode& a, const ExpressionNode& b) const {
+    /* Constants compare by bit pattern, so 0 and -0 (or two NaNs) stay distinct. */
+    return a.kind==b.kind && a.arity==b.arity && a.operation==b.operation && a.slot==b.slot
+        && memcmp(&a.value, &b.value, sizeof(float))==0
+        && memcmp(&a.precise, &b.precise, sizeof(double))==0
+        && equal(a.args, a.args + a.arity, b.args);
+}
+
+ExpressionTree::ExpressionTree() {}
+
+ExpressionTree::ExpressionTree(const CompiledExpression& compiled) {
+    vector<int> slot_map;
+    for (size_t slot=0; slot<compiled.get_variables().size(); slot++) {
+        slot_map.push_back(slot);
+    }
+    add_expression(compiled, slot_map);
+}
+
+void ExpressionTree::add_expression(const CompiledExpression& compiled, const vector<int>& slot_map) {
+    const SharedArray<float>& constants = compiled.get_constants();
+    const SharedArray<double>& precise_constants = compiled.get_precise_constants();
+    vector<int> node_stack;
+    vector<int> temps;
+    vector<int> results(compiled.get_result_count(), -1);
+    bool stores_results = false;
+    for (const Instruction& instruction: compiled.get_program()) {
+        switch (instruction.kind) {
+            case INSTRUCTION_CONSTANT:
+                node_stack.push_back(add_constant(constants[instruction.index], precise_constants[instruction.index]));
+                break;
+            case INSTRUCTION_VARIABLE:
+                node_stack.push_back(add_variable(slot_map[instruction.index]));
+                break;
+            case INSTRUCTION_LOAD_TEMP:
+                node_stack.push_back(temps[instruction.index]);
+                break;
+            case INSTRUCTION_STORE_TEMP:
+                if (temps.size()<=(size_t)instruction.index) {
+                    temps.resize(instruction.index+1, -1);
+                }
+                temps[instruction.index] = node_stack.back();
+                break;
+            case INSTRUCTION_STORE_RESULT:
+                results[instruction.index] = node_stack.back();
+                node_stack.pop_back();
+                stores_results = true;
+                break;
+            case INSTRUCTION_OPERATION:
+            case INSTRUCTION_CALL: {
+                int args[MAX_FUNCTION_ARITY];
+                for (int i=instruction.arity-1; i>=0; i--) {
+                    args[i] = node_stack.back();
+                    node_stack.pop_back();
+                }
+                node_stack.push_back(instruction.kind==INSTRUCTION_CALL
+                                     ? add_call(instruction.index, instruction.arity, args)
+                                     : add_operation(instruction.operation, instruction.arity, args));
+                break;
+            }
+        }
+    }
+    if (stores_results) {
+        roots.insert(roots.end(), results.begin(), results.end());
+    } else if (!node_stack.empty()) {
+        roots.push_back(node_stack.back());
+    }
+}
+
+int ExpressionTree::add_node(const ExpressionNode& node) {
+    auto search = node_lookup.find(node);
+    if (search!=node_lookup.end()) {
+        return search->second;
+    }
+    nodes.push_back(node);
+    node_lookup[node] = nodes.size()-1;
+    return nodes.size()-1;
+}
+
+int ExpressionTree::add_constant(float value, double precise) {
+    ExpressionNode node = {INSTRUCTION_CONSTANT, 0, 0, -1, value, precise, {-1, -1, -1}};
+    return add_node(node);
+}
+
+int ExpressionTree::add_variable(int slot) {
+    ExpressionNode node = {INSTRUCTION_VARIABLE, 0, 0, slot, 0.0f, 0.0, {-1, -1, -1}};
+    return add_node(node);
+}
+
+int ExpressionTree::add_operation(unsigned short operation, int arity, const int* args) {
+    ExpressionNode node = {INSTRUCTION_OPERATION, (unsigned char)arity, operation, -1, 0.0f, 0.0, {-1, -1, -1}};
+    for (int i=0; i<arity; i++) {
+        node.args[i] = args[i];
+    }
+    return add_node(node);
+}
+
+int ExpressionTree::add_call(int function, int arity, const int* args) {
+    ExpressionNode node = {INSTRUCTION_CALL, (unsigned char)arity, 0, function, 0.0f, 0.0, {-1, -1, -1}};
+    for (int i=0; i<arity; i++) {
+        node.args[i] = args[i];
+    }
+    if (FunctionRegistry::get(function).pure) {
+        return add_node(node);
+    }
+    nodes.push_back(node);
+    return nodes.size()-1;
+}
+
+bool ExpressionTree::is_constant(int node, double value) const {
+    return nodes[node].kind==INSTRUCTION_CONSTANT && nodes[node].value==(float)value && nodes[node].precise==value;
+}
+
+/* Adds an operation node, folding it or rewriting it into something cheaper when
+   that gives exactly the same result for every input. x*0 is deliberately left
+   alone because it is not 0 for infinite or NaN x. */
+int ExpressionTree::add_simplified_operation(unsigned short operation, int arity, const int* args) {
+    bool all_constant = true;
+    float values[3];
+    double precise_values[3];
+    for (int i=0; i<arity; i++) {
+        all_constant = all_constant && nodes[args[i]].kind==INSTRUCTION_CONSTANT;
+        values[i] = nodes[args[i]].value;
+        precise_values[i] = nodes[args[i]].precise;
+    }
+    if (all_constant) {
+        /* Folded in float and in double, so evaluate() and evaluate_as<double>() see what
+           they would have computed. The fixed-point types get the double value converted,
+           which can differ from computing in fixed point: 1/3*3 folds to exactly 1, where
+           evaluating it in Fixed32 gives 0.99998. */
+        return add_constant(apply_operation(operation, arity, values),
+                            apply_precise_operation(operation, arity, precise_values));
+    }
+    if (arity==1 && operation==NODE_MATH_NEG) {
+        const ExpressionNode& arg = nodes[args[0]];
+        if (arg.kind==INSTRUCTION_OPERATION && arg.arity==1 && arg.operation==NODE_MATH_NEG) {
+            return arg.args[0];
+        }
+    }
+    if (arity==2) {
+        switch (operation) {
+            case NODE_MATH_MULTIPLY:
+                if (is_constant(args[1], 1.0f)) {
+                    return args[0];
+                }
+                if (is_constant(args[0], 1.0f)) {
+                    return args[1];
+                }
+                break;
+            case NODE_MATH_ADD: {
+                /* Only -0 can be dropped: -0+0 is +0, but x+-0 is x for every x. */
+                if (is_constant(args[1], 0.0f) && signbit(nodes[args[1]].value)) {
+                    return args[0];
+                }
+                if (is_constant(args[0], 0.0f) && signbit(nodes[args[0]].value)) {
+                    return args[1];
+                }
+                /* a*b+c -> multiply_add(a, b, c); addition commutes, so c+a*b fuses too. */
+                for (int side=0; side<2; side++) {
+                    const ExpressionNode& product = nodes[args[side]];
+                    if (product.kind==INSTRUCTION_OPERATION && product.arity==2
+                        && product.operation==NODE_MATH_MULTIPLY) {
+                        int fused_args[3] = {product.args[0], product.args[1], args[1-side]};
+                        return add_operation(NODE_MATH_MULTIPLY_ADD, 3, fused_args);
+                    }
+                }
+                break;
+            }
+            case NODE_MATH_SUBTRACT:
+                /* Likewise x-0 is x, but -0-(-0) is +0. */
+                if (is_constant(args[1], 0.0f) && !signbit(nodes[args[1]].value)) {
+                    return args[0];
+                }
+                break;
+            case NODE_MATH_DIVIDE:
+            case NODE_MATH_POWER:
+                if (is_constant(args[1], 1.0f)) {
+                    return args[0];
+                }
+                break;
+        }
+    }
+    return add_operation(operation, arity, args);
+}
+
+/* A pure function of constants is folded. Like the evaluators for double, the
+   precise value is the function of the precise arguments rounded to float. */
+int ExpressionTree::add_simplified_call(int function, int arity, const int* args) {
+    const RegisteredFunction& registered = FunctionRegistry::get(function);
+    bool all_constant = registered.pure;
+    float values[MAX_FUNCTION_ARITY];
+    float precise_values[MAX_FUNCTION_ARITY];
+    for (int i=0; i<arity; i++) {
+        all_constant = all_constant && nodes[args[i]].kind==INSTRUCTION_CONSTANT;
+        values[i] = nodes[args[i]].value;
+        precise_values[i] = (float)nodes[args[i]].precise;
+    }
+    if (all_constant) {
+        return add_constant(registered.call(registered.state, values),
+                            registered.call(registered.state, precise_values));
+    }
+    return add_call(function, arity, args);
+}
+
+ExpressionTree ExpressionTree::simplified() const {
+    ExpressionTree result;
+    vector<int> mapped(nodes.size(), -1);
+    for (size_t i=0; i<nodes.size(); i++) {
+        const ExpressionNode& node = nodes[i];
+        switch (node.kind) {
+            case INSTRUCTION_CONSTANT:
+                mapped[i] = result.add_constant(node.value, node.precise);
+                break;
+            case INSTRUCTION_VARIABLE:
+                mapped[i] = result.add_variable(node.slot);
+                break;
+            case INSTRUCTION_OPERATION: {
+                int args[3];
+                for (int a=0; a<node.arity; a++) {
+                    args[a] = mapped[node.args[a]];
+                }
+                mapped[i] = result.add_simplified_operation(node.operation, node.arity, args);
+                break;
+            }
+            case INSTRUCTION_CALL: {
+                int args[MAX_FUNCTION_ARITY];
+                for (int a=0; a<node.arity; a++) {
+                    args[a] = mapped[node.args[a]];
+                }
+                mapped[i] = result.add_simplified_call(node.slot, node.arity, args);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    for (int root: roots) {
+        result.roots.push_back(mapped[root]);
+    }
+    return result;
+}
+
+CompiledExpression ExpressionTree::to_compiled(const string& source, const vector<string>& variables) const {
+    /* Count how often each reachable node is used; shared operations get a temporary. */
+    vector<int> uses(nodes.size(), 0);
+    vector<int> reachable;
+    for (int root: roots) {
+        if (uses[root]++==0) {
+            reachable.push_back(root);
+        }
+    }
+    for (size_t i=0; i<reachable.size(); i++) {
+        const ExpressionNode& node = nodes[reachable[i]];
+        for (int a=0; a<node.arity; a++) {
+            if (uses[node.args[a]]++==0) {
+                reachable.push_back(node.args[a]);
+            }
+        }
+    }
+
+    vector<Instruction> program;
+    vector<float> constants;
+    vector<double> precise_constants;
+    vector<int> temp_of(nodes.size(), -1);
+    int temp_count = 0;
+    int depth = 0;
+    int max_depth = 0;
+    bool store_results = roots.size()!=1;
+    vector<pair<int, int>> pending;
+    for (int r=0; r<(int)roots.size(); r++) {
+        /* Post-order walk with an explicit stack, so long chains cannot overflow the call stack. */
+        pending.push_back(make_pair(roots[r], 0));
+        while (!pending.empty()) {
+            int node_index = pending.back().first;
+            int next_arg = pending.back().second;
+            const ExpressionNode& node = nodes[node_index];
+            Instruction instruction = {node.kind, node.arity, node.operation, 0};
+            if (temp_of[node_index]>=0) {
+                pending.pop_back();
+                instruction = {INSTRUCTION_LOAD_TEMP, 0, 0, temp_of[node_index]};
+                depth++;
+                max_depth = max(max_depth, depth);
+                program.push_back(instruction);
+                continue;
+            }
+            bool computed = node.kind==INSTRUCTION_OPERATION || node.kind==INSTRUCTION_CALL;
+            if (computed && next_arg<node.arity) {
+                pending.back().second++;
+                pending.push_back(make_pair(node.args[next_arg], 0));
+                continue;
+            }
+            pending.pop_back();
+            if (node.kind==INSTRUCTION_CONSTANT) {
+                size_t index = 0;
+                while (index<constants.size() && (memcmp(&constants[index], &node.value, sizeof(float))!=0
+                                                  || memcmp(&precise_constants[index], &node.precise, sizeof(double))!=0)) {
+                    index++;
+                }
+                if (index==constants.size()) {
+                    constants.push_back(node.value);
+                    precise_constants.push_back(node.precise);
+                }
+                instruction.index = index;
+                depth++;
+            } else if (node.kind==INSTRUCTION_VARIABLE) {
+                instruction.index = node.slot;
+                depth++;
+            } else if (node.kind==INSTRUCTION_CALL) {
+                instruction.index = node.slot;
+                depth -= node.arity - 1;
+            } else {
+                depth -= node.arity - 1;
+            }
+            max_depth = max(max_depth, depth);
+            program.push_back(instruction);
+            if (computed && uses[node_index]>1) {
+                temp_of[node_index] = temp_count++;
+                instruction = {INSTRUCTION_STORE_TEMP, 0, 0, temp_of[node_index]};
+                program.push_back(instruction);
+            }
+        }
+        if (store_results) {
+            Instruction instruction = {INSTRUCTION_STORE_RESULT, 0, 0, r};
+            program.push_back(instruction);
+            depth--;
+        }
+    }
+    return CompiledExpression(source, program, constants, variables, max_depth,
+                              temp_count, store_results ? roots.size() : 1, precise_constants);
+}
+
+/* Builds derivative nodes into a tree. A derivative that is 0 whatever the inputs
+   is ZERO rather than a node, so subexpressions that do not depend on the variable
+   cost nothing, and no x*0 (which the simplifier rightly keeps) is ever made. */
+class Differentiator {
+    public:
+    static constexpr int ZERO = -1;
+
+    Differentiator(ExpressionTree& tree) : tree(tree) {}
+
+    int constant(double value) {
+        return tree.add_constant((float)value, value);
+    }
+
+    int operation(unsigned short operation, int a, int b = -1, int c = -1) {
+        int args[3] = {a, b, c};
+        int arity = (b<0) ? 1 : (c<0) ? 2 : 3;
+        return tree.add_operation(operation, arity, args);
+    }
+
+    int add(int a, int b) {
+        if (a==ZERO) {
+            return b;
+        }
+        if (b==ZERO) {
+            return a;
+        }
+        return operation(NODE_MATH_ADD, a, b);
+    }
+
+    int subtract(int a, int b) {
+        if (b==ZERO) {
+            return a;
+        }
+        if (a==ZERO) {
+            return operation(NODE_MATH_NEG, b);
+        }
+        return operation(NODE_MATH_SUBTRACT, a, b);
+    }
+
+    int multiply(int a, int b) {
+        if (a==ZERO || b==ZERO) {
+            return ZERO;
+        }
+        return operation(NODE_MATH_MULTIPLY, a, b);
+    }
+
+    /* Division is safe_divide, so this is 0 where b is 0. */
+    int divide(int a, int b) {
+        if (a==ZERO) {
+            return ZERO;
+        }
+        return operation(NODE_MATH_DIVIDE, a, b);
+    }
+
+    int negate(int a) {
+        if (a==ZERO) {
+            return ZERO;
+        }
+        return operation(NODE_MATH_NEG, a);
+    }
+
+    /* 1 where a is not 0, else 0. */
+    int is_nonzero(int a) {
+        return operation(NODE_MATH_ABSOLUTE, operation(NODE_MATH_SIGN, a));
+    }
+
+    /* Partial derivatives of smoothmin(a, b, c); the same rule as math_derivatives.hh. */
+    void smoothmin_partials(int a, int b, int c, int* d) {
+        int distance = operation(NODE_MATH_ABSOLUTE, operation(NODE_MATH_SUBTRACT, a, b));
+        int h = operation(NODE_MATH_DIVIDE, operation(NODE_MATH_MAXIMUM, operation(NODE_MATH_SUBTRACT, c, distance),
+                                                      constant(0.0)), c);
+        int h_squared = operation(NODE_MATH_MULTIPLY, h, h);
+        /* 1 for a < b, 0 for a > b and a half for a tie */
+        int side = operation(NODE_MATH_MULTIPLY_ADD, constant(0.5),
+                             operation(NODE_MATH_SIGN, operation(NODE_MATH_SUBTRACT, b, a)), constant(0.5));
+        int pull = operation(NODE_MATH_MULTIPLY, operation(NODE_MATH_MULTIPLY, constant(0.5), h_squared),
+                             operation(NODE_MATH_SIGN, operation(NODE_MATH_SUBTRACT, a, b)));
+        d[0] = operation(NODE_MATH_ADD, side, pull);
+        d[1] = operation(NODE_MATH_SUBTRACT, constant(1.0), d[0]);
+        d[2] = operation(NODE_MATH_NEG, operation(NODE_MATH_MULTIPLY, h_squared,
+            operation(NODE_MATH_ADD, operation(NODE_MATH_DIVIDE, h, constant(6.0)),
+                      operation(NODE_MATH_MULTIPLY, constant(0.5), operation(NODE_MATH_DIVIDE, distance, c)))));
+    }
+
+    /* d(node) from its operands x, y, z and their derivatives dx, dy, dz. */
+    int derivative(const ExpressionNode& node, int f, const int* d) {
+        int x = node.args[0];
+        int y = node.args[1];
+        int z = node.args[2];
+        int dx = d[0];
+        int dy = d[1];
+        int dz = d[2];
+        if (node.arity==1) {
+            switch (node.operation) {
+                case NODE_MATH_EXPONENT:
+                    return multiply(f, dx);
+                case NODE_MATH_SQRT:
+                    return divide(multiply(constant(0.5), dx), f);
+                case NODE_MATH_INV_SQRT:
+                    return multiply(multiply(constant(-0.5), operation(NODE_MATH_DIVIDE, f, x)), dx);
+                case NODE_MATH_ABSOLUTE:
+                    return multiply(operation(NODE_MATH_SIGN, x), dx);
+                case NODE_MATH_RADIANS:
+                    return multiply(constant(DEG2RAD(1.0)), dx);
+                case NODE_MATH_DEGREES:
+                    return multiply(constant(RAD2DEG(1.0)), dx);
+                case NODE_MATH_FRACTION:
+                    return dx;
+                case NODE_MATH_SINE:
+                    return multiply(operation(NODE_MATH_COSINE, x), dx);
+                case NODE_MATH_COSINE:
+                    return negate(multiply(operation(NODE_MATH_SINE, x), dx));
+                case NODE_MATH_TANGENT:
+                    return multiply(operation(NODE_MATH_ADD, operation(NODE_MATH_MULTIPLY, f, f), constant(1.0)), dx);
+                case NODE_MATH_SINH:
+                    return multiply(operation(NODE_MATH_COSH, x), dx);
+                case NODE_MATH_COSH:
+                    return multiply(operation(NODE_MATH_SINH, x), dx);
+                case NODE_MATH_TANH:
+                    return multiply(operation(NODE_MATH_SUBTRACT, constant(1.0), operation(NODE_MATH_MULTIPLY, f, f)), dx);
+                case NODE_MATH_ARCSINE:
+                case NODE_MATH_ARCCOSINE: {
+                    /* isqrt is 0 outside (-1, 1), where the clamped functions are flat */
+                    int slope = operation(NODE_MATH_INV_SQRT, operation(NODE_MATH_SUBTRACT, constant(1.0),
+                                                                        operation(NODE_MATH_MULTIPLY, x, x)));
+                    int dslope = multiply(slope, dx);
+                    return node.operation==NODE_MATH_ARCSINE ? dslope : negate(dslope);
+                }
+                case NODE_MATH_ARCTANGENT:
+                    return divide(dx, operation(NODE_MATH_ADD, operation(NODE_MATH_MULTIPLY, x, x), constant(1.0)));
+                case NODE_MATH_NEG:
+                    return negate(dx);
+            }
+            /* sign, round, floor, ceil and trunc are flat */
+            return ZERO;
+        }
+        if (node.arity==2) {
+            switch (node.operation) {
+                case NODE_MATH_ADD:
+                    return add(dx, dy);
+                case NODE_MATH_SUBTRACT:
+                    return subtract(dx, dy);
+                case NODE_MATH_MULTIPLY:
+                    return add(multiply(dx, y), multiply(x, dy));
+                case NODE_MATH_DIVIDE:
+                    return divide(subtract(dx, multiply(f, dy)), y);
+                case NODE_MATH_POWER: {
+                    /* safe_pow is 0 for a negative base and a fractional exponent, and
+                       pow(x, y-1) is then 0 as well; log(x, e) is 0 for x <= 0 */
+                    int dbase = ZERO;
+                    if (dx!=ZERO && !tree.is_constant(y, 0.0)) {
+                        int slope = operation(NODE_MATH_MULTIPLY, y, operation(NODE_MATH_POWER, x,
+                                              operation(NODE_MATH_SUBTRACT, y, constant(1.0))));
+                        dbase = multiply(slope, dx);
+                    }
+                    int dexponent = multiply(multiply(f, operation(NODE_MATH_LOGARITHM, x, constant(M_E))), dy);
+                    return add(dbase, dexponent);
+                }
+                case NODE_MATH_LOGARITHM: {
+                    /* log(a, b) = ln a / ln b, 0 unless a > 0 and b > 0 */
+                    int log_base = operation(NODE_MATH_LOGARITHM, y, constant(M_E));
+                    int da = multiply(operation(NODE_MATH_GREATER_THAN, x, constant(0.0)),
+                                      divide(dx, operation(NODE_MATH_MULTIPLY, x, log_base)));
+                    int db = divide(multiply(f, dy), operation(NODE_MATH_MULTIPLY, y, log_base));
+                    return subtract(da, db);
+                }
+                case NODE_MATH_MINIMUM:
+                case NODE_MATH_MAXIMUM: {
+                    /* The evaluator's min(a, b) is b only when b < a, and max(a, b) b only when a < b */
+                    int takes_b = node.operation==NODE_MATH_MINIMUM ? operation(NODE_MATH_LESS_THAN, y, x)
+                                                                    : operation(NODE_MATH_LESS_THAN, x, y);
+                    int takes_a = operation(NODE_MATH_SUBTRACT, constant(1.0), takes_b);
+                    return add(multiply(takes_a, dx), multiply(takes_b, dy));
+                }
+                case NODE_MATH_MODULO: {
+                    int quotient = operation(NODE_MATH_TRUNC, operation(NODE_MATH_DIVIDE, x, y));
+                    return subtract(multiply(is_nonzero(y), dx), multiply(quotient, dy));
+                }
+                case NODE_MATH_SNAP:
+                    return multiply(operation(NODE_MATH_FLOOR, operation(NODE_MATH_DIVIDE, x, y)), dy);
+                case NODE_MATH_ARCTAN2: {
+                    int length_squared = operation(NODE_MATH_ADD, operation(NODE_MATH_MULTIPLY, x, x),
+                                                   operation(NODE_MATH_MULTIPLY, y, y));
+                    return divide(subtract(multiply(y, dx), multiply(x, dy)), length_squared);
+                }
+                case NODE_MATH_PINGPONG: {
+                    /* |u| with u = fract(t)*2b - b and t = (a - b) / 2b; everything is 0 for b = 0 */
+                    int t = operation(NODE_MATH_DIVIDE, operation(NODE_MATH_SUBTRACT, x, y),
+                                      operation(NODE_MATH_MULTIPLY, y, constant(2.0)));
+                    int u = operation(NODE_MATH_SUBTRACT, operation(NODE_MATH_MULTIPLY, operation(NODE_MATH_MULTIPLY,
+                                      operation(NODE_MATH_FRACTION, t), y), constant(2.0)), y);
+                    int scale_slope = operation(NODE_MATH_MULTIPLY, constant(-2.0),
+                                                operation(NODE_MATH_ADD, operation(NODE_MATH_FLOOR, t), constant(1.0)));
+                    return multiply(operation(NODE_MATH_SIGN, u), add(dx, multiply(scale_slope, dy)));
+                }
+            }
+            /* the comparisons are flat */
+            return ZERO;
+        }
+        switch (node.operation) {
+            case NODE_MATH_MULTIPLY_ADD:
+                return add(add(multiply(dx, y), multiply(x, dy)), dz);
+            case NODE_MATH_SMOOTH_MIN:
+            case NODE_MATH_SMOOTH_MAX: {
+                /* smoothmax is -smoothmin(-a, -b, -c), whose partials are smoothmin's at (-a, -b, -c) */
+                int partials[3];
+                if (node.operation==NODE_MATH_SMOOTH_MIN) {
+                    smoothmin_partials(x, y, z, partials);
+                } else {
+                    smoothmin_partials(operation(NODE_MATH_NEG, x), operation(NODE_MATH_NEG, y),
+                                       operation(NODE_MATH_NEG, z), partials);
+                }
+                return add(add(multiply(partials[0], dx), multiply(partials[1], dy)), multiply(partials[2], dz));
+            }
+            case NODE_MATH_WRAP: {
+                /* value - range*floor((value - min) / range), or min when the range is 0 */
+                int range = operation(NODE_MATH_SUBTRACT, y, z);
+                int wraps = operation(NODE_MATH_FLOOR, operation(NODE_MATH_DIVIDE, operation(NODE_MATH_SUBTRACT, x, z), range));
+                int wrapping = is_nonzero(range);
+                return add(add(multiply(wrapping, dx), multiply(wraps, subtract(dz, dy))),
+                           multiply(operation(NODE_MATH_SUBTRACT, constant(1.0), wrapping), dz));
+            }
+        }
+        /* compare is flat */
+        return ZERO;
+    }
+
+    private:
+    ExpressionTree& tree;
+};
+
+ExpressionTree ExpressionTree::differentiated(int slot) const {
+    ExpressionTree result = *this;
+    Differentiator differentiator(result);
+    vector<int> derivatives(nodes.size(), Differentiator::ZERO);
+    for (int i=0; i<(int)nodes.size(); i++) {
+        /* A copy, as adding nodes may move the vector */
+        ExpressionNode node = nodes[i];
+        if (node.kind==INSTRUCTION_VARIABLE && node.slot==slot) {
+            derivatives[i] = differentiator.constant(1.0);
+        } else if (node.kind==INSTRUCTION_CALL) {
+            for (int a=0; a<node.arity; a++) {
+                if (derivatives[node.args[a]]!=Differentiator::ZERO) {
+                    throw invalid_argument("No derivative for function " + FunctionRegistry::get(node.slot).name);
+                }
+            }
+        } else if (node.kind==INSTRUCTION_OPERATION) {
+            int d[3] = {Differentiator::ZERO, Differentiator::ZERO, Differentiator::ZERO};
+            bool depends = false;
+            for (int a=0; a<node.arity; a++) {
+                d[a] = derivatives[node.args[a]];
+                depends = depends || d[a]!=Differentiator::ZERO;
+            }
+            if (depends) {
+                derivatives[i] = differentiator.derivative(node, i, d);
+            }
+        }
+    }
+    result.roots.clear();
+    for (int root: roots) {
+        int derivative = derivatives[root];
+        result.roots.push_back(derivative==Differentiator::ZERO ? differentiator.constant(0.0) : derivative);
+    }
+    if (result.roots.empty()) {
+        result.roots.push_back(differentiator.constant(0.0));
+    }
+    return result;
+}
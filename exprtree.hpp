@@ -0,0 +1,67 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "exprparser.hpp"
+
+/* One node of an ExpressionTree. Operation and call nodes refer to their operands
+   by index; slot is the variable slot of a variable and the function id of a call. */
+struct ExpressionNode {
+    InstructionKind kind;
+    unsigned char arity;
+    unsigned short operation;
+    int slot;
+    float value;
+    double precise;
+    int args[MAX_FUNCTION_ARITY];
+};
+
+struct ExpressionNodeHash {
+    size_t operator()(const ExpressionNode& node) const;
+};
+
+struct ExpressionNodeEqual {
+    bool operator()(const ExpressionNode& a, const ExpressionNode& b) const;
+};
+
+/* Tree form of a compiled program, for passes that need to see whole subexpressions
+   rather than a flat RPN stream. Nodes are stored operands first, so every node's
+   arguments have smaller indices than the node itself.
+   Adding a node that already exists returns the existing one, so repeated
+   subexpressions become a single shared node and the tree is really a DAG.
+   Each root is one result; most trees have just one. */
+class ExpressionTree {
+    public:
+    ExpressionTree();
+    ExpressionTree(const CompiledExpression& compiled);
+    /* Adds the roots of `compiled`, with its variable slot i renumbered to slot_map[i]. */
+    void add_expression(const CompiledExpression& compiled, const vector<int>& slot_map);
+    /* precise is the same constant in double, see CompiledExpression::get_precise_constants(). */
+    int add_constant(float value, double precise);
+    int add_variable(int slot);
+    int add_operation(unsigned short operation, int arity, const int* args);
+    /* A call of registered function `function`. Calls of a function that is not pure
+       are never merged, even with the same arguments. */
+    int add_call(int function, int arity, const int* args);
+    /* True for a constant node that is exactly `value` in float and in double. */
+    bool is_constant(int node, double value) const;
+    ExpressionTree simplified() const;
+    /* A tree whose roots are the derivatives of these roots with respect to variable
+       `slot`, sharing this tree's nodes; simplified() then folds it. invalid_argument
+       if that needs the derivative of a registered function. */
+    ExpressionTree differentiated(int slot) const;
+    /* Emits RPN. Operation nodes used more than once are computed once into a temporary. */
+    CompiledExpression to_compiled(const string& source, const vector<string>& variables) const;
+    vector<ExpressionNode> nodes;
+    vector<int> roots;
+    private:
+    int add_node(const ExpressionNode& node);
+    int add_simplified_operation(unsigned short operation, int arity, const int* args);
+    int add_simplified_call(int function, int arity, const int* args);
+    unordered_map<ExpressionNode, int, ExpressionNodeHash, ExpressionNodeEqual> node_lookup;
+};
+
+/* Applies one NodeMathOperation to `arity` arguments, exactly as the evaluator does. */
+float apply_operation(unsigned short operation, int arity, const float* args);
+/* The same in double, as evaluate_as<double>() does. */
+double apply_precise_operation(unsigned short operation, int arity, const double* args);
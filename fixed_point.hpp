@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+using namespace std;
+
+/* Multiplication and division of fixed-point numbers need twice the bits of the raw value. */
+template <class Int> struct FixedPointWide;
+template <> struct FixedPointWide<int32_t> { typedef int64_t type; };
+#ifdef __SIZEOF_INT128__
+template <> struct FixedPointWide<int64_t> { typedef __int128 type; };
+#else
+/* Without a 128-bit integer, 64-bit products go through long double and lose low bits. */
+template <> struct FixedPointWide<int64_t> { typedef long double type; };
+#endif
+
+/* Signed fixed-point number: raw / 2^FRACTION_BITS. Addition and subtraction wrap
+   like the underlying integer; conversion from double saturates, and NaN becomes 0.
+   Multiplication and division work in Wide and round toward zero, and a result
+   outside the range of Int wraps as well, so 200*400 in Fixed32 is not 80000 but
+   80000-65536. Division by zero gives 0, as safe_divide does. */
+template <class Int, int FRACTION_BITS>
+class FixedPoint {
+    public:
+    typedef typename FixedPointWide<Int>::type Wide;
+    static constexpr Int ONE = Int(1) << FRACTION_BITS;
+
+    constexpr FixedPoint() : raw(0) {}
+
+    explicit FixedPoint(double value) {
+        double scaled = nearbyint(value * ONE);
+        if (!(scaled==scaled)) {
+            raw = 0;
+        } else if (scaled >= (double)numeric_limits<Int>::max()) {
+            raw = numeric_limits<Int>::max();
+        } else if (scaled <= (double)numeric_limits<Int>::min()) {
+            raw = numeric_limits<Int>::min();
+        } else {
+            raw = (Int)scaled;
+        }
+    }
+
+    static constexpr FixedPoint from_raw(Int raw) {
+        FixedPoint value;
+        value.raw = raw;
+        return value;
+    }
+
+    constexpr Int get_raw() const {
+        return raw;
+    }
+
+    explicit operator double() const {
+        return (double)raw / ONE;
+    }
+
+    FixedPoint operator+(FixedPoint other) const {
+        return from_raw((Int)((make_unsigned_t<Int>)raw + (make_unsigned_t<Int>)other.raw));
+    }
+
+    FixedPoint operator-(FixedPoint other) const {
+        return from_raw((Int)((make_unsigned_t<Int>)raw - (make_unsigned_t<Int>)other.raw));
+    }
+
+    FixedPoint operator-() const {
+        return from_raw((Int)(0 - (make_unsigned_t<Int>)raw));
+    }
+
+    FixedPoint operator*(FixedPoint other) const {
+        return from_raw((Int)((Wide)raw * other.raw / ONE));
+    }
+
+    FixedPoint operator/(FixedPoint other) const {
+        if (other.raw==0) {
+            return FixedPoint();
+        }
+        return from_raw((Int)((Wide)raw * ONE / other.raw));
+    }
+
+    bool operator==(FixedPoint other) const { return raw==other.raw; }
+    bool operator!=(FixedPoint other) const { return raw!=other.raw; }
+    bool operator<(FixedPoint other) const { return raw<other.raw; }
+    bool operator>(FixedPoint other) const { return raw>other.raw; }
+    bool operator<=(FixedPoint other) const { return raw<=other.raw; }
+    bool operator>=(FixedPoint other) const { return raw>=other.raw; }
+
+    private:
+    Int raw;
+};
+
+/* 16.16 and 32.32 formats. */
+typedef FixedPoint<int32_t, 16> Fixed32;
+typedef FixedPoint<int64_t, 32> Fixed64;
+
+namespace std {
+    template <class Int, int FRACTION_BITS>
+    class numeric_limits<FixedPoint<Int, FRACTION_BITS>> {
+        public:
+        static constexpr bool is_specialized = true;
+        static constexpr FixedPoint<Int, FRACTION_BITS> epsilon() {
+            return FixedPoint<Int, FRACTION_BITS>::from_raw(1);
+        }
+        static constexpr FixedPoint<Int, FRACTION_BITS> min() {
+            return FixedPoint<Int, FRACTION_BITS>::from_raw(numeric_limits<Int>::min());
+        }
+        static constexpr FixedPoint<Int, FRACTION_BITS> max() {
+            return FixedPoint<Int, FRACTION_BITS>::from_raw(numeric_limits<Int>::max());
+        }
+    };
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+/* Closed range [lo, hi] of float values, for CompiledExpression::evaluate_interval().
+   An interval may be unbounded on either side (lo = -inf, hi = inf). */
+struct Interval {
+    float lo = 0.0f;
+    float hi = 0.0f;
+
+    Interval() {}
+    Interval(float value) : lo(value), hi(value) {}
+    Interval(float lo, float hi) : lo(lo), hi(hi) {}
+
+    bool contains(float value) const {
+        return lo<=value && value<=hi;
+    }
+
+    /* Smallest interval holding values[0..count), NaNs skipped; used to bound a
+       block of a column before evaluating over it. */
+    static Interval of(const float* values, size_t count) {
+        /* Comparisons are false for NaN. Eight running bounds instead of one, so
+           the loop is not one long chain of dependent compares and can use vector min/max. */
+        const size_t LANES = 8;
+        float lo[LANES];
+        float hi[LANES];
+        for (size_t lane=0; lane<LANES; lane++) {
+            lo[lane] = INFINITY;
+            hi[lane] = -INFINITY;
+        }
+        size_t whole = count - count%LANES;
+        for (size_t i=0; i<whole; i+=LANES) {
+            for (size_t lane=0; lane<LANES; lane++) {
+                float value = values[i+lane];
+                lo[lane] = value<lo[lane] ? value : lo[lane];
+                hi[lane] = value>hi[lane] ? value : hi[lane];
+            }
+        }
+        for (size_t i=whole; i<count; i++) {
+            lo[0] = values[i]<lo[0] ? values[i] : lo[0];
+            hi[0] = values[i]>hi[0] ? values[i] : hi[0];
+        }
+        for (size_t lane=1; lane<LANES; lane++) {
+            lo[0] = lo[lane]<lo[0] ? lo[lane] : lo[0];
+            hi[0] = hi[lane]>hi[0] ? hi[lane] : hi[0];
+        }
+        return Interval(lo[0], hi[0]);
+    }
+};
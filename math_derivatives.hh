@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cmath>
+
+#include "math_functions.hh"
+
+/* Partial derivatives of the float math functions of math_functions.hh, for
+   reverse-mode differentiation. Each rule gets the arguments and the value the
+   function returned for them. Unary rules return df/da; binary and ternary rules
+   write df/da, df/db (and df/dc) to d[].
+   Where a function is piecewise (min/max, floor and friends, snap, wrap, pingpong,
+   modulo) the derivative is that of the piece the arguments select, so step
+   functions and comparisons have derivative 0. At the points where safe_* functions
+   return 0 instead of failing, the derivative is 0 too. */
+namespace blender {
+  namespace nodes {
+    MINLINE void smoothmin_derivatives(float a, float b, float c, float *d)
+    {
+      if (c == 0.0f) {
+        d[0] = (a < b) ? 1.0f : 0.0f;
+        d[1] = 1.0f - d[0];
+        d[2] = 0.0f;
+        return;
+      }
+      float distance = fabsf(a - b);
+      float h = max_ff(c - distance, 0.0f) / c;
+      if (a == b) {
+        /* The smoothed minimum is symmetric here, so both arguments get half */
+        d[0] = d[1] = 0.5f;
+      }
+      else {
+        float side = (a < b) ? 1.0f : 0.0f;
+        float pull = 0.5f * h * h * compatible_signf(a - b);
+        d[0] = side + pull;
+        d[1] = 1.0f - side - pull;
+      }
+      d[2] = (h > 0.0f) ? -h * h * h * (1.0f / 6.0f) - 0.5f * h * h * distance / c : 0.0f;
+    }
+
+    template<typename Callback>
+    inline bool try_dispatch_float_math_derivative_fl_to_fl(const int operation, Callback &&callback)
+    {
+      auto dispatch = [&](auto derivative) -> bool {
+        callback(derivative);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_EXPONENT:
+          return dispatch([](float a, float result) { return result; });
+        case NODE_MATH_SQRT:
+          return dispatch([](float a, float result) { return (a > 0.0f) ? 0.5f / result : 0.0f; });
+        case NODE_MATH_INV_SQRT:
+          return dispatch([](float a, float result) { return (a > 0.0f) ? -0.5f * result / a : 0.0f; });
+        case NODE_MATH_ABSOLUTE:
+          return dispatch([](float a, float result) { return compatible_signf(a); });
+        case NODE_MATH_RADIANS:
+          return dispatch([](float a, float result) { return (float)DEG2RAD(1.0); });
+        case NODE_MATH_DEGREES:
+          return dispatch([](float a, float result) { return (float)RAD2DEG(1.0); });
+        case NODE_MATH_SIGN:
+        case NODE_MATH_ROUND:
+        case NODE_MATH_FLOOR:
+        case NODE_MATH_CEIL:
+        case NODE_MATH_TRUNC:
+          return dispatch([](float a, float result) { return 0.0f; });
+        case NODE_MATH_FRACTION:
+          return dispatch([](float a, float result) { return 1.0f; });
+        case NODE_MATH_SINE:
+          return dispatch([](float a, float result) { return cosf(a); });
+        case NODE_MATH_COSINE:
+          return dispatch([](float a, float result) { return -sinf(a); });
+        case NODE_MATH_TANGENT:
+          return dispatch([](float a, float result) { return 1.0f + result * result; });
+        case NODE_MATH_SINH:
+          return dispatch([](float a, float result) { return coshf(a); });
+        case NODE_MATH_COSH:
+          return dispatch([](float a, float result) { return sinhf(a); });
+        case NODE_MATH_TANH:
+          return dispatch([](float a, float result) { return 1.0f - result * result; });
+        case NODE_MATH_ARCSINE:
+          return dispatch([](float a, float result) { return (fabsf(a) < 1.0f) ? 1.0f / sqrtf(1.0f - a * a) : 0.0f; });
+        case NODE_MATH_ARCCOSINE:
+          return dispatch([](float a, float result) { return (fabsf(a) < 1.0f) ? -1.0f / sqrtf(1.0f - a * a) : 0.0f; });
+        case NODE_MATH_ARCTANGENT:
+          return dispatch([](float a, float result) { return 1.0f / (1.0f + a * a); });
+        case NODE_MATH_NEG:
+          return dispatch([](float a, float result) { return -1.0f; });
+      }
+      return false;
+    }
+
+    template<typename Callback>
+    inline bool try_dispatch_float_math_derivative_fl_fl_to_fl(const int operation, Callback &&callback)
+    {
+      auto dispatch = [&](auto derivative) -> bool {
+        callback(derivative);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_ADD:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = 1.0f;
+            d[1] = 1.0f;
+          });
+        case NODE_MATH_SUBTRACT:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = 1.0f;
+            d[1] = -1.0f;
+          });
+        case NODE_MATH_MULTIPLY:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = b;
+            d[1] = a;
+          });
+        case NODE_MATH_DIVIDE:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = (b != 0.0f) ? 1.0f / b : 0.0f;
+            d[1] = (b != 0.0f) ? -result / b : 0.0f;
+          });
+        case NODE_MATH_POWER:
+          return dispatch([](float a, float b, float result, float *d) {
+            if (a < 0.0f && b != (int)b) {
+              d[0] = d[1] = 0.0f;
+              return;
+            }
+            d[0] = (b != 0.0f) ? b * powf(a, b - 1.0f) : 0.0f;
+            d[1] = (a > 0.0f) ? result * logf(a) : 0.0f;
+          });
+        case NODE_MATH_LOGARITHM:
+          return dispatch([](float a, float b, float result, float *d) {
+            float log_base = (a > 0.0f && b > 0.0f) ? logf(b) : 0.0f;
+            d[0] = (log_base != 0.0f) ? 1.0f / (a * log_base) : 0.0f;
+            d[1] = (log_base != 0.0f) ? -result / (b * log_base) : 0.0f;
+          });
+        case NODE_MATH_MINIMUM:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = (b < a) ? 0.0f : 1.0f;
+            d[1] = 1.0f - d[0];
+          });
+        case NODE_MATH_MAXIMUM:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = (a < b) ? 0.0f : 1.0f;
+            d[1] = 1.0f - d[0];
+          });
+        case NODE_MATH_LESS_THAN:
+        case NODE_MATH_GREATER_THAN:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = 0.0f;
+            d[1] = 0.0f;
+          });
+        case NODE_MATH_MODULO:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = (b != 0.0f) ? 1.0f : 0.0f;
+            d[1] = (b != 0.0f) ? -truncf(a / b) : 0.0f;
+          });
+        case NODE_MATH_SNAP:
+          return dispatch([](float a, float b, float result, float *d) {
+            d[0] = 0.0f;
+            d[1] = floorf(safe_divide(a, b));
+          });
+        case NODE_MATH_ARCTAN2:
+          return dispatch([](float a, float b, float result, float *d) {
+            float length_squared = a * a + b * b;
+            d[0] = (length_squared != 0.0f) ? b / length_squared : 0.0f;
+            d[1] = (length_squared != 0.0f) ? -a / length_squared : 0.0f;
+          });
+        case NODE_MATH_PINGPONG:
+          return dispatch([](float a, float b, float result, float *d) {
+            if (b == 0.0f) {
+              d[0] = d[1] = 0.0f;
+              return;
+            }
+            /* result = |u| with u = fract(t) * 2b - b and t = (a - b) / 2b */
+            float t = (a - b) / (b * 2.0f);
+            float side = compatible_signf(fractf(t) * b * 2.0f - b);
+            d[0] = side;
+            d[1] = side * (-2.0f - 2.0f * floorf(t));
+          });
+      }
+      return false;
+    }
+
+    template<typename Callback>
+    inline bool try_dispatch_float_math_derivative_fl_fl_fl_to_fl(const int operation, Callback &&callback)
+    {
+      auto dispatch = [&](auto derivative) -> bool {
+        callback(derivative);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_MULTIPLY_ADD:
+          return dispatch([](float a, float b, float c, float result, float *d) {
+            d[0] = b;
+            d[1] = a;
+            d[2] = 1.0f;
+          });
+        case NODE_MATH_COMPARE:
+          return dispatch([](float a, float b, float c, float result, float *d) {
+            d[0] = d[1] = d[2] = 0.0f;
+          });
+        case NODE_MATH_SMOOTH_MIN:
+          return dispatch([](float a, float b, float c, float result, float *d) {
+            smoothmin_derivatives(a, b, c, d);
+          });
+        case NODE_MATH_SMOOTH_MAX:
+          /* -smoothmin(-a, -b, -c): the two negations cancel in every partial */
+          return dispatch([](float a, float b, float c, float result, float *d) {
+            smoothmin_derivatives(-a, -b, -c, d);
+          });
+        case NODE_MATH_WRAP:
+          return dispatch([](float a, float b, float c, float result, float *d) {
+            float range = b - c;
+            if (range == 0.0f) {
+              d[0] = d[1] = 0.0f;
+              d[2] = 1.0f;
+              return;
+            }
+            float wraps = floorf((a - c) / range);
+            d[0] = 1.0f;
+            d[1] = -wraps;
+            d[2] = wraps;
+          });
+      }
+      return false;
+    }
+  }
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#include "math_functions.hh"
+
+/* The operations of math_functions.hh for other value types: double, or any type
+   that converts explicitly to and from double and has arithmetic and comparison
+   operators (see fixed_point.hpp). Arithmetic, comparisons, min/max, abs and the
+   smooth/wrap/pingpong helpers use T's own operators; the transcendental and
+   rounding functions are computed in double and converted back, which for double
+   itself is exact. float keeps using math_functions.hh directly. */
+namespace blender {
+  namespace nodes {
+    template<typename T> struct ValueMath {
+      static T zero() { return T(0.0); }
+      static T one() { return T(1.0); }
+      static T epsilon() { return std::numeric_limits<T>::epsilon(); }
+
+      static T min(T a, T b) { return (a < b) ? a : b; }
+      static T max(T a, T b) { return (a > b) ? a : b; }
+      static T abs(T a)
+      {
+        if constexpr (std::is_floating_point<T>::value) {
+          return std::fabs(a);
+        }
+        else {
+          return (a < zero()) ? -a : a;
+        }
+      }
+      static T sign(T a)
+      {
+        if (a > zero()) {
+          return one();
+        }
+        if (a < zero()) {
+          return -one();
+        }
+        return zero();
+      }
+      static T safe_divide(T a, T b) { return (b != zero()) ? a / b : zero(); }
+      static T safe_mod(T a, T b) { return (b != zero()) ? T(std::fmod(double(a), double(b))) : zero(); }
+      static T safe_pow(T base, T exponent)
+      {
+        double b = double(base);
+        double e = double(exponent);
+        if (b < 0.0 && e != std::trunc(e)) {
+          return zero();
+        }
+        return T(std::pow(b, e));
+      }
+      static T safe_log(T a, T base)
+      {
+        if (a <= zero() || base <= zero()) {
+          return zero();
+        }
+        double log_base = std::log(double(base));
+        return (log_base != 0.0) ? T(std::log(double(a)) / log_base) : zero();
+      }
+      static T safe_sqrt(T a)
+      {
+        double x = double(a);
+        return T(std::sqrt(x > 0.0 ? x : 0.0));
+      }
+      static T safe_inverse_sqrt(T a) { return (a > zero()) ? T(1.0 / std::sqrt(double(a))) : zero(); }
+      static T safe_asin(T a)
+      {
+        double x = double(a);
+        CLAMP(x, -1.0, 1.0);
+        return T(std::asin(x));
+      }
+      static T safe_acos(T a)
+      {
+        double x = double(a);
+        CLAMP(x, -1.0, 1.0);
+        return T(std::acos(x));
+      }
+      static T floor(T a) { return T(std::floor(double(a))); }
+      static T ceil(T a) { return T(std::ceil(double(a))); }
+      static T fract(T a) { return a - floor(a); }
+      static T pingpong(T value, T scale)
+      {
+        if (scale == zero()) {
+          return zero();
+        }
+        return abs(fract((value - scale) / (scale * T(2.0))) * scale * T(2.0) - scale);
+      }
+      static T smoothmin(T a, T b, T c)
+      {
+        if (c != zero()) {
+          T h = max(c - abs(a - b), zero()) / c;
+          return min(a, b) - h * h * h * c * T(1.0 / 6.0);
+        }
+        return min(a, b);
+      }
+      static T wrap(T value, T max, T min)
+      {
+        T range = max - min;
+        return (range != zero()) ? value - (range * floor((value - min) / range)) : min;
+      }
+      static T compare(T a, T b, T c)
+      {
+        T limit = (c > epsilon()) ? c : epsilon();
+        return ((a == b) || (abs(a - b) <= limit)) ? one() : zero();
+      }
+    };
+
+    template<typename T, typename Callback>
+    inline bool try_dispatch_value_math_v_to_v(const int operation, Callback &&callback)
+    {
+      typedef ValueMath<T> M;
+      auto dispatch = [&](auto math_function) -> bool {
+        callback(math_function);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_EXPONENT:
+          return dispatch([](T a) { return T(std::exp(double(a))); });
+        case NODE_MATH_SQRT:
+          return dispatch([](T a) { return M::safe_sqrt(a); });
+        case NODE_MATH_INV_SQRT:
+          return dispatch([](T a) { return M::safe_inverse_sqrt(a); });
+        case NODE_MATH_ABSOLUTE:
+          return dispatch([](T a) { return M::abs(a); });
+        case NODE_MATH_RADIANS:
+          return dispatch([](T a) { return T(DEG2RAD(double(a))); });
+        case NODE_MATH_DEGREES:
+          return dispatch([](T a) { return T(RAD2DEG(double(a))); });
+        case NODE_MATH_SIGN:
+          return dispatch([](T a) { return M::sign(a); });
+        case NODE_MATH_ROUND:
+          return dispatch([](T a) { return M::floor(a + T(0.5)); });
+        case NODE_MATH_FLOOR:
+          return dispatch([](T a) { return M::floor(a); });
+        case NODE_MATH_CEIL:
+          return dispatch([](T a) { return M::ceil(a); });
+        case NODE_MATH_FRACTION:
+          return dispatch([](T a) { return M::fract(a); });
+        case NODE_MATH_TRUNC:
+          return dispatch([](T a) { return a >= M::zero() ? M::floor(a) : M::ceil(a); });
+        case NODE_MATH_SINE:
+          return dispatch([](T a) { return T(std::sin(double(a))); });
+        case NODE_MATH_COSINE:
+          return dispatch([](T a) { return T(std::cos(double(a))); });
+        case NODE_MATH_TANGENT:
+          return dispatch([](T a) { return T(std::tan(double(a))); });
+        case NODE_MATH_SINH:
+          return dispatch([](T a) { return T(std::sinh(double(a))); });
+        case NODE_MATH_COSH:
+          return dispatch([](T a) { return T(std::cosh(double(a))); });
+        case NODE_MATH_TANH:
+          return dispatch([](T a) { return T(std::tanh(double(a))); });
+        case NODE_MATH_ARCSINE:
+          return dispatch([](T a) { return M::safe_asin(a); });
+        case NODE_MATH_ARCCOSINE:
+          return dispatch([](T a) { return M::safe_acos(a); });
+        case NODE_MATH_ARCTANGENT:
+          return dispatch([](T a) { return T(std::atan(double(a))); });
+        case NODE_MATH_NEG:
+          return dispatch([](T a) { return -a; });
+      }
+      return false;
+    }
+
+    template<typename T, typename Callback>
+    inline bool try_dispatch_value_math_v_v_to_v(const int operation, Callback &&callback)
+    {
+      typedef ValueMath<T> M;
+      auto dispatch = [&](auto math_function) -> bool {
+        callback(math_function);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_ADD:
+          return dispatch([](T a, T b) { return a + b; });
+        case NODE_MATH_SUBTRACT:
+          return dispatch([](T a, T b) { return a - b; });
+        case NODE_MATH_MULTIPLY:
+          return dispatch([](T a, T b) { return a * b; });
+        case NODE_MATH_DIVIDE:
+          return dispatch([](T a, T b) { return M::safe_divide(a, b); });
+        case NODE_MATH_POWER:
+          return dispatch([](T a, T b) { return M::safe_pow(a, b); });
+        case NODE_MATH_LOGARITHM:
+          return dispatch([](T a, T b) { return M::safe_log(a, b); });
+        case NODE_MATH_MINIMUM:
+          return dispatch([](T a, T b) { return (b < a) ? b : a; });
+        case NODE_MATH_MAXIMUM:
+          return dispatch([](T a, T b) { return (a < b) ? b : a; });
+        case NODE_MATH_LESS_THAN:
+          return dispatch([](T a, T b) { return (a < b) ? M::one() : M::zero(); });
+        case NODE_MATH_GREATER_THAN:
+          return dispatch([](T a, T b) { return (a > b) ? M::one() : M::zero(); });
+        case NODE_MATH_MODULO:
+          return dispatch([](T a, T b) { return M::safe_mod(a, b); });
+        case NODE_MATH_SNAP:
+          return dispatch([](T a, T b) { return M::floor(M::safe_divide(a, b)) * b; });
+        case NODE_MATH_ARCTAN2:
+          return dispatch([](T a, T b) { return T(std::atan2(double(a), double(b))); });
+        case NODE_MATH_PINGPONG:
+          return dispatch([](T a, T b) { return M::pingpong(a, b); });
+      }
+      return false;
+    }
+
+    template<typename T, typename Callback>
+    inline bool try_dispatch_value_math_v_v_v_to_v(const int operation, Callback &&callback)
+    {
+      typedef ValueMath<T> M;
+      auto dispatch = [&](auto math_function) -> bool {
+        callback(math_function);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_MULTIPLY_ADD:
+          return dispatch([](T a, T b, T c) { return a * b + c; });
+        case NODE_MATH_COMPARE:
+          return dispatch([](T a, T b, T c) { return M::compare(a, b, c); });
+        case NODE_MATH_SMOOTH_MIN:
+          return dispatch([](T a, T b, T c) { return M::smoothmin(a, b, c); });
+        case NODE_MATH_SMOOTH_MAX:
+          return dispatch([](T a, T b, T c) { return -M::smoothmin(-a, -b, -c); });
+        case NODE_MATH_WRAP:
+          return dispatch([](T a, T b, T c) { return M::wrap(a, b, c); });
+      }
+      return false;
+    }
+  }
+}
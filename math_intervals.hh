@@ -0,0 +1,451 @@
+#pragma once
+
+#include <cmath>
+
+#include "interval.hpp"
+#include "math_functions.hh"
+
+/* Interval versions of the float math functions of math_functions.hh: given
+   intervals holding the arguments, each rule returns an interval holding every
+   value the float function can return for them, NaN aside.
+   Where the float function is exact or provably monotone in float (min/max, abs,
+   floor and friends, sqrt, modulo, snap by a constant) the rule evaluates it at the
+   ends. Everything else is computed in double and rounded outwards to float with
+   one float step to spare, which covers libm results that are within an ulp.
+   Bounds are guaranteed but not always tight: a variable used twice is treated as
+   two independent ones, and wrap, snap and pingpong only bound their period. */
+namespace blender {
+  namespace nodes {
+    /* Largest float below value, one float step further out */
+    MINLINE float interval_down(double value)
+    {
+      if (std::isnan(value)) {
+        return -INFINITY;
+      }
+      float rounded = (float)value;
+      if (rounded > value) {
+        rounded = nextafterf(rounded, -INFINITY);
+      }
+      return nextafterf(rounded, -INFINITY);
+    }
+
+    MINLINE float interval_up(double value)
+    {
+      if (std::isnan(value)) {
+        return INFINITY;
+      }
+      float rounded = (float)value;
+      if (rounded < value) {
+        rounded = nextafterf(rounded, INFINITY);
+      }
+      return nextafterf(rounded, INFINITY);
+    }
+
+    MINLINE Interval rounded_interval(double lo, double hi)
+    {
+      return Interval(interval_down(lo), interval_up(hi));
+    }
+
+    MINLINE Interval interval_hull(Interval a, Interval b)
+    {
+      return Interval(fminf(a.lo, b.lo), fmaxf(a.hi, b.hi));
+    }
+
+    MINLINE Interval whole_interval()
+    {
+      return Interval(-INFINITY, INFINITY);
+    }
+
+    /* Whether some offset + k * period lies in [lo, hi], widened a little so that
+       rounding in k * period cannot miss a point right at an end */
+    MINLINE bool interval_meets_lattice(double lo, double hi, double offset, double period)
+    {
+      double tolerance = 1e-12 * fmax(1.0, fmax(fabs(lo), fabs(hi)));
+      double k = ceil((lo - tolerance - offset) / period);
+      return offset + k * period <= hi + tolerance;
+    }
+
+    /* 0 * inf is NaN in float, which the intervals do not bound anyway */
+    MINLINE double interval_product(double a, double b)
+    {
+      return (a == 0.0 || b == 0.0) ? 0.0 : a * b;
+    }
+
+    MINLINE Interval multiply_interval(Interval a, Interval b)
+    {
+      double p0 = interval_product(a.lo, b.lo);
+      double p1 = interval_product(a.lo, b.hi);
+      double p2 = interval_product(a.hi, b.lo);
+      double p3 = interval_product(a.hi, b.hi);
+      return rounded_interval(fmin(fmin(p0, p1), fmin(p2, p3)), fmax(fmax(p0, p1), fmax(p2, p3)));
+    }
+
+    MINLINE Interval divide_interval(Interval a, Interval b)
+    {
+      if (b.lo == 0.0f && b.hi == 0.0f) {
+        return Interval(0.0f);
+      }
+      /* safe_divide() gives 0 at b = 0, and a / b grows without bound next to it */
+      if (b.lo == 0.0f && b.hi > 0.0f) {
+        return Interval(a.lo < 0.0f ? -INFINITY : 0.0f, a.hi > 0.0f ? INFINITY : 0.0f);
+      }
+      if (b.hi == 0.0f && b.lo < 0.0f) {
+        return Interval(a.hi > 0.0f ? -INFINITY : 0.0f, a.lo < 0.0f ? INFINITY : 0.0f);
+      }
+      if (b.lo < 0.0f && b.hi > 0.0f) {
+        return whole_interval();
+      }
+      double q0 = (double)a.lo / b.lo;
+      double q1 = (double)a.lo / b.hi;
+      double q2 = (double)a.hi / b.lo;
+      double q3 = (double)a.hi / b.hi;
+      return rounded_interval(fmin(fmin(q0, q1), fmin(q2, q3)), fmax(fmax(q0, q1), fmax(q2, q3)));
+    }
+
+    MINLINE Interval add_interval(Interval a, Interval b)
+    {
+      return rounded_interval((double)a.lo + b.lo, (double)a.hi + b.hi);
+    }
+
+    MINLINE Interval subtract_interval(Interval a, Interval b)
+    {
+      return rounded_interval((double)a.lo - b.hi, (double)a.hi - b.lo);
+    }
+
+    MINLINE Interval absolute_interval(Interval a)
+    {
+      if (a.lo >= 0.0f) {
+        return a;
+      }
+      if (a.hi <= 0.0f) {
+        return Interval(-a.hi, -a.lo);
+      }
+      return Interval(0.0f, fmaxf(-a.lo, a.hi));
+    }
+
+    MINLINE Interval power_interval(Interval a, Interval b)
+    {
+      double lo = INFINITY;
+      double hi = -INFINITY;
+      auto include = [&](double value) {
+        lo = fmin(lo, value);
+        hi = fmax(hi, value);
+      };
+      bool point_exponent = b.lo == b.hi;
+      /* safe_powf() tells integers apart with an int cast, which saturates to INT_MIN */
+      if (point_exponent && b.lo == floorf(b.lo) && b.lo >= -2147483648.0f && b.lo < 2147483648.0f) {
+        /* x^n is monotone on either side of 0, where even powers turn and negative ones have a pole */
+        double n = b.lo;
+        include(pow((double)a.lo, n));
+        include(pow((double)a.hi, n));
+        if (a.lo <= 0.0f && a.hi >= 0.0f) {
+          if (n < 0.0 && fmod(n, 2.0) != 0.0) {
+            return whole_interval();
+          }
+          include(pow(0.0, n));
+        }
+        return rounded_interval(lo, hi);
+      }
+      if (a.hi >= 0.0f) {
+        /* For x >= 0, x^y is monotone in x and in y, so the corners bound it */
+        double x0 = fmax(a.lo, 0.0);
+        double x1 = a.hi;
+        include(pow(x0, (double)b.lo));
+        include(pow(x0, (double)b.hi));
+        include(pow(x1, (double)b.lo));
+        include(pow(x1, (double)b.hi));
+      }
+      if (a.lo <= 0.0f && a.hi >= 0.0f && b.lo <= -1.0f) {
+        /* -0 to an odd negative power */
+        include(-INFINITY);
+      }
+      if (a.lo < 0.0f) {
+        /* Negative bases give 0 for a fractional exponent and +-|x|^y for an integer one */
+        include(0.0);
+        if (!point_exponent) {
+          double x0 = fmax(-a.hi, 0.0);
+          double x1 = -a.lo;
+          double magnitude = fmax(fmax(pow(x0, (double)b.lo), pow(x0, (double)b.hi)),
+                                  fmax(pow(x1, (double)b.lo), pow(x1, (double)b.hi)));
+          include(magnitude);
+          include(-magnitude);
+        }
+      }
+      return rounded_interval(lo, hi);
+    }
+
+    MINLINE Interval logarithm_interval(Interval a, Interval base)
+    {
+      if (a.hi <= 0.0f || base.hi <= 0.0f) {
+        return Interval(0.0f);
+      }
+      /* As safe_logf(): logf of each positive part, divided by safe_divide() */
+      Interval log_a = rounded_interval(log(fmax(a.lo, 0.0)), log((double)a.hi));
+      Interval log_base = rounded_interval(log(fmax(base.lo, 0.0)), log((double)base.hi));
+      Interval result = divide_interval(log_a, log_base);
+      if (a.lo <= 0.0f || base.lo <= 0.0f) {
+        result = interval_hull(result, Interval(0.0f));
+      }
+      return result;
+    }
+
+    MINLINE Interval modulo_interval(Interval a, Interval b)
+    {
+      /* fmodf() is exact, keeps the sign of a and is smaller than |b| */
+      float divisor = fmaxf(fabsf(b.lo), fabsf(b.hi));
+      bool nonzero = b.lo > 0.0f || b.hi < 0.0f;
+      float smallest = nonzero ? fminf(fabsf(b.lo), fabsf(b.hi)) : 0.0f;
+      if (nonzero && fmaxf(fabsf(a.lo), fabsf(a.hi)) < smallest) {
+        return a;
+      }
+      return Interval(a.lo >= 0.0f ? 0.0f : fmaxf(a.lo, -divisor), a.hi <= 0.0f ? 0.0f : fminf(a.hi, divisor));
+    }
+
+    MINLINE Interval snap_interval(Interval a, Interval b)
+    {
+      auto snap = [](float a, float b) { return floorf(safe_divide(a, b)) * b; };
+      if (b.lo == b.hi) {
+        /* Nondecreasing in a for either sign of b */
+        return Interval(snap(a.lo, b.lo), snap(a.hi, b.lo));
+      }
+      /* floor(a / b) * b lies in (a - b, a] for b > 0 and in [a, a - b) for b < 0,
+         and is 0 for b = 0; allow for rounding in the float division and product */
+      double lo = (double)a.lo - fmax(b.hi, 0.0);
+      double hi = (double)a.hi - fmin(b.lo, 0.0);
+      if (b.lo <= 0.0f && b.hi >= 0.0f) {
+        lo = fmin(lo, 0.0);
+        hi = fmax(hi, 0.0);
+      }
+      double magnitude = fmax(fmax(fabs(a.lo), fabs(a.hi)), fmax(fabs(b.lo), fabs(b.hi)));
+      return rounded_interval(lo - magnitude * 1e-6, hi + magnitude * 1e-6);
+    }
+
+    MINLINE Interval wrap_interval(Interval value, Interval max, Interval min)
+    {
+      /* The result lies between min and max, up to rounding in the float arithmetic */
+      double magnitude = fmax(fmax(fabs(value.lo), fabs(value.hi)),
+                              fmax(fmax(fabs(max.lo), fabs(max.hi)), fmax(fabs(min.lo), fabs(min.hi))));
+      return rounded_interval(fmin(min.lo, max.lo) - magnitude * 1e-6, fmax(min.hi, max.hi) + magnitude * 1e-6);
+    }
+
+    MINLINE Interval pingpong_interval(Interval a, Interval scale)
+    {
+      float largest = fmaxf(fabsf(scale.lo), fabsf(scale.hi));
+      return Interval(0.0f, largest > FLT_MAX / 2.0f ? INFINITY : largest);
+    }
+
+    /* sin or cos, which peak at peak + 2k pi and bottom out at trough + 2k pi */
+    MINLINE Interval periodic_interval(Interval a, double (*f)(double), double peak, double trough)
+    {
+      if (!std::isfinite(a.lo) || !std::isfinite(a.hi) || (double)a.hi - a.lo >= 2.0 * M_PI) {
+        return Interval(-1.0f, 1.0f);
+      }
+      double lo = fmin(f(a.lo), f(a.hi));
+      double hi = fmax(f(a.lo), f(a.hi));
+      if (interval_meets_lattice(a.lo, a.hi, peak, 2.0 * M_PI)) {
+        hi = 1.0;
+      }
+      if (interval_meets_lattice(a.lo, a.hi, trough, 2.0 * M_PI)) {
+        lo = -1.0;
+      }
+      Interval result = rounded_interval(lo, hi);
+      return Interval(fmaxf(result.lo, -1.0f), fminf(result.hi, 1.0f));
+    }
+
+    MINLINE Interval arctan2_interval(Interval a, Interval b)
+    {
+      /* The angle jumps from pi to -pi across the negative x axis, including at -0 */
+      if (b.lo <= 0.0f && a.lo <= 0.0f && a.hi >= 0.0f) {
+        return rounded_interval(-M_PI, M_PI);
+      }
+      /* Elsewhere the box does not hold the origin, so its corners bound the angle */
+      double t0 = atan2((double)a.lo, (double)b.lo);
+      double t1 = atan2((double)a.lo, (double)b.hi);
+      double t2 = atan2((double)a.hi, (double)b.lo);
+      double t3 = atan2((double)a.hi, (double)b.hi);
+      return rounded_interval(fmin(fmin(t0, t1), fmin(t2, t3)), fmax(fmax(t0, t1), fmax(t2, t3)));
+    }
+
+    MINLINE Interval smoothmin_interval(Interval a, Interval b, Interval c)
+    {
+      /* min(a, b) minus h^3 c / 6 with h in [0, 1], and no smoothing for c <= 0 */
+      double smoothing = fmax(c.hi, 0.0) * (double)(1.0f / 6.0f) * (1.0 + 0x1p-22);
+      return Interval(interval_down(fmin(a.lo, b.lo) - smoothing), fminf(a.hi, b.hi));
+    }
+
+    MINLINE Interval compare_interval(Interval a, Interval b, Interval c)
+    {
+      Interval distance = absolute_interval(subtract_interval(a, b));
+      Interval threshold(fmaxf(c.lo, FLT_EPSILON), fmaxf(c.hi, FLT_EPSILON));
+      if (distance.hi <= threshold.lo) {
+        return Interval(1.0f);
+      }
+      if (distance.lo > threshold.hi) {
+        return Interval(0.0f);
+      }
+      return Interval(0.0f, 1.0f);
+    }
+
+    template<typename Callback>
+    inline bool try_dispatch_interval_math_fl_to_fl(const int operation, Callback &&callback)
+    {
+      auto dispatch = [&](auto math_function) -> bool {
+        callback(math_function);
+        return true;
+      };
+      /* Monotone in double, rounded outwards */
+      auto increasing = [](Interval a, double (*f)(double)) { return rounded_interval(f(a.lo), f(a.hi)); };
+
+      switch (operation) {
+        case NODE_MATH_EXPONENT:
+          return dispatch([=](Interval a) { return increasing(a, exp); });
+        case NODE_MATH_SQRT:
+          return dispatch([](Interval a) { return Interval(safe_sqrtf(a.lo), safe_sqrtf(a.hi)); });
+        case NODE_MATH_INV_SQRT:
+          return dispatch([](Interval a) {
+            if (a.hi <= 0.0f) {
+              return Interval(0.0f);
+            }
+            if (a.lo <= 0.0f) {
+              return Interval(0.0f, INFINITY);
+            }
+            return rounded_interval(1.0 / sqrt((double)a.hi), 1.0 / sqrt((double)a.lo));
+          });
+        case NODE_MATH_ABSOLUTE:
+          return dispatch([](Interval a) { return absolute_interval(a); });
+        case NODE_MATH_RADIANS:
+          return dispatch([](Interval a) { return Interval((float)DEG2RAD(a.lo), (float)DEG2RAD(a.hi)); });
+        case NODE_MATH_DEGREES:
+          return dispatch([](Interval a) { return Interval((float)RAD2DEG(a.lo), (float)RAD2DEG(a.hi)); });
+        case NODE_MATH_SIGN:
+          return dispatch([](Interval a) { return Interval(compatible_signf(a.lo), compatible_signf(a.hi)); });
+        case NODE_MATH_ROUND:
+          return dispatch([](Interval a) { return Interval(floorf(a.lo + 0.5f), floorf(a.hi + 0.5f)); });
+        case NODE_MATH_FLOOR:
+          return dispatch([](Interval a) { return Interval(floorf(a.lo), floorf(a.hi)); });
+        case NODE_MATH_CEIL:
+          return dispatch([](Interval a) { return Interval(ceilf(a.lo), ceilf(a.hi)); });
+        case NODE_MATH_FRACTION:
+          return dispatch([](Interval a) {
+            /* Within one unit a - floor(a) is monotone; a tiny negative a rounds up to 1 */
+            if (floorf(a.lo) == floorf(a.hi) && std::isfinite(a.lo)) {
+              return Interval(a.lo - floorf(a.lo), a.hi - floorf(a.hi));
+            }
+            return Interval(0.0f, 1.0f);
+          });
+        case NODE_MATH_TRUNC:
+          return dispatch([](Interval a) {
+            return Interval(a.lo >= 0.0f ? floorf(a.lo) : ceilf(a.lo), a.hi >= 0.0f ? floorf(a.hi) : ceilf(a.hi));
+          });
+        case NODE_MATH_SINE:
+          return dispatch([](Interval a) { return periodic_interval(a, sin, M_PI / 2.0, -M_PI / 2.0); });
+        case NODE_MATH_COSINE:
+          return dispatch([](Interval a) { return periodic_interval(a, cos, 0.0, M_PI); });
+        case NODE_MATH_TANGENT:
+          return dispatch([](Interval a) {
+            if (!std::isfinite(a.lo) || !std::isfinite(a.hi) || (double)a.hi - a.lo >= M_PI ||
+                interval_meets_lattice(a.lo, a.hi, M_PI / 2.0, M_PI))
+            {
+              return whole_interval();
+            }
+            return rounded_interval(tan((double)a.lo), tan((double)a.hi));
+          });
+        case NODE_MATH_SINH:
+          return dispatch([=](Interval a) { return increasing(a, sinh); });
+        case NODE_MATH_COSH:
+          return dispatch([](Interval a) {
+            Interval magnitude = absolute_interval(a);
+            return rounded_interval(cosh((double)magnitude.lo), cosh((double)magnitude.hi));
+          });
+        case NODE_MATH_TANH:
+          return dispatch([=](Interval a) { return increasing(a, tanh); });
+        case NODE_MATH_ARCSINE:
+          return dispatch([](Interval a) {
+            return rounded_interval(asin(fmin(fmax(a.lo, -1.0), 1.0)), asin(fmin(fmax(a.hi, -1.0), 1.0)));
+          });
+        case NODE_MATH_ARCCOSINE:
+          return dispatch([](Interval a) {
+            return rounded_interval(acos(fmin(fmax(a.hi, -1.0), 1.0)), acos(fmin(fmax(a.lo, -1.0), 1.0)));
+          });
+        case NODE_MATH_ARCTANGENT:
+          return dispatch([=](Interval a) { return increasing(a, atan); });
+        case NODE_MATH_NEG:
+          return dispatch([](Interval a) { return Interval(-a.hi, -a.lo); });
+      }
+      return false;
+    }
+
+    template<typename Callback>
+    inline bool try_dispatch_interval_math_fl_fl_to_fl(const int operation, Callback &&callback)
+    {
+      auto dispatch = [&](auto math_function) -> bool {
+        callback(math_function);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_ADD:
+          return dispatch([](Interval a, Interval b) { return add_interval(a, b); });
+        case NODE_MATH_SUBTRACT:
+          return dispatch([](Interval a, Interval b) { return subtract_interval(a, b); });
+        case NODE_MATH_MULTIPLY:
+          return dispatch([](Interval a, Interval b) { return multiply_interval(a, b); });
+        case NODE_MATH_DIVIDE:
+          return dispatch([](Interval a, Interval b) { return divide_interval(a, b); });
+        case NODE_MATH_POWER:
+          return dispatch([](Interval a, Interval b) { return power_interval(a, b); });
+        case NODE_MATH_LOGARITHM:
+          return dispatch([](Interval a, Interval b) { return logarithm_interval(a, b); });
+        case NODE_MATH_MINIMUM:
+          return dispatch([](Interval a, Interval b) { return Interval(fminf(a.lo, b.lo), fminf(a.hi, b.hi)); });
+        case NODE_MATH_MAXIMUM:
+          return dispatch([](Interval a, Interval b) { return Interval(fmaxf(a.lo, b.lo), fmaxf(a.hi, b.hi)); });
+        case NODE_MATH_LESS_THAN:
+          return dispatch([](Interval a, Interval b) {
+            return Interval(a.hi < b.lo ? 1.0f : 0.0f, a.lo < b.hi ? 1.0f : 0.0f);
+          });
+        case NODE_MATH_GREATER_THAN:
+          return dispatch([](Interval a, Interval b) {
+            return Interval(a.lo > b.hi ? 1.0f : 0.0f, a.hi > b.lo ? 1.0f : 0.0f);
+          });
+        case NODE_MATH_MODULO:
+          return dispatch([](Interval a, Interval b) { return modulo_interval(a, b); });
+        case NODE_MATH_SNAP:
+          return dispatch([](Interval a, Interval b) { return snap_interval(a, b); });
+        case NODE_MATH_ARCTAN2:
+          return dispatch([](Interval a, Interval b) { return arctan2_interval(a, b); });
+        case NODE_MATH_PINGPONG:
+          return dispatch([](Interval a, Interval b) { return pingpong_interval(a, b); });
+      }
+      return false;
+    }
+
+    template<typename Callback>
+    inline bool try_dispatch_interval_math_fl_fl_fl_to_fl(const int operation, Callback &&callback)
+    {
+      auto dispatch = [&](auto math_function) -> bool {
+        callback(math_function);
+        return true;
+      };
+
+      switch (operation) {
+        case NODE_MATH_MULTIPLY_ADD:
+          return dispatch([](Interval a, Interval b, Interval c) {
+            return add_interval(multiply_interval(a, b), c);
+          });
+        case NODE_MATH_COMPARE:
+          return dispatch([](Interval a, Interval b, Interval c) { return compare_interval(a, b, c); });
+        case NODE_MATH_SMOOTH_MIN:
+          return dispatch([](Interval a, Interval b, Interval c) { return smoothmin_interval(a, b, c); });
+        case NODE_MATH_SMOOTH_MAX:
+          return dispatch([](Interval a, Interval b, Interval c) {
+            Interval result = smoothmin_interval(Interval(-a.hi, -a.lo), Interval(-b.hi, -b.lo), Interval(-c.hi, -c.lo));
+            return Interval(-result.hi, -result.lo);
+          });
+        case NODE_MATH_WRAP:
+          return dispatch([](Interval a, Interval b, Interval c) { return wrap_interval(a, b, c); });
+      }
+      return false;
+    }
+  }
+}
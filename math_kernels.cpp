@@ -0,0 +1,312 @@
+#include <algorithm>
+
+#include "math_functions.hh"
+#include "math_kernels.hh"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define MATH_KERNELS_X86
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#endif
+
+using std::copy;
+
+namespace blender {
+  namespace nodes {
+
+    static const int KERNEL_TABLE_SIZE = 64;
+
+#ifdef MATH_KERNELS_X86
+
+    /* GCC and Clang only generate code for instruction sets that are enabled, so each
+       block of kernels below switches its instruction set on for itself. MSVC emits any
+       intrinsic without special flags. AVX-512F implies FMA, so GCC is also told not to
+       fuse the separate multiplies and adds, which would break bit-exactness. */
+#if defined(__clang__)
+#  pragma clang attribute push(__attribute__((target("sse4.1"))), apply_to = function)
+#elif defined(__GNUC__)
+#  pragma GCC push_options
+#  pragma GCC target("sse4.1")
+#  pragma GCC optimize("fp-contract=off")
+#endif
+    namespace sse41 {
+      struct SIMD {
+        typedef __m128 V;
+        typedef __m128 M;
+        static const int WIDTH = 4;
+        static inline V load(const float *p) { return _mm_loadu_ps(p); }
+        static inline void store(float *p, V a) { _mm_storeu_ps(p, a); }
+        static inline V set1(float f) { return _mm_set1_ps(f); }
+        static inline V add(V a, V b) { return _mm_add_ps(a, b); }
+        static inline V sub(V a, V b) { return _mm_sub_ps(a, b); }
+        static inline V mul(V a, V b) { return _mm_mul_ps(a, b); }
+        static inline V div(V a, V b) { return _mm_div_ps(a, b); }
+        static inline V min(V a, V b) { return _mm_min_ps(a, b); }
+        static inline V max(V a, V b) { return _mm_max_ps(a, b); }
+        static inline V sqrt(V a) { return _mm_sqrt_ps(a); }
+        static inline V floor(V a) { return _mm_floor_ps(a); }
+        static inline V ceil(V a) { return _mm_ceil_ps(a); }
+        static inline V trunc(V a) { return _mm_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+        static inline V abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+        static inline V neg(V a) { return _mm_xor_ps(_mm_set1_ps(-0.0f), a); }
+        static inline M cmp_lt(V a, V b) { return _mm_cmplt_ps(a, b); }
+        static inline M cmp_le(V a, V b) { return _mm_cmple_ps(a, b); }
+        static inline M cmp_gt(V a, V b) { return _mm_cmpgt_ps(a, b); }
+        static inline M cmp_eq(V a, V b) { return _mm_cmpeq_ps(a, b); }
+        static inline M cmp_neq(V a, V b) { return _mm_cmpneq_ps(a, b); }
+        static inline M mask_or(M a, M b) { return _mm_or_ps(a, b); }
+        static inline V select(M mask, V a, V b) { return _mm_blendv_ps(b, a, mask); }
+        static inline V mul_in_double(V a, double factor)
+        {
+          __m128d f = _mm_set1_pd(factor);
+          __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(a), f));
+          __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(a, a)), f));
+          return _mm_movelh_ps(lo, hi);
+        }
+      };
+#include "math_kernels_impl.hh"
+    }
+#if defined(__clang__)
+#  pragma clang attribute pop
+#elif defined(__GNUC__)
+#  pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#  pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#  pragma GCC push_options
+#  pragma GCC target("avx2")
+#  pragma GCC optimize("fp-contract=off")
+#endif
+    namespace avx2 {
+      struct SIMD {
+        typedef __m256 V;
+        typedef __m256 M;
+        static const int WIDTH = 8;
+        static inline V load(const float *p) { return _mm256_loadu_ps(p); }
+        static inline void store(float *p, V a) { _mm256_storeu_ps(p, a); }
+        static inline V set1(float f) { return _mm256_set1_ps(f); }
+        static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+        static inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+        static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+        static inline V div(V a, V b) { return _mm256_div_ps(a, b); }
+        static inline V min(V a, V b) { return _mm256_min_ps(a, b); }
+        static inline V max(V a, V b) { return _mm256_max_ps(a, b); }
+        static inline V sqrt(V a) { return _mm256_sqrt_ps(a); }
+        static inline V floor(V a) { return _mm256_floor_ps(a); }
+        static inline V ceil(V a) { return _mm256_ceil_ps(a); }
+        static inline V trunc(V a) { return _mm256_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+        static inline V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+        static inline V neg(V a) { return _mm256_xor_ps(_mm256_set1_ps(-0.0f), a); }
+        static inline M cmp_lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+        static inline M cmp_le(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+        static inline M cmp_gt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+        static inline M cmp_eq(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+        static inline M cmp_neq(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+        static inline M mask_or(M a, M b) { return _mm256_or_ps(a, b); }
+        static inline V select(M mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+        static inline V mul_in_double(V a, double factor)
+        {
+          __m256d f = _mm256_set1_pd(factor);
+          __m128 lo = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(a)), f));
+          __m128 hi = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(a, 1)), f));
+          return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+        }
+      };
+#include "math_kernels_impl.hh"
+    }
+#if defined(__clang__)
+#  pragma clang attribute pop
+#elif defined(__GNUC__)
+#  pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#  pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#  pragma GCC push_options
+#  pragma GCC target("avx512f")
+#  pragma GCC optimize("fp-contract=off")
+#endif
+    namespace avx512 {
+      struct SIMD {
+        typedef __m512 V;
+        typedef __mmask16 M;
+        static const int WIDTH = 16;
+        /* The zero-masking forms with every lane selected compile to the plain instructions;
+           GCC's unmasked ones start from _mm512_undefined_ps(), which -Wall flags as
+           maybe-uninitialized wherever they are inlined. */
+        static const M ALL = 0xFFFF;
+        static inline V load(const float *p) { return _mm512_loadu_ps(p); }
+        static inline void store(float *p, V a) { _mm512_storeu_ps(p, a); }
+        static inline V set1(float f) { return _mm512_set1_ps(f); }
+        static inline V add(V a, V b) { return _mm512_add_ps(a, b); }
+        static inline V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+        static inline V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+        static inline V div(V a, V b) { return _mm512_div_ps(a, b); }
+        static inline V min(V a, V b) { return _mm512_maskz_min_ps(ALL, a, b); }
+        static inline V max(V a, V b) { return _mm512_maskz_max_ps(ALL, a, b); }
+        static inline V sqrt(V a) { return _mm512_maskz_sqrt_ps(ALL, a); }
+        static inline V floor(V a) { return _mm512_maskz_roundscale_ps(ALL, a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+        static inline V ceil(V a) { return _mm512_maskz_roundscale_ps(ALL, a, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC); }
+        static inline V trunc(V a) { return _mm512_maskz_roundscale_ps(ALL, a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+        static inline V abs(V a) { return _mm512_abs_ps(a); }
+        static inline V neg(V a)
+        {
+          return _mm512_castsi512_ps(
+              _mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32((int)0x80000000)));
+        }
+        static inline M cmp_lt(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+        static inline M cmp_le(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+        static inline M cmp_gt(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+        static inline M cmp_eq(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+        static inline M cmp_neq(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+        static inline M mask_or(M a, M b) { return _mm512_kor(a, b); }
+        static inline V select(M mask, V a, V b) { return _mm512_mask_blend_ps(mask, b, a); }
+        /* GCC's _mm512_castps512_ps256() is the unmasked extract too. */
+        template<int HALF> static inline __m256 half(V a)
+        {
+          return _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(a), HALF));
+        }
+        static inline V mul_in_double(V a, double factor)
+        {
+          __m512d f = _mm512_set1_pd(factor);
+          __m256 lo = _mm512_maskz_cvtpd_ps(0xFF, _mm512_mul_pd(
+              _mm512_maskz_cvtps_pd(0xFF, half<0>(a)), f));
+          __m256 hi = _mm512_maskz_cvtpd_ps(0xFF, _mm512_mul_pd(
+              _mm512_maskz_cvtps_pd(0xFF, half<1>(a)), f));
+          return _mm512_castpd_ps(_mm512_maskz_insertf64x4(
+              0xFF, _mm512_castps_pd(_mm512_castps256_ps512(lo)), _mm256_castps_pd(hi), 1));
+        }
+      };
+#include "math_kernels_impl.hh"
+    }
+#if defined(__clang__)
+#  pragma clang attribute pop
+#elif defined(__GNUC__)
+#  pragma GCC pop_options
+#endif
+
+    enum KernelISA { ISA_SCALAR, ISA_SSE41, ISA_AVX2, ISA_AVX512F };
+
+#ifdef _MSC_VER
+    static KernelISA detect_isa()
+    {
+      int info[4];
+      __cpuid(info, 0);
+      int max_leaf = info[0];
+      __cpuid(info, 1);
+      bool sse41 = (info[2] & (1 << 19)) != 0;
+      bool osxsave = (info[2] & (1 << 27)) != 0;
+      bool avx = (info[2] & (1 << 28)) != 0;
+      unsigned long long xcr0 = (osxsave) ? _xgetbv(0) : 0;
+      bool ymm_enabled = (xcr0 & 0x6) == 0x6;
+      bool zmm_enabled = (xcr0 & 0xe6) == 0xe6;
+      bool avx2 = false, avx512f = false;
+      if (max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+        avx512f = (info[1] & (1 << 16)) != 0;
+      }
+      if (avx512f && zmm_enabled) {
+        return ISA_AVX512F;
+      }
+      if (avx && avx2 && ymm_enabled) {
+        return ISA_AVX2;
+      }
+      return sse41 ? ISA_SSE41 : ISA_SCALAR;
+    }
+#else
+    static KernelISA detect_isa()
+    {
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f")) {
+        return ISA_AVX512F;
+      }
+      if (__builtin_cpu_supports("avx2")) {
+        return ISA_AVX2;
+      }
+      if (__builtin_cpu_supports("sse4.1")) {
+        return ISA_SSE41;
+      }
+      return ISA_SCALAR;
+    }
+#endif
+
+#else
+    enum KernelISA { ISA_SCALAR };
+
+    static KernelISA detect_isa()
+    {
+      return ISA_SCALAR;
+    }
+#endif /* MATH_KERNELS_X86 */
+
+    struct KernelTables {
+      KernelISA isa;
+      MathKernel_fl_to_fl fl_to_fl[KERNEL_TABLE_SIZE] = {nullptr};
+      MathKernel_fl_fl_to_fl fl_fl_to_fl[KERNEL_TABLE_SIZE] = {nullptr};
+      MathKernel_fl_fl_fl_to_fl fl_fl_fl_to_fl[KERNEL_TABLE_SIZE] = {nullptr};
+
+      KernelTables()
+      {
+        isa = detect_isa();
+        switch (isa) {
+#ifdef MATH_KERNELS_X86
+          case ISA_AVX512F:
+            avx512::fill_kernel_tables(fl_to_fl, fl_fl_to_fl, fl_fl_fl_to_fl);
+            break;
+          case ISA_AVX2:
+            avx2::fill_kernel_tables(fl_to_fl, fl_fl_to_fl, fl_fl_fl_to_fl);
+            break;
+          case ISA_SSE41:
+            sse41::fill_kernel_tables(fl_to_fl, fl_fl_to_fl, fl_fl_fl_to_fl);
+            break;
+#endif
+          default:
+            break;
+        }
+      }
+    };
+
+    static const KernelTables &kernel_tables()
+    {
+      static const KernelTables tables;
+      return tables;
+    }
+
+    MathKernel_fl_to_fl get_math_kernel_fl_to_fl(const int operation)
+    {
+      return (operation >= 0 && operation < KERNEL_TABLE_SIZE) ? kernel_tables().fl_to_fl[operation] : nullptr;
+    }
+
+    MathKernel_fl_fl_to_fl get_math_kernel_fl_fl_to_fl(const int operation)
+    {
+      return (operation >= 0 && operation < KERNEL_TABLE_SIZE) ? kernel_tables().fl_fl_to_fl[operation] : nullptr;
+    }
+
+    MathKernel_fl_fl_fl_to_fl get_math_kernel_fl_fl_fl_to_fl(const int operation)
+    {
+      return (operation >= 0 && operation < KERNEL_TABLE_SIZE) ? kernel_tables().fl_fl_fl_to_fl[operation] : nullptr;
+    }
+
+    const char *get_math_kernel_isa()
+    {
+      switch (kernel_tables().isa) {
+#ifdef MATH_KERNELS_X86
+        case ISA_AVX512F:
+          return "avx512f";
+        case ISA_AVX2:
+          return "avx2";
+        case ISA_SSE41:
+          return "sse4.1";
+#endif
+        default:
+          return "scalar";
+      }
+    }
+  }
+}
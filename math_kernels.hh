@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Vectorized block kernels for the NodeMathOperation set, used by batch evaluation.
+ *
+ * Each kernel works in place on the first argument array: x[i] = op(x[i], y[i], z[i]).
+ * Kernels exist for SSE4.1, AVX2 and AVX-512F; the widest one the running CPU supports
+ * is selected once, at first use. A null kernel means "no vector version", and the
+ * caller falls back to the scalar lambdas of try_dispatch_float_math_*.
+ *
+ * Accuracy: every vectorized kernel is bit-identical (0 ULP) to the scalar lambda it
+ * replaces, including the "safe" cases (divide by zero gives 0, sqrt of a negative
+ * gives 0, wrap/pingpong with an empty range, NaN propagation through min/max).
+ * They use the same IEEE single precision operations in the same order, and
+ * RADIANS/DEGREES multiply in double precision as DEG2RAD/RAD2DEG do. Operations that
+ * call into libm (sin, cos, tan, sinh, cosh, tanh, asin, acos, atan, atan2, exp, pow,
+ * log, mod) have no vector kernel, so batch and scalar results never diverge.
+ * This assumes the scalar code is not built with FMA contraction (-ffp-contract=off
+ * or no FMA target), otherwise MULTIPLY_ADD and friends may differ in the last bit.
+ */
+
+namespace blender {
+  namespace nodes {
+    typedef void (*MathKernel_fl_to_fl)(float *x, size_t count);
+    typedef void (*MathKernel_fl_fl_to_fl)(float *x, const float *y, size_t count);
+    typedef void (*MathKernel_fl_fl_fl_to_fl)(float *x, const float *y, const float *z, size_t count);
+
+    MathKernel_fl_to_fl get_math_kernel_fl_to_fl(const int operation);
+    MathKernel_fl_fl_to_fl get_math_kernel_fl_fl_to_fl(const int operation);
+    MathKernel_fl_fl_fl_to_fl get_math_kernel_fl_fl_fl_to_fl(const int operation);
+
+    /* Name of the instruction set the kernels were selected for: "avx512f", "avx2", "sse4.1" or "scalar". */
+    const char *get_math_kernel_isa();
+  }
+}
@@ -0,0 +1,271 @@
+/**
+ * Kernel bodies shared by every instruction set. This file is included once per
+ * instruction set by math_kernels.cpp, inside a namespace that defines `SIMD` (the
+ * vector wrapper) and with that instruction set enabled for code generation.
+ * Every expression mirrors the scalar lambda in math_functions.hh operation by
+ * operation, so the results are bit-identical.
+ * The kernel lambdas capture by reference although they use nothing: a lambda without
+ * captures also converts to a plain function pointer, and GCC warns (-Wpsabi) that
+ * such a function taking vectors is compiled without the instruction set enabled.
+ */
+
+typedef SIMD::V V;
+typedef SIMD::M M;
+
+template<typename Function>
+static inline void map_fl_to_fl(float *x, size_t count, Function function)
+{
+  size_t i = 0;
+  for (; i + SIMD::WIDTH <= count; i += SIMD::WIDTH) {
+    SIMD::store(x + i, function(SIMD::load(x + i)));
+  }
+  if (i < count) {
+    /* Run the tail through a padded copy so it takes exactly the same path as the body. */
+    float tx[SIMD::WIDTH] = {0};
+    copy(x + i, x + count, tx);
+    SIMD::store(tx, function(SIMD::load(tx)));
+    copy(tx, tx + (count - i), x + i);
+  }
+}
+
+template<typename Function>
+static inline void map_fl_fl_to_fl(float *x, const float *y, size_t count, Function function)
+{
+  size_t i = 0;
+  for (; i + SIMD::WIDTH <= count; i += SIMD::WIDTH) {
+    SIMD::store(x + i, function(SIMD::load(x + i), SIMD::load(y + i)));
+  }
+  if (i < count) {
+    float tx[SIMD::WIDTH] = {0}, ty[SIMD::WIDTH] = {0};
+    copy(x + i, x + count, tx);
+    copy(y + i, y + count, ty);
+    SIMD::store(tx, function(SIMD::load(tx), SIMD::load(ty)));
+    copy(tx, tx + (count - i), x + i);
+  }
+}
+
+template<typename Function>
+static inline void map_fl_fl_fl_to_fl(
+    float *x, const float *y, const float *z, size_t count, Function function)
+{
+  size_t i = 0;
+  for (; i + SIMD::WIDTH <= count; i += SIMD::WIDTH) {
+    SIMD::store(x + i, function(SIMD::load(x + i), SIMD::load(y + i), SIMD::load(z + i)));
+  }
+  if (i < count) {
+    float tx[SIMD::WIDTH] = {0}, ty[SIMD::WIDTH] = {0}, tz[SIMD::WIDTH] = {0};
+    copy(x + i, x + count, tx);
+    copy(y + i, y + count, ty);
+    copy(z + i, z + count, tz);
+    SIMD::store(tx, function(SIMD::load(tx), SIMD::load(ty), SIMD::load(tz)));
+    copy(tx, tx + (count - i), x + i);
+  }
+}
+
+static inline V fractv(V a)
+{
+  return SIMD::sub(a, SIMD::floor(a));
+}
+
+static inline V safe_dividev(V a, V b)
+{
+  return SIMD::select(SIMD::cmp_neq(b, SIMD::set1(0.0f)), SIMD::div(a, b), SIMD::set1(0.0f));
+}
+
+static inline V bool_to_floatv(M mask)
+{
+  return SIMD::select(mask, SIMD::set1(1.0f), SIMD::set1(0.0f));
+}
+
+/* min_ff(a, b) is (a < b) ? a : b, which is exactly what the min instructions compute. */
+static inline V min_ffv(V a, V b)
+{
+  return SIMD::min(a, b);
+}
+
+static inline V max_ffv(V a, V b)
+{
+  return SIMD::max(a, b);
+}
+
+static inline V smoothminv(V a, V b, V c)
+{
+  V h = SIMD::div(max_ffv(SIMD::sub(c, SIMD::abs(SIMD::sub(a, b))), SIMD::set1(0.0f)), c);
+  V smooth = SIMD::sub(
+      min_ffv(a, b),
+      SIMD::mul(SIMD::mul(SIMD::mul(SIMD::mul(h, h), h), c), SIMD::set1(1.0f / 6.0f)));
+  return SIMD::select(SIMD::cmp_neq(c, SIMD::set1(0.0f)), smooth, min_ffv(a, b));
+}
+
+static void kernel_absolute(float *x, size_t n) { map_fl_to_fl(x, n, [&](V a) { return SIMD::abs(a); }); }
+static void kernel_neg(float *x, size_t n) { map_fl_to_fl(x, n, [&](V a) { return SIMD::neg(a); }); }
+static void kernel_floor(float *x, size_t n) { map_fl_to_fl(x, n, [&](V a) { return SIMD::floor(a); }); }
+static void kernel_ceil(float *x, size_t n) { map_fl_to_fl(x, n, [&](V a) { return SIMD::ceil(a); }); }
+static void kernel_trunc(float *x, size_t n) { map_fl_to_fl(x, n, [&](V a) { return SIMD::trunc(a); }); }
+static void kernel_fraction(float *x, size_t n) { map_fl_to_fl(x, n, [&](V a) { return fractv(a); }); }
+
+static void kernel_round(float *x, size_t n)
+{
+  map_fl_to_fl(x, n, [&](V a) { return SIMD::floor(SIMD::add(a, SIMD::set1(0.5f))); });
+}
+
+static void kernel_sqrt(float *x, size_t n)
+{
+  /* MAX2(a, 0.0f) is (a > 0) ? a : 0, so NaN becomes 0 like the scalar version. */
+  map_fl_to_fl(x, n, [&](V a) { return SIMD::sqrt(SIMD::max(a, SIMD::set1(0.0f))); });
+}
+
+static void kernel_inv_sqrt(float *x, size_t n)
+{
+  map_fl_to_fl(x, n, [&](V a) {
+    return SIMD::select(SIMD::cmp_gt(a, SIMD::set1(0.0f)),
+                        SIMD::div(SIMD::set1(1.0f), SIMD::sqrt(a)),
+                        SIMD::set1(0.0f));
+  });
+}
+
+static void kernel_sign(float *x, size_t n)
+{
+  map_fl_to_fl(x, n, [&](V a) {
+    V zero = SIMD::set1(0.0f);
+    return SIMD::select(SIMD::cmp_gt(a, zero),
+                        SIMD::set1(1.0f),
+                        SIMD::select(SIMD::cmp_lt(a, zero), SIMD::set1(-1.0f), zero));
+  });
+}
+
+static void kernel_radians(float *x, size_t n)
+{
+  map_fl_to_fl(x, n, [&](V a) { return SIMD::mul_in_double(a, M_PI / 180.0); });
+}
+
+static void kernel_degrees(float *x, size_t n)
+{
+  map_fl_to_fl(x, n, [&](V a) { return SIMD::mul_in_double(a, 180.0 / M_PI); });
+}
+
+static void kernel_add(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return SIMD::add(a, b); });
+}
+
+static void kernel_subtract(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return SIMD::sub(a, b); });
+}
+
+static void kernel_multiply(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return SIMD::mul(a, b); });
+}
+
+static void kernel_divide(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return safe_dividev(a, b); });
+}
+
+/* std::min(a, b) is (b < a) ? b : a and std::max(a, b) is (a < b) ? b : a. */
+static void kernel_minimum(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return SIMD::min(b, a); });
+}
+
+static void kernel_maximum(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return SIMD::max(b, a); });
+}
+
+static void kernel_less_than(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return bool_to_floatv(SIMD::cmp_lt(a, b)); });
+}
+
+static void kernel_greater_than(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return bool_to_floatv(SIMD::cmp_gt(a, b)); });
+}
+
+static void kernel_snap(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V a, V b) { return SIMD::mul(SIMD::floor(safe_dividev(a, b)), b); });
+}
+
+static void kernel_pingpong(float *x, const float *y, size_t n)
+{
+  map_fl_fl_to_fl(x, y, n, [&](V value, V scale) {
+    V two = SIMD::set1(2.0f);
+    V fract = fractv(SIMD::div(SIMD::sub(value, scale), SIMD::mul(scale, two)));
+    V result = SIMD::abs(SIMD::sub(SIMD::mul(SIMD::mul(fract, scale), two), scale));
+    return SIMD::select(SIMD::cmp_eq(scale, SIMD::set1(0.0f)), SIMD::set1(0.0f), result);
+  });
+}
+
+static void kernel_multiply_add(float *x, const float *y, const float *z, size_t n)
+{
+  map_fl_fl_fl_to_fl(x, y, z, n, [&](V a, V b, V c) { return SIMD::add(SIMD::mul(a, b), c); });
+}
+
+static void kernel_compare(float *x, const float *y, const float *z, size_t n)
+{
+  map_fl_fl_fl_to_fl(x, y, z, n, [&](V a, V b, V c) {
+    /* fmaxf(c, FLT_EPSILON) ignores a NaN c, as does max with c as the first operand. */
+    M close = SIMD::cmp_le(SIMD::abs(SIMD::sub(a, b)), SIMD::max(c, SIMD::set1(FLT_EPSILON)));
+    return bool_to_floatv(SIMD::mask_or(SIMD::cmp_eq(a, b), close));
+  });
+}
+
+static void kernel_smooth_min(float *x, const float *y, const float *z, size_t n)
+{
+  map_fl_fl_fl_to_fl(x, y, z, n, [&](V a, V b, V c) { return smoothminv(a, b, c); });
+}
+
+static void kernel_smooth_max(float *x, const float *y, const float *z, size_t n)
+{
+  map_fl_fl_fl_to_fl(x, y, z, n, [&](V a, V b, V c) {
+    return SIMD::neg(smoothminv(SIMD::neg(a), SIMD::neg(b), SIMD::neg(c)));
+  });
+}
+
+static void kernel_wrap(float *x, const float *y, const float *z, size_t n)
+{
+  map_fl_fl_fl_to_fl(x, y, z, n, [&](V value, V max, V min) {
+    V range = SIMD::sub(max, min);
+    V wrapped = SIMD::sub(value, SIMD::mul(range, SIMD::floor(SIMD::div(SIMD::sub(value, min), range))));
+    return SIMD::select(SIMD::cmp_neq(range, SIMD::set1(0.0f)), wrapped, min);
+  });
+}
+
+static void fill_kernel_tables(MathKernel_fl_to_fl *fl_to_fl,
+                               MathKernel_fl_fl_to_fl *fl_fl_to_fl,
+                               MathKernel_fl_fl_fl_to_fl *fl_fl_fl_to_fl)
+{
+  fl_to_fl[NODE_MATH_ABSOLUTE] = kernel_absolute;
+  fl_to_fl[NODE_MATH_NEG] = kernel_neg;
+  fl_to_fl[NODE_MATH_FLOOR] = kernel_floor;
+  fl_to_fl[NODE_MATH_CEIL] = kernel_ceil;
+  fl_to_fl[NODE_MATH_TRUNC] = kernel_trunc;
+  fl_to_fl[NODE_MATH_FRACTION] = kernel_fraction;
+  fl_to_fl[NODE_MATH_ROUND] = kernel_round;
+  fl_to_fl[NODE_MATH_SQRT] = kernel_sqrt;
+  fl_to_fl[NODE_MATH_INV_SQRT] = kernel_inv_sqrt;
+  fl_to_fl[NODE_MATH_SIGN] = kernel_sign;
+  fl_to_fl[NODE_MATH_RADIANS] = kernel_radians;
+  fl_to_fl[NODE_MATH_DEGREES] = kernel_degrees;
+
+  fl_fl_to_fl[NODE_MATH_ADD] = kernel_add;
+  fl_fl_to_fl[NODE_MATH_SUBTRACT] = kernel_subtract;
+  fl_fl_to_fl[NODE_MATH_MULTIPLY] = kernel_multiply;
+  fl_fl_to_fl[NODE_MATH_DIVIDE] = kernel_divide;
+  fl_fl_to_fl[NODE_MATH_MINIMUM] = kernel_minimum;
+  fl_fl_to_fl[NODE_MATH_MAXIMUM] = kernel_maximum;
+  fl_fl_to_fl[NODE_MATH_LESS_THAN] = kernel_less_than;
+  fl_fl_to_fl[NODE_MATH_GREATER_THAN] = kernel_greater_than;
+  fl_fl_to_fl[NODE_MATH_SNAP] = kernel_snap;
+  fl_fl_to_fl[NODE_MATH_PINGPONG] = kernel_pingpong;
+
+  fl_fl_fl_to_fl[NODE_MATH_MULTIPLY_ADD] = kernel_multiply_add;
+  fl_fl_fl_to_fl[NODE_MATH_COMPARE] = kernel_compare;
+  fl_fl_fl_to_fl[NODE_MATH_SMOOTH_MIN] = kernel_smooth_min;
+  fl_fl_fl_to_fl[NODE_MATH_SMOOTH_MAX] = kernel_smooth_max;
+  fl_fl_fl_to_fl[NODE_MATH_WRAP] = kernel_wrap;
+}
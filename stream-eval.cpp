@@ -0,0 +1,144 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include "exprstream.hpp"
+#include "threadpool.hpp"
+
+using namespace std;
+
+/* Evaluates expressions over every row of a CSV or raw float file.
+
+   Usage: stream-eval [options] expression...
+     --input FILE          read FILE instead of standard input
+     --output FILE         write FILE instead of standard output
+     --format csv|raw      input format, csv by default
+     --output-format F     output format, the input format by default
+     --columns a,b,...     column names of raw input
+     --bind variable=column  read variable from a column of another name
+     --delimiter C         CSV field delimiter, ',' by default
+     --block-rows N        rows per block, which bounds memory use
+     --threads N           evaluate each block on N threads
+
+   An expression may be written name=expression to name its output column. */
+
+void print_usage(const char* program) {
+    cerr << "Usage: " << program << " [--input FILE] [--output FILE] [--format csv|raw]"
+         << " [--output-format csv|raw] [--columns a,b,...] [--bind variable=column]"
+         << " [--delimiter C] [--block-rows N] [--threads N] expression...\n";
+}
+
+vector<string> split(const string& text, char separator) {
+    vector<string> parts;
+    size_t begin = 0;
+    while (true) {
+        size_t end = text.find(separator, begin);
+        parts.push_back(text.substr(begin, end-begin));
+        if (end==string::npos) {
+            return parts;
+        }
+        begin = end+1;
+    }
+}
+
+int main(int argc, const char** argv) {
+    string input_path;
+    string output_path;
+    string format = "csv";
+    string output_format;
+    vector<string> raw_columns;
+    vector<pair<string, string>> bindings;
+    char delimiter = ',';
+    size_t block_rows = StreamEvaluator::DEFAULT_BLOCK_ROWS;
+    unsigned threads = 1;
+    vector<string> expressions;
+    for (int i=1; i<argc; i++) {
+        bool has_value = i+1<argc;
+        if (strncmp(argv[i], "--", 2)!=0) {
+            expressions.push_back(argv[i]);
+        } else if (strcmp(argv[i], "--input")==0 && has_value) {
+            input_path = argv[++i];
+        } else if (strcmp(argv[i], "--output")==0 && has_value) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--format")==0 && has_value) {
+            format = argv[++i];
+        } else if (strcmp(argv[i], "--output-format")==0 && has_value) {
+            output_format = argv[++i];
+        } else if (strcmp(argv[i], "--columns")==0 && has_value) {
+            raw_columns = split(argv[++i], ',');
+        } else if (strcmp(argv[i], "--bind")==0 && has_value) {
+            vector<string> binding = split(argv[++i], '=');
+            if (binding.size()!=2) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            bindings.push_back({binding[0], binding[1]});
+        } else if (strcmp(argv[i], "--delimiter")==0 && has_value && strlen(argv[i+1])==1) {
+            delimiter = argv[++i][0];
+        } else if (strcmp(argv[i], "--block-rows")==0 && has_value) {
+            block_rows = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--threads")==0 && has_value) {
+            threads = strtoul(argv[++i], nullptr, 10);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (output_format.empty()) {
+        output_format = format;
+    }
+    if (expressions.empty() || (format!="csv" && format!="raw") || (output_format!="csv" && output_format!="raw")) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    ios::sync_with_stdio(false);
+    ifstream input_file;
+    ofstream output_file;
+    if (!input_path.empty()) {
+        input_file.open(input_path, ios::binary);
+        if (!input_file) {
+            cerr << "Cannot open " << input_path << "\n";
+            return 1;
+        }
+    }
+    if (!output_path.empty()) {
+        output_file.open(output_path, ios::binary);
+        if (!output_file) {
+            cerr << "Cannot create " << output_path << "\n";
+            return 1;
+        }
+    }
+    istream& input = input_path.empty() ? cin : input_file;
+    ostream& output = output_path.empty() ? cout : output_file;
+
+    try {
+        unique_ptr<ThreadPool> pool;
+        if (threads!=1) {
+            pool = make_unique<ThreadPool>(threads);
+        }
+        StreamEvaluator evaluator(expressions, block_rows, pool.get());
+        for (const pair<string, string>& binding: bindings) {
+            evaluator.bind(binding.first, binding.second);
+        }
+        unique_ptr<TableReader> reader;
+        if (format=="csv") {
+            reader = make_unique<CsvReader>(input, delimiter);
+        } else {
+            reader = make_unique<RawReader>(input, raw_columns);
+        }
+        unique_ptr<TableWriter> writer;
+        if (output_format=="csv") {
+            writer = make_unique<CsvWriter>(output, delimiter);
+        } else {
+            writer = make_unique<RawWriter>(output);
+        }
+        evaluator.run(*reader, *writer);
+        output.flush();
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
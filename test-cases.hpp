@@ -0,0 +1,57 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+using namespace std;
+
+/* Expressions with their expected value under test_variables; shared by parse-test
+   and the benchmark corpus. */
+inline map<string, float> test_cases = {
+    {"A * (B + C)", 44},
+    {"A - B + C", 5},
+    {"A * B ^ C + D", 62508},
+    {"A * (B + C * D) + E", 221},
+    {"12+x-(03*y^5)", -77},
+    {"12+x-(30*y^5)", -941},
+    {"12+(x)-(3*y^5)", -77},
+    {"12+sin(x)  - (3*y^5)", -83.343018},
+    {"4+18/(9-3)", 7},
+    {"A * B + C", 26},
+    {"+A * B + C", 26},
+    {"A + B * C", 34},
+    {"A * (B + C * D) + +E", 221},
+    {"1.2E-1+sin(x) - (3*-y^5)", 96.776985},
+    {"(1.2E-1+sin(x)-2) - (3*-y^5)", 94.776985},
+    {"(1.2E-1+sin(x)/2) - (3*-y^5)", 96.448494},
+    {"(1.2E-1+sin(x)*2) - (3*-y^5)", 97.433975},
+    {"(1.2E-1+sin(x)^2) - (3*-y^5)", 96.551628},
+    {"(1.2E-1+sin(x)+2) - (3*-y^5)", 98.776985},
+    {"1.2E+1+sin(x) - (3*-y^5)", 108.65698},
+    {"1.2E1+sin(x) - (3*-y^5)", 108.65698},
+    {"1.002+sin(x) - (3*-y^5.0)", 97.658989},
+    {"(1+sin(pi))*2", 2},
+    {"(1+sin(pi))*2-cos(pi/2)", 2},
+    {"(1+sin(pi/2))*2-cos(pi/2)", 4},
+    {"(x*sin(x)-x)*y", -4.8021879},
+    {"(x*sin(x))*y", 9.1978121},
+    {"log(10,e)", 2.3025854},
+    {"log(10,e+1-1)", 2.3025854},
+    {"log(100,11-1)", 2},
+    {"log(pi^2,pi)", 2},
+    {"4+log(100,10)/2", 5},
+    {"x*1+0-0", 7},
+    {"--x^1/1", 7},
+    {"A*B+C*D", 68},
+    {"sin(x)*sin(x)+sin(x)*y", 1.7456045},
+};
+
+inline map<string, float> test_variables = {
+    {"A", 4}, 
+    {"B", 5},
+    {"C", 6},
+    {"D", 8},
+    {"E", 9},
+    {"x", 7},
+    {"y", 2}
+};
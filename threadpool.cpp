@@ -0,0 +1,142 @@
+#include <algorithm>
+
+#include "threadpool.hpp"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+static unsigned resolve_thread_count(unsigned thread_count) {
+    if (thread_count==0) {
+        thread_count = thread::hardware_concurrency();
+    }
+    return max(thread_count, 1u);
+}
+
+static void pin_thread(thread& worker_thread, unsigned cpu) {
+    unsigned cpu_count = max(thread::hardware_concurrency(), 1u);
+    cpu %= cpu_count;
+#if defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(worker_thread.native_handle(), sizeof(cpu_set_t), &cpus);
+#elif defined(_WIN32)
+    if (cpu < 64) {
+        SetThreadAffinityMask((HANDLE)worker_thread.native_handle(), (DWORD_PTR)1 << cpu);
+    }
+#endif
+}
+
+ThreadPool::ThreadPool(unsigned thread_count, bool pin_threads) : ranges(resolve_thread_count(thread_count)) {
+    for (unsigned worker=1; worker<ranges.size(); worker++) {
+        threads.emplace_back(&ThreadPool::worker_loop, this, worker);
+        if (pin_threads) {
+            pin_thread(threads.back(), worker);
+        }
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> state(state_lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (thread& worker_thread: threads) {
+        worker_thread.join();
+    }
+}
+
+unsigned ThreadPool::get_thread_count() const {
+    return ranges.size();
+}
+
+void ThreadPool::run(size_t count, const function<void(size_t)>& task) {
+    if (count==0) {
+        return;
+    }
+    lock_guard<mutex> running(run_lock);
+    size_t worker_count = ranges.size();
+    for (size_t worker=0; worker<worker_count; worker++) {
+        lock_guard<mutex> range(ranges[worker].lock);
+        ranges[worker].begin = count*worker/worker_count;
+        ranges[worker].end = count*(worker+1)/worker_count;
+    }
+    error = nullptr;
+    {
+        lock_guard<mutex> state(state_lock);
+        current_task = &task;
+        busy_workers = threads.size();
+        generation++;
+    }
+    work_ready.notify_all();
+    work(0);
+    {
+        unique_lock<mutex> state(state_lock);
+        work_done.wait(state, [&] { return busy_workers==0; });
+        current_task = nullptr;
+    }
+    if (error) {
+        rethrow_exception(error);
+    }
+}
+
+void ThreadPool::worker_loop(unsigned worker) {
+    size_t seen_generation = 0;
+    while (true) {
+        {
+            unique_lock<mutex> state(state_lock);
+            work_ready.wait(state, [&] { return stopping || generation!=seen_generation; });
+            if (stopping) {
+                return;
+            }
+            seen_generation = generation;
+        }
+        work(worker);
+        {
+            lock_guard<mutex> state(state_lock);
+            if (--busy_workers==0) {
+                work_done.notify_all();
+            }
+        }
+    }
+}
+
+void ThreadPool::work(unsigned worker) {
+    size_t task;
+    while (take(worker, task) || steal(worker, task)) {
+        try {
+            (*current_task)(task);
+        } catch (...) {
+            lock_guard<mutex> errors(error_lock);
+            if (!error) {
+                error = current_exception();
+            }
+        }
+    }
+}
+
+bool ThreadPool::take(unsigned worker, size_t& task) {
+    lock_guard<mutex> range(ranges[worker].lock);
+    if (ranges[worker].begin<ranges[worker].end) {
+        task = ranges[worker].begin++;
+        return true;
+    }
+    return false;
+}
+
+bool ThreadPool::steal(unsigned worker, size_t& task) {
+    for (size_t i=1; i<ranges.size(); i++) {
+        TaskRange& victim = ranges[(worker+i) % ranges.size()];
+        lock_guard<mutex> range(victim.lock);
+        if (victim.begin<victim.end) {
+            task = --victim.end;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Fixed set of worker threads for splitting one job into many small tasks.
+   run() numbers the tasks 0..count-1 and gives each thread one contiguous range
+   of them, so each thread keeps working on the same part of the data (and, with
+   first-touch allocation, on memory local to its NUMA node). A thread that runs
+   out of its own tasks steals from the far end of another thread's range.
+   The calling thread takes part as worker 0. One run() at a time; concurrent
+   callers wait for each other. */
+class ThreadPool {
+    public:
+    /* thread_count 0 means one per hardware thread. pin_threads binds the pool's own
+       thread for worker i to CPU i where the platform supports it, so its range
+       stays on one node; the calling thread's affinity is left alone. */
+    ThreadPool(unsigned thread_count = 0, bool pin_threads = false);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+    unsigned get_thread_count() const;
+    /* Calls task(i) once for every i in [0, count) and returns when all are done.
+       The first exception thrown by a task is rethrown here after the rest finish. */
+    void run(size_t count, const function<void(size_t)>& task);
+    private:
+    /* Remaining tasks [begin, end) of one worker: the owner takes from begin,
+       thieves from end. */
+    struct TaskRange {
+        mutex lock;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+    void worker_loop(unsigned worker);
+    void work(unsigned worker);
+    bool take(unsigned worker, size_t& task);
+    bool steal(unsigned worker, size_t& task);
+    vector<thread> threads;
+    vector<TaskRange> ranges;
+    mutex run_lock;
+    mutex state_lock;
+    condition_variable work_ready;
+    condition_variable work_done;
+    const function<void(size_t)>* current_task = nullptr;
+    size_t generation = 0;
+    unsigned busy_workers = 0;
+    bool stopping = false;
+    exception_ptr error;
+    mutex error_lock;
+};